@@ -92,6 +92,25 @@ This library provides the following functions;
 
 - qoy_decode  -- decode a QOY image from memory to an RGBA or YCbCrA buffer
 - qoy_encode  -- encode an RGBA or YCbCrA buffer into a QOY image in memory
+- qoy_encode_ex -- qoy_encode with options (effort, near-lossless)
+- qoy_encode_stats -- qoy_encode_ex that also counts the ops it emitted (QOY_STATS)
+- qoy_decode_stats -- qoy_decode that also counts the ops it read (QOY_STATS)
+
+- qoy_decode_header -- read the header of a QOY image in memory
+- qoy_tiles         -- number of independently coded tiles of an image
+- qoy_decode_tile   -- decode a single tile of a QOY image in memory
+- qoy_verify        -- check the checksums of a QOY image in memory
+- qoy_encode_damage -- encode a frame again, only the tiles that changed
+
+- qoy_decoder_open / qoy_decoder_lines / qoy_decoder_close
+                    -- decode a QOY stream two lines at a time
+- qoy_encoder_open / qoy_encoder_lines / qoy_encoder_close
+                    -- encode a QOY stream two lines at a time
+
+- qoy_encode_batch_bound / qoy_encode_batch
+                    -- encode many images into one buffer
+- qoy_decode_batch_size / qoy_decode_batch
+                    -- decode many images into one buffer
 
 - qoy_ycbcra_size     -- calculate size of YCbCrA buffer
 - qoy_rgba_to_ycbcra  -- convert buffer from RGBA to YCbCrA colorspace
@@ -103,9 +122,19 @@ See the function declaration below for the signature and more information.
 If you don't want/need the qoy_read and qoy_write functions, you can define
 QOY_NO_STDIO before including this library.
 
+On POSIX systems qoy_read decodes straight from a memory mapping of the file,
+and qoy_write encodes straight into one. Define QOY_NO_MMAP to use stdio
+instead. Strict ISO C modes (e.g. -std=c99 with glibc) hide the POSIX
+functions, define _POSIX_C_SOURCE as 200112L or later to use them there. With
+glibc, qoy_write only maps the file with _GNU_SOURCE defined, see there.
+
 This library uses malloc() and free(). To supply your own malloc implementation
 you can define QOY_MALLOC and QOY_FREE before including this library.
 
+The batch functions can spread a batch across threads with POSIX threads. To
+enable that, define QOY_THREADS in the file with the implementation and link
+with -pthread; otherwise batches are processed on the calling thread.
+
 
 -- Buffer formats
 
@@ -205,7 +234,8 @@ struct qoy_header_t {
     uint32_t width;      // image width in pixels (BE)
     uint32_t height;     // image height in pixels (BE)
     uint8_t  channels;   // 3 = without alpha, 4 = with alpha
-    uint8_t  colorspace; // 0 = sRGB with linear alpha, 1 = all channels linear (hint only)
+    uint8_t  colorspace; // bit 0: 0 = sRGB with linear alpha, 1 = all channels linear (hint only)
+                         // bits 1..7: format flags, see "Format flags" below
 };
 
 Images are encoded from top to bottom, left to right. The decoder and encoder 
@@ -232,7 +262,8 @@ Alpha values precede YCbCr values, this way, if there's no alpha tag present
 before an YCbCr tag, the decoder knows to repeat the previous alpha value.
 This also means a change of A interrupts and restarts a run of YCbCr repeats,
 otherwise the decoder would be unable to discern to which pixel in the run
-the new A value applies.
+the new A value applies. QOY_FLAG_ALPHA_RUN lets a block that only changes A
+skip the run op.
 
 Differences in Y (and A) values apply to the last horizontal pixel, not the
 last block: y[0] and y[1] compare to y[2] and y[3] of the last block,
@@ -445,7 +476,157 @@ End of file, decoder should never read this, logic should complete reading the
 byte before as all blocks should be processed at that point. Reading this tag
 is thus an error. The file is padded by 8 * QOY_OP_EOF, which makes it
 searchable, as this sequence is guaranteed to not occur naturally in the
-encoded pixel data.
+encoded pixel data. This holds for the ops only: with QOY_FLAG_LZ the
+compressed data can contain it, see there.
+
+
+-- Format flags
+
+Bits 1..7 of the colorspace byte in the header are flags that enable optional
+extensions of the format. A decoder must refuse a file with flags it does not
+know. Files without flags are encoded exactly as described above.
+
+
+.- QOY_FLAG_PREDICT (0x02) -------------------------------------------------.
+
+Each row pair starts with a single byte (not a tag) that selects the predictor
+that YCbCr differences and runs of that row pair are relative to. Alpha is not
+affected. A run never continues into the next row pair.
+
+0 = QOY_PRED_LEFT, the predictor described above:
+        y[0] from previous y[2], y[1] from previous y[3],
+        y[2] from current  y[0], y[3] from current  y[1],
+        cb and cr from previous cb and cr
+
+1 = QOY_PRED_UP, from the block above:
+        y[0] from above    y[1], y[1] from current  y[0],
+        y[2] from above    y[3], y[3] from current  y[2],
+        cb and cr from above cb and cr
+
+2 = QOY_PRED_MED, the median edge detector of LOCO-I, per value:
+        med(a, b, c) = min(a, b) if c >= max(a, b)
+                       max(a, b) if c <= min(a, b)
+                       a + b - c otherwise
+        y[0] = med(left y[2],    above y[1],   above-left y[3])
+        y[1] = med(left y[3],    current y[0], left y[2]      )
+        y[2] = med(current y[0], above y[3],   above y[1]     )
+        y[3] = med(current y[1], current y[2], current y[0]   )
+        cb   = med(left cb,      above cb,     above-left cb  )
+        cr   = med(left cr,      above cr,     above-left cr  )
+    where left is the previous block. For the first block of a row pair both
+    left and above-left are the block above.
+
+The first row pair must use QOY_PRED_LEFT. QOY_OP_888 stores full values
+regardless of predictor, and a run repeats a zero difference to the
+predictor, which for QOY_PRED_UP repeats the bottom line of the block above.
+
+
+.- QOY_FLAG_INDEX (0x04) ---------------------------------------------------.
+
+The decoder and encoder keep an array of 8 previously seen YCbCr values,
+zero-initialized. Every block coded by an op other than a run (including
+QOY_OP_INDEX) is stored in this array at:
+    index_position = (y[0] * 3 + y[1] * 5 + y[2] * 7 + y[3] * 11 + cb * 13 + cr * 17) % 8
+
+QOY_OP_INDEX takes the place of QOY_OP_865, which is not available with this
+flag. Blocks that would have used QOY_OP_865 use QOY_OP_888 instead.
+
+.- QOY_OP_INDEX ------------.
+|         Byte[0]         |
+| 7 6 5 4 3     2 1 0     |
+|-----------+-------------|
+| 1 1 1 1 0 |    index    |
+`-------------------------`
+5-bit tag b11110
+3-bit index into the array, y[0..3], cb and cr are copied from it
+
+Alpha is not part of the array, it is coded before QOY_OP_INDEX as usual.
+
+
+.- QOY_FLAG_LZ (0x08) ------------------------------------------------------.
+
+The chunks (all ops and predictor bytes, not the end marker) are compressed
+with a byte oriented LZ77 coder. The header is then followed by
+
+    uint32_t ops_size;   // size of the uncompressed chunks in bytes (BE)
+
+and the chunks, cut into segments of 65536 bytes (the last one may be
+shorter), each stored as
+
+    uint32_t length;     // bit 31: 1 = stored as-is, 0 = LZ
+                         // bits 0..30: size of the segment data in bytes (BE)
+    uint8_t  data[length & 0x7fffffff];
+
+followed by the 8-byte end marker. LZ segment data is the LZ4 block format: a
+series of sequences, each
+
+    token                // bits 4..7: number of literals
+                         // bits 0..3: match length - 4
+    [literal length]     // if the number of literals is 15: bytes added to
+                         // it, up to and including the first byte < 255
+    literals
+    uint16_t offset;     // LE, distance back from the current position, 1..
+    [match length]       // if the match length - 4 is 15: as above
+
+The last sequence of a segment ends after its literals. Matches may overlap
+the bytes they produce, but never reach into an earlier segment, so every
+segment decodes on its own. A segment of n bytes takes at most
+n + n / 255 + 16 bytes of LZ data, longer ones are invalid.
+
+Literals, lengths and offsets are arbitrary bytes, so the LZ data can contain
+8 * 0xff. The end marker of a file with this flag is found from the segment
+lengths, not by searching for it.
+
+
+.- QOY_FLAG_TILED (0x10) ---------------------------------------------------.
+
+The image is cut into tiles of 256x256 pixels in row-major order, the tiles in
+the right column and bottom row are cut off at the image edge. The header is
+then followed by
+
+    uint32_t tile_offset[tiles]; // start of the data of each tile (BE),
+                                 // relative to the end of this table, or of
+                                 // the checksums of QOY_FLAG_CRC after it
+
+Each tile is coded exactly as an image of its own with the size of the tile
+would be: from the initial previous block, with an empty index, with its own
+predictor bytes and, with QOY_FLAG_LZ, its own ops_size and segments. The data
+of every tile ends with the 8-byte end marker, for the last tile that is the
+end marker of the file. Tiles can thus be decoded independently and in any
+order.
+
+
+.- QOY_FLAG_ALPHA_RUN (0x20) -----------------------------------------------.
+
+An alpha op directly followed by another alpha op codes a block whose YCbCr
+values repeat, exactly as if a QOY_OP_RUN_1 stood between the two: a zero
+difference to the predictor, and no update of the QOY_FLAG_INDEX array. The
+second alpha op belongs to the next block. A row of blocks that only change
+A, like a soft shadow over a flat color, is thus coded as
+
+    [A][A][A]...[A][YCbCr op or run]
+
+instead of an alpha op and a QOY_OP_RUN_1 for every block. Without this flag
+an alpha op followed by an alpha op is invalid.
+
+
+.- QOY_FLAG_CRC (0x40) -----------------------------------------------------.
+
+The header, and the tile offsets of QOY_FLAG_TILED, are followed by
+
+    uint32_t crc[1 + tiles];     // checksums (BE), tiles is 1 without
+                                 // QOY_FLAG_TILED
+
+crc[0] is the checksum of all bytes before the checksums, the header and the
+tile offsets. crc[1 + i] is the checksum of the data of tile i, from its start
+up to and including its end marker; without QOY_FLAG_TILED that is all data
+after the checksums. Every tile can thus be verified on its own, as it is
+decoded, and corrupt data is refused instead of decoded to wrong pixels.
+
+The checksum is CRC32C, the CRC-32 with the Castagnoli polynomial 0x1edc6f41
+(0x82f63b78 bit-reversed), an initial value of 0xffffffff and a final XOR with
+0xffffffff, as used by iSCSI and ext4 and computed by the crc32 instruction of
+SSE4.2. The CRC32C of the ASCII string "123456789" is 0xe3069283.
 
 */
 
@@ -456,6 +637,8 @@ Header - Public functions */
 #ifndef QOY_H
 #define QOY_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -470,25 +653,62 @@ The colorspace in this qoy_desc is an enum where
     1 = all channels are linear
 You may use the constants QOY_COLORSPACE_SRGB or QOY_COLORSPACE_LINEAR. The
 colorspace is purely informative. It will be saved to the file header, but
-does not affect en-/decoding in any way. */
+does not affect en-/decoding in any way.
+
+The flags in this qoy_desc enable optional format extensions when encoding,
+and are filled with the extensions used by the file when decoding. Leave them
+at 0 to produce files that any QOY decoder can read.
+    QOY_FLAG_PREDICT = choose the best of several predictors per row pair,
+                       smaller files for vertical edges and gradients
+    QOY_FLAG_INDEX   = 1-byte references to recently seen blocks, smaller
+                       files for images that alternate between a few colors
+    QOY_FLAG_LZ      = LZ compress the encoded data, 20-60% smaller files
+                       for a fraction of the decode speed
+    QOY_FLAG_TILED   = code tiles of QOY_TILE_SIZE x QOY_TILE_SIZE pixels
+                       independently, see qoy_decode_tile
+    QOY_FLAG_ALPHA_RUN = blocks that only change alpha need no run op,
+                       smaller files for sprites with soft edges
+    QOY_FLAG_CRC     = CRC32C checksums of the header and every tile, checked
+                       by all decoders and by qoy_verify */
 
 #define QOY_COLORSPACE_SRGB   0
 #define QOY_COLORSPACE_LINEAR 1
 
+#define QOY_FLAG_PREDICT 0x02
+#define QOY_FLAG_INDEX   0x04
+#define QOY_FLAG_LZ      0x08
+#define QOY_FLAG_TILED   0x10
+#define QOY_FLAG_ALPHA_RUN 0x20
+#define QOY_FLAG_CRC     0x40
+
+#define QOY_TILE_SIZE 256
+
 typedef struct {
     unsigned int width;
     unsigned int height;
     unsigned char channels;
     unsigned char colorspace;
+    unsigned char flags;
 } qoy_desc;
 
 /* qoy_encode and qoy_decode can work with RGB(A) and YCbCr 4:2:0 (A) buffers.
 Internally they always use YCbCr 4:2:0 (A) buffers, with conversion from/to
 RGB(A) on-the-fly per every two lines of RGB(A). You need to tell the function
-the format of the buffer using these defines. */
+the format of the buffer using these defines.
+
+The decoders can also write packed 16-bit pixels in native byte order, for
+displays that take them as-is: QOY_FORMAT_RGB565 (r:5 g:6 b:5 from the most
+significant bit) and QOY_FORMAT_RGBA4444 (r:4 g:4 b:4 a:4). They are converted
+straight from the decoded row pairs, and out_channels is ignored for them.
+Values are rounded to the nearest level, or with QOY_FORMAT_DITHER or'ed in,
+dithered with a 4x4 ordered (Bayer) matrix, which hides the banding of flat
+gradients. These formats are not accepted by the encoders. */
 
 #define QOY_FORMAT_RGBA 0
 #define QOY_FORMAT_YCBCR420A 1
+#define QOY_FORMAT_RGB565 2
+#define QOY_FORMAT_RGBA4444 3
+#define QOY_FORMAT_DITHER 0x10
 
 #ifndef QOY_NO_STDIO
 
@@ -534,6 +754,110 @@ The returned qoy data should be free()d after use. */
 void *qoy_encode(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format);
 
 
+/* Encoder options for qoy_encode_ex. A zero-initialized struct gives the same
+result as qoy_encode.
+
+effort trades encode time for smaller files, decode speed is not affected:
+    QOY_EFFORT_FAST   = estimate the best predictor per row pair from a sample
+                        of its blocks (default)
+    QOY_EFFORT_BETTER = encode each row pair with every predictor and keep the
+                        smallest; about 3x the encode time with QOY_FLAG_PREDICT
+    QOY_EFFORT_BEST   = QOY_EFFORT_BETTER for every subset of desc->flags, keep
+                        the smallest file; up to 4x QOY_EFFORT_BETTER
+Predictors are only used when desc->flags has QOY_FLAG_PREDICT, and only the
+flags set in desc->flags are ever tried, so without flags all levels give the
+same result.
+
+max_error makes the encoder near-lossless: every decoded Y, Cb, Cr and A value
+is within max_error (0..255) of the encoded YCbCrA value, and values are moved
+within that range wherever it makes a block cheaper to code (runs, smaller
+diffs, index hits). 0 is lossless. The error is bound in YCbCrA, RGBA input
+adds the usual conversion error on top. Files decode with any QOY decoder.
+
+drop_opaque_alpha scans the alpha of 4 channel input first, and if it is 255
+everywhere encodes a 3 channel image (desc->channels 3 in the file header):
+no alpha ops are written or read, and the file is slightly smaller. Decoding
+with out_channels 4 still returns alpha, filled with 255. Only the whole image
+functions scan; the streaming encoder can't look ahead and ignores it. */
+
+#define QOY_EFFORT_FAST   0
+#define QOY_EFFORT_BETTER 1
+#define QOY_EFFORT_BEST   2
+
+typedef struct {
+    int effort;
+    int max_error;
+    int drop_opaque_alpha;
+} qoy_options;
+
+
+/* Same as qoy_encode, with options. options may be NULL for the defaults. */
+
+void *qoy_encode_ex(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format, const qoy_options *options);
+
+
+/* Encoder and decoder statistics: how often each op was emitted or read and
+the bytes spent on it (the chunks before QOY_FLAG_LZ compression), and a
+histogram of run lengths, where runs[i] counts the runs of 2^i to 2^(i+1)-1
+blocks. QOY_STAT_PRED counts the predictor bytes of QOY_FLAG_PREDICT.
+
+blocks counts all blocks, run_blocks those repeated by a run, literal_blocks
+those that needed a QOY_OP_888 or QOY_OP_A48 literal (or both) and alpha_ops
+the ops of all four QOY_OP_A* kinds. class_bits splits the bits of all ops
+by what they code: Y, CbCr, A, or anything else (tags, runs, index ops and
+predictors).
+
+qoy_encode_stats and qoy_decode_stats are only available with QOY_STATS
+defined before including this library; the op loops are not instrumented
+otherwise. With QOY_STATS the instrumented op loops are separate copies, so
+qoy_encode and qoy_decode run the same code as without it. */
+
+#define QOY_STAT_321    0
+#define QOY_STAT_433    1
+#define QOY_STAT_554    2
+#define QOY_STAT_666    3
+#define QOY_STAT_865    4
+#define QOY_STAT_888    5
+#define QOY_STAT_INDEX  6
+#define QOY_STAT_RUN_1  7
+#define QOY_STAT_RUN_X  8
+#define QOY_STAT_A18    9
+#define QOY_STAT_A42   10
+#define QOY_STAT_A44   11
+#define QOY_STAT_A48   12
+#define QOY_STAT_PRED  13
+#define QOY_STAT_COUNT 14
+
+#define QOY_STATS_RUN_BUCKETS 16
+
+#define QOY_CLASS_Y      0
+#define QOY_CLASS_CBCR   1
+#define QOY_CLASS_A      2
+#define QOY_CLASS_OTHER  3
+#define QOY_CLASS_COUNT  4
+
+typedef struct {
+    unsigned long long ops[QOY_STAT_COUNT];
+    unsigned long long bytes[QOY_STAT_COUNT];
+    unsigned long long runs[QOY_STATS_RUN_BUCKETS];
+    unsigned long long blocks;
+    unsigned long long run_blocks;
+    unsigned long long literal_blocks;
+    unsigned long long alpha_ops;
+    unsigned long long class_bits[QOY_CLASS_COUNT];
+} qoy_stats;
+
+#ifdef QOY_STATS
+/* Same as qoy_encode_ex, and fills stats for the encoded image */
+
+void *qoy_encode_stats(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format, const qoy_options *options, qoy_stats *stats);
+
+/* Same as qoy_decode, and fills stats for the decoded image */
+
+void *qoy_decode_stats(const void *data, int size, qoy_desc *desc, int out_channels, int out_format, qoy_stats *stats);
+#endif
+
+
 /* Decode a QOY image from memory.
 
 The function either returns NULL on failure (invalid parameters or malloc 
@@ -545,13 +869,195 @@ need not match desc->channels; must be 0 (use desc->channels), 3 (no alpha)
 or 4 (alpha).
 
 out_format specifies the buffer format of the returned data; QOY_FORMAT_RGBA
-to decode and convert to RGBA, or QOY_FORMAT_YCBCR420A to decode YCbCrA.
+to decode and convert to RGBA, QOY_FORMAT_YCBCR420A to decode YCbCrA, or one
+of the packed 16-bit formats, width*height*2 bytes.
 
 The returned pixel data should be free()d after use. */
 
 void *qoy_decode(const void *data, int size, qoy_desc *desc, int out_channels, int out_format);
 
 
+/* Read the header of a QOY image in memory into desc, without decoding it.
+
+Returns 1 on success or 0 on invalid data. */
+
+int qoy_decode_header(const void *data, int size, qoy_desc *desc);
+
+
+/* Number of tiles of an image, 1 if desc->flags does not have QOY_FLAG_TILED.
+Tile t covers the QOY_TILE_SIZE x QOY_TILE_SIZE pixels (fewer at the right and
+bottom edges) starting at column (t % tiles_x) * QOY_TILE_SIZE and line
+(t / tiles_x) * QOY_TILE_SIZE, where tiles_x is the number of tiles per row. */
+
+int qoy_tiles(const qoy_desc *desc);
+
+
+/* Decode a single tile of a QOY image in memory into its place in pixels,
+which must hold the whole decoded image as qoy_decode would return it. Other
+parts of pixels are not touched, so the tiles of an image may be decoded by
+several threads into the same buffer. out_channels and out_format are as for
+qoy_decode.
+
+Returns 1 on success or 0 on failure (invalid parameters or data, or malloc
+failed). */
+
+int qoy_decode_tile(const void *data, int size, int tile, void *pixels, int out_channels, int out_format);
+
+
+/* Check the QOY_FLAG_CRC checksums of a QOY image in memory without decoding
+it, e.g. after reading it from storage. The decoders check the checksums of
+the tiles they decode anyway, so this is only needed to check data that is
+stored or passed on as is.
+
+Returns 1 if the image has QOY_FLAG_CRC and all checksums match, 0 if it has
+no checksums, a checksum does not match or the data is invalid. */
+
+int qoy_verify(const void *data, int size);
+
+
+/* A rectangle of pixels, for qoy_encode_damage */
+typedef struct {
+    unsigned int x, y, width, height;
+} qoy_rect;
+
+
+/* Encode a frame that differs from the previous one only in parts, e.g. the
+next frame of a screen capture. prev is the encoded previous frame of prev_size
+bytes, data the new frame and rects the count rectangles in which they differ.
+in_channels and in_format are as for qoy_encode, options as for qoy_encode_ex
+and may be NULL.
+
+The tiles of QOY_FLAG_TILED are coded independently, so only the tiles that
+intersect a rectangle are encoded again and the data of all others is copied
+from prev; the encode time scales with the damaged area instead of the frame.
+Without QOY_FLAG_TILED the whole frame is encoded again. The new frame keeps
+the size, channels, colorspace and flags of prev, so QOY_EFFORT_BEST is
+treated as QOY_EFFORT_BETTER and drop_opaque_alpha is ignored.
+
+The function either returns NULL on failure (invalid parameters or data, or
+malloc failed) or a pointer to the new frame, with its size in out_len. The
+returned qoy data should be free()d after use. */
+
+void *qoy_encode_damage(const void *prev, int prev_size, const void *data, const qoy_rect *rects, int count, int *out_len, int in_channels, int in_format, const qoy_options *options);
+
+
+/* Batches of images, e.g. many small icons, for which the per call overhead of
+qoy_encode and qoy_decode (validation, mallocs and frees) would dominate. The
+images are written back to back into one caller supplied arena, image i at
+offset offsets[i] with offsets[count] the end of the last one, so offsets must
+have count + 1 entries. Working memory is allocated once per batch and thread,
+for the largest image, and reused for all images.
+
+threads > 1 spreads the batch across up to that many threads, each taking a
+contiguous range of the images. This requires QOY_THREADS, else the batch is
+processed on the calling thread. */
+
+/* Size of the arena qoy_encode_batch needs for count images described by
+descs, with in_channels and in_format as for qoy_encode (in_channels 0 uses the
+channels of each desc).
+
+Returns 0 if count is not positive or the parameters of any image are
+invalid. */
+
+size_t qoy_encode_batch_bound(int count, const qoy_desc *descs, int in_channels, int in_format);
+
+
+/* Encode count images, data[i] described by descs[i], into arena, which must
+have room for qoy_encode_batch_bound bytes. in_channels and in_format are as
+for qoy_encode_batch_bound, options as for qoy_encode_ex and may be NULL; they
+apply to all images. Threads encode their ranges at the offsets the bound
+leaves for them, the ranges are then moved together.
+
+Returns 0 on success or -1 on failure (invalid parameters or malloc failed). */
+
+int qoy_encode_batch(int count, const void *const *data, const qoy_desc *descs, int in_channels, int in_format, const qoy_options *options, void *arena, size_t *offsets, int threads);
+
+
+/* Size of the arena qoy_decode_batch needs for count QOY images, data[i] of
+sizes[i] bytes, decoded with out_channels and out_format as for qoy_decode.
+descs may be NULL, else it is filled with the headers of the images.
+
+Returns 0 if count is not positive, the parameters are invalid or the header
+of any image is. */
+
+size_t qoy_decode_batch_size(int count, const void *const *data, const int *sizes, qoy_desc *descs, int out_channels, int out_format);
+
+
+/* Decode count QOY images into arena, which must have room for
+qoy_decode_batch_size bytes. The pixels of image i are laid out as qoy_decode
+would return them.
+
+Returns 0 on success or -1 on failure (invalid parameters or data of any image,
+or malloc failed). On failure the contents of arena are undefined. */
+
+int qoy_decode_batch(int count, const void *const *data, const int *sizes, int out_channels, int out_format, void *arena, size_t *offsets, int threads);
+
+
+/* Streaming decoder and encoder. The data is read and written through
+callbacks, two lines (one row pair) at a time, so an image never has to be
+held in memory as a whole. The decoder keeps about a row pair of chunks and
+a row pair of pixels, or a row of tiles for QOY_FLAG_TILED.
+
+A qoy_read_fn reads up to size bytes into buffer and returns the number of
+bytes read, 0 at the end of the data or -1 on error. A qoy_write_fn writes
+size bytes from buffer and returns 0 on success or -1 on error. */
+
+typedef int (*qoy_read_fn)(void *user, void *buffer, int size);
+typedef int (*qoy_write_fn)(void *user, const void *buffer, int size);
+
+typedef struct qoy_decoder qoy_decoder;
+typedef struct qoy_encoder qoy_encoder;
+
+
+/* Read the header of a QOY stream into desc and set up a decoder for it.
+out_channels and out_format are as for qoy_decode.
+
+Returns NULL on failure (invalid parameters or data, read error or malloc
+failed). */
+
+qoy_decoder *qoy_decoder_open(qoy_read_fn read, void *user, qoy_desc *desc, int out_channels, int out_format);
+
+
+/* Decode the next two lines into pixels, which must have room for
+width*out_channels*2 bytes (QOY_FORMAT_RGBA), width*2*2 bytes (the packed
+formats) or qoy_ycbcra_size(width, 2, out_channels) bytes
+(QOY_FORMAT_YCBCR420A).
+
+Returns the number of lines decoded, 2 or 1 for the last line of an image with
+an odd height, 0 at the end of the image or -1 on failure (invalid data or read
+error). */
+
+int qoy_decoder_lines(qoy_decoder *decoder, void *pixels);
+
+void qoy_decoder_close(qoy_decoder *decoder);
+
+
+/* Write the header of a QOY stream and set up an encoder for it. in_channels
+and in_format are as for qoy_encode, options as for qoy_encode_ex and may be
+NULL. The chunks are written as they are encoded, so QOY_FLAG_LZ,
+QOY_FLAG_TILED, QOY_FLAG_CRC and QOY_EFFORT_BEST are not supported.
+
+Returns NULL on failure (invalid parameters or malloc failed). */
+
+qoy_encoder *qoy_encoder_open(qoy_write_fn write, void *user, const qoy_desc *desc, int in_channels, int in_format, const qoy_options *options);
+
+
+/* Encode the next two lines from pixels, laid out as for qoy_decoder_lines.
+Only the first line is read for the last line of an image with an odd height.
+
+Returns 0 on success or -1 on failure (write error or all lines encoded). */
+
+int qoy_encoder_lines(qoy_encoder *encoder, const void *pixels);
+
+
+/* Write the end marker and free the encoder.
+
+Returns the size of the encoded stream, or 0 on failure (write error or not
+all lines encoded). */
+
+int qoy_encoder_close(qoy_encoder *encoder);
+
+
 /* Calculate size of YCbCrA buffer, channels must be 3 (no alpha) or 4 (alpha) */
 
 int qoy_ycbcra_size(int width, int height, int channels);
@@ -613,6 +1119,8 @@ Implementation */
 #define QOY_OP_666      0xe0 /* 1110yyyy yyYYYYYY yyyyyyYY YYYYbbbb bbrrrrrr          y:4*6 cb:6 cr:6 --> 5 bytes */
 #define QOY_OP_865_MASK 0xf8 /* 11111...                                                                          */
 #define QOY_OP_865      0xf0 /* 11110yyy yyyyyYYY YYYYYyyy yyyyyYYY YYYYYbbb bbbrrrrr y:4*8 cb:6 cr:5 --> 6 bytes */
+#define QOY_OP_INDEX_MASK 0xf8 /* 11111...                                                                        */
+#define QOY_OP_INDEX    0xf0 /* 11110iii                          QOY_FLAG_INDEX only, replaces 865 --> 1 byte  */
 
 #define QOY_OP_A_MASK   0xfc /* 111111..                                                                          */
 #define QOY_OP_A_ANY    0xf8 /* 11111000                                                                          */
@@ -632,6 +1140,22 @@ Implementation */
 #define QOY_OP_EOF_MASK 0xff /* 11111111                                                                          */
 #define QOY_OP_EOF      0xff /* 11111111*8 cannot be produced by the encoder, *6 is the max using QOY_OP_888      */
 
+#define QOY_FLAGS_ALL   (QOY_FLAG_PREDICT | QOY_FLAG_INDEX | QOY_FLAG_LZ | QOY_FLAG_TILED | QOY_FLAG_ALPHA_RUN | QOY_FLAG_CRC)
+
+#define QOY_PRED_LEFT   0
+#define QOY_PRED_UP     1
+#define QOY_PRED_MED    2
+
+#define QOY_INDEX_SIZE  8
+
+#define QOY_LZ_SEGMENT    65536
+#define QOY_LZ_STORED     0x80000000
+#define QOY_LZ_MIN_MATCH  4
+#define QOY_LZ_HASH_BITS  12
+/* Worst case size of an LZ segment that is not worth storing as LZ */
+#define QOY_LZ_BOUND(n)   ((n) + (n) / 255 + 16)
+#define QOY_INDEX_HASH(px) (((px)->y[0] * 3 + (px)->y[1] * 5 + (px)->y[2] * 7 + (px)->y[3] * 11 + (px)->cb * 13 + (px)->cr * 17) % QOY_INDEX_SIZE)
+
 #define QOY_MAGIC \
     (((unsigned int)'q') << 24 | ((unsigned int)'o') << 16 | \
      ((unsigned int)'y') <<  8 | ((unsigned int)'f'))
@@ -682,12 +1206,13 @@ static inline unsigned char qoy_8bit_clamp(int i) {
     return i;
 }
 
-static inline int qoy_rgba_to_ycbcra_two_lines(const void* rgba_in, int width, int lines, int channels_in, int channels_out, void *ycbcr420a_out) {
+/* Convert two lines, stride is the distance in bytes between the lines */
+static inline int qoy_rgba_to_ycbcra_two_lines(const void* rgba_in, int width, int lines, int stride, int channels_in, int channels_out, void *ycbcr420a_out) {
     if (channels_in != 4) channels_in = 3;
     if (channels_out != 4) channels_out = 3;
     unsigned char *line1 = (unsigned char *)rgba_in;
-    unsigned char *line2 = lines == 2 ? line1 + width * channels_in : line1;
-    unsigned char *out = ycbcr420a_out;
+    unsigned char *line2 = lines == 2 ? line1 + stride : line1;
+    unsigned char *out = (unsigned char *)ycbcr420a_out;
     int size_out = (channels_out == 4) ? 10 : 6;
     int written = 0;
     for (int i = 0; i < width; i += 2, line1 += channels_in * 2, line2 += channels_in * 2, out += size_out) {
@@ -728,11 +1253,12 @@ int qoy_rgba_to_ycbcra(const void* rgba_in, int width, int height, int channels_
     unsigned char *pout = (unsigned char *)ycbcr420a_out;
     int size_out = (channels_out == 4) ? 10 : 6;
     int written = 0;
-    for (int y = 0; y < height; y += 2, pin += width * channels_in * 2, pout += size_out * (width >> 1)) {
+    for (int y = 0; y < height; y += 2, pin += width * channels_in * 2, pout += size_out * ((width + 1) >> 1)) {
         written += qoy_rgba_to_ycbcra_two_lines(
             pin,
             width,
             (height & 0x01) != 0 && y == height - 1 ? 1 : 2,
+            width * channels_in,
             channels_in,
             channels_out,
             pout
@@ -741,14 +1267,103 @@ int qoy_rgba_to_ycbcra(const void* rgba_in, int width, int height, int channels_
     return written;
 }
 
-static inline int qoy_ycbcra_to_rgba_two_lines(const void* ycbcr420a_in, int width, int lines, int channels_in, int channels_out, void *rgba_out) {
+/* Thresholds for QOY_FORMAT_DITHER: (2 * b + 1) * 255 / 32 for each b of the
+4x4 Bayer matrix, so the thresholds of a 4x4 area spread evenly over 0..254.
+Without dithering values round to the nearest level with 127. */
+static const unsigned char qoy_dither[4][4] = {
+    {  7, 135,  39, 167},
+    {199,  71, 231, 103},
+    { 55, 183,  23, 151},
+    {247, 119, 215,  87}
+};
+
+/* A value quantized to levels + 1 levels with threshold t is
+floor((v * levels + t) / 255), which for all v and t used here equals
+(v * levels * 257 + t * 257 + 128) >> 16. bias is t * 257 + 128. */
+static inline unsigned int qoy_quantize(int v, int levels, int bias) {
+    return (unsigned int)(qoy_8bit_clamp(v) * levels * 257 + bias) >> 16;
+}
+
+static inline __attribute__((__always_inline__)) void qoy_pack_pixel(unsigned char *out, int y, int r_diff, int g_diff, int b_diff, int a, int bias, int rgb565) {
+    unsigned short v;
+    if (rgb565) {
+        v = qoy_quantize(y + r_diff, 31, bias) << 11 | qoy_quantize(y - g_diff, 63, bias) << 5 | qoy_quantize(y + b_diff, 31, bias);
+    } else {
+        v = qoy_quantize(y + r_diff, 15, bias) << 12 | qoy_quantize(y - g_diff, 15, bias) << 8 | qoy_quantize(y + b_diff, 15, bias) << 4 | qoy_quantize(a, 15, bias);
+    }
+    memcpy(out, &v, 2);
+}
+
+/* Pack the four pixels of a block, bias1 and bias2 hold the biases of the
+block's columns on its two lines */
+static inline __attribute__((__always_inline__)) void qoy_pack_block(const qoy_ycbcr420a_t *pin, int alpha, unsigned char *p1, unsigned char *p2, unsigned char *p3, unsigned char *p4, const int *bias1, const int *bias2, int rgb565) {
+    int r_diff = (11760828 * (pin->cr - 128)) >> 23;
+    int g_diff = ((2886822 * (pin->cb - 128)) + (5990607 * (pin->cr - 128))) >> 23;
+    int b_diff = (14864613 * (pin->cb - 128)) >> 23;
+    qoy_pack_pixel(p1, pin->y[0], r_diff, g_diff, b_diff, alpha ? pin->a[0] : 255, bias1[0], rgb565);
+    qoy_pack_pixel(p2, pin->y[1], r_diff, g_diff, b_diff, alpha ? pin->a[1] : 255, bias2[0], rgb565);
+    qoy_pack_pixel(p3, pin->y[2], r_diff, g_diff, b_diff, alpha ? pin->a[2] : 255, bias1[1], rgb565);
+    qoy_pack_pixel(p4, pin->y[3], r_diff, g_diff, b_diff, alpha ? pin->a[3] : 255, bias2[1], rgb565);
+}
+
+/* Convert two lines to QOY_FORMAT_RGB565 or QOY_FORMAT_RGBA4444, y is the line
+of the first one (only its position in the dither matrix matters). rgb565 and
+alpha are passed as constants, so each combination gets its own loop. */
+static inline __attribute__((__always_inline__)) int qoy_ycbcra_to_packed_two_lines_with(const unsigned char *in, int width, int lines, int stride, int dither, int y, unsigned char *line1, int alpha, int rgb565) {
+    unsigned char *line2 = lines == 2 ? line1 + stride : line1;
+    int size_in = alpha ? 10 : 6;
+
+    /* The biases of the columns 0..3 of both lines, block i covers columns 2i
+    and 2i + 1. The second line of an odd height lands on the first, as for
+    RGBA, so it takes the biases of the first. */
+    int y2 = lines == 2 ? y + 1 : y;
+    int bias1[4], bias2[4];
+    for (int i = 0; i < 4; i++) {
+        bias1[i] = (dither ? qoy_dither[y & 3][i] : 127) * 257 + 128;
+        bias2[i] = (dither ? qoy_dither[y2 & 3][i] : 127) * 257 + 128;
+    }
+
+    int blocks = width >> 1;
+    for (int i = 0; i < blocks; i++, line1 += 4, line2 += 4, in += size_in) {
+        int c = (i & 1) * 2;
+        qoy_pack_block((const qoy_ycbcr420a_t *)in, alpha, line1, line2, line1 + 2, line2 + 2, bias1 + c, bias2 + c, rgb565);
+    }
+    /* The right column of the last block of an odd width lands on the left
+    one, as for RGBA */
+    if (width & 0x01) {
+        int c = (blocks & 1) * 2;
+        int last1[2] = {bias1[c], bias1[c]};
+        int last2[2] = {bias2[c], bias2[c]};
+        qoy_pack_block((const qoy_ycbcr420a_t *)in, alpha, line1, line2, line1, line2, last1, last2, rgb565);
+    }
+    return ((width + 1) >> 1) * 8;
+}
+
+static int qoy_ycbcra_to_packed_two_lines(const void* ycbcr420a_in, int width, int lines, int stride, int channels_in, int format, int y, void *packed_out) {
+    const unsigned char *in = (const unsigned char *)ycbcr420a_in;
+    unsigned char *out = (unsigned char *)packed_out;
+    int dither = (format & QOY_FORMAT_DITHER) != 0;
+    if ((format & ~QOY_FORMAT_DITHER) == QOY_FORMAT_RGB565) {
+        return qoy_ycbcra_to_packed_two_lines_with(in, width, lines, stride, dither, y, out, 0, 1);
+    } else if (channels_in == 4) {
+        return qoy_ycbcra_to_packed_two_lines_with(in, width, lines, stride, dither, y, out, 1, 0);
+    } else {
+        return qoy_ycbcra_to_packed_two_lines_with(in, width, lines, stride, dither, y, out, 0, 0);
+    }
+}
+
+/* Convert two lines to out_format, stride is the distance in bytes between the
+lines. y is the line of the first one, for QOY_FORMAT_DITHER. */
+static inline int qoy_ycbcra_to_rgba_two_lines(const void* ycbcr420a_in, int width, int lines, int stride, int channels_in, int channels_out, int out_format, int y, void *rgba_out) {
+    if (out_format != QOY_FORMAT_RGBA) {
+        return qoy_ycbcra_to_packed_two_lines(ycbcr420a_in, width, lines, stride, channels_in, out_format, y, rgba_out);
+    }
     unsigned char *line1 = (unsigned char *)rgba_out;
-    unsigned char *line2 = lines == 2 ? line1 + width * channels_out : line1;
+    unsigned char *line2 = lines == 2 ? line1 + stride : line1;
     unsigned char *in = (unsigned char *)ycbcr420a_in;
     int size_in = (channels_in == 4) ? 10 : 6;
     int written = 0;
     int r_diff, g_diff, b_diff;
-    int a[4];
     for (int i = 0; i < width; i += 2, line1 += channels_out * 2, line2 += channels_out * 2, in += size_in) {
         qoy_ycbcr420a_t *pin = (qoy_ycbcr420a_t *)in;
         qoy_rgba_t *p1 = (qoy_rgba_t *)line1;
@@ -800,438 +1415,3013 @@ int qoy_ycbcra_to_rgba(const void* ycbcr420a_in, int width, int height, int chan
     unsigned char *pin = (unsigned char *)ycbcr420a_in;
     int size_in = (channels_in == 4) ? 10 : 6;
     int written = 0;
-    for (int y = 0; y < height; y += 2, pout += width * channels_out * 2, pin += size_in * (width >> 1)) {
+    for (int y = 0; y < height; y += 2, pout += width * channels_out * 2, pin += size_in * ((width + 1) >> 1)) {
         written += qoy_ycbcra_to_rgba_two_lines(
             pin,
             width,
             (height & 0x01) != 0 && y == height - 1 ? 1 : 2,
+            width * channels_out,
             channels_in,
             channels_out,
+            QOY_FORMAT_RGBA,
+            y,
             pout
         );
     }
     return written;
 }
 
-void *qoy_encode(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format) {
-    int internal_width = (desc->width + 1) & ~0x01;
-    int internal_height = (desc->height + 1) & ~0x01;
+/* CRC32C of QOY_FLAG_CRC, one table lookup per byte where the CPU has no crc32
+instruction */
+static const unsigned int qoy_crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
 
-    if (in_channels == 0) in_channels = desc->channels;
-    if (
-        data == NULL || out_len == NULL || desc == NULL ||
-        desc->width == 0 || desc->height == 0 ||
-        desc->channels < 3 || desc->channels > 4 ||
-        in_channels < 3 || in_channels > 4 ||
-        desc->colorspace > 1 ||
-        internal_height >= QOY_PIXELS_MAX / internal_width ||
-        in_format > 1
-    ) {
-        return NULL;
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+
+/* 8 bytes per instruction; enabled per function, so the library needs no
+-msse4.2 and runs on CPUs without it */
+__attribute__((__target__("sse4.2")))
+static unsigned int qoy_crc32c_sse42(unsigned int crc, const unsigned char *bytes, int size) {
+#if defined(__x86_64__)
+    unsigned long long c = crc;
+    for (; size >= 8; size -= 8, bytes += 8) {
+        unsigned long long v;
+        memcpy(&v, bytes, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (unsigned int)c;
+#endif
+    for (; size >= 4; size -= 4, bytes += 4) {
+        unsigned int v;
+        memcpy(&v, bytes, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    for (; size > 0; size--) {
+        crc = _mm_crc32_u8(crc, *bytes++);
     }
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
-    int max_size = QOY_HEADER_SIZE + ((internal_width * internal_height + 3) >> 2) * (desc->channels == 4 ? 12 : 7) + (int)sizeof(qoy_padding);
+/* The CRC32C of size bytes, continuing from crc, which is 0 for the first
+bytes. Little endian loads feed the crc32 instructions, which process the
+lowest byte first. */
+static unsigned int qoy_crc32c(unsigned int crc, const unsigned char *bytes, int size) {
+    crc = ~crc;
+#if defined(__x86_64__) || defined(__i386__)
+#ifndef __SSE4_2__
+    if (__builtin_cpu_supports("sse4.2"))
+#endif
+    {
+        return ~qoy_crc32c_sse42(crc, bytes, size);
+    }
+#elif defined(__ARM_FEATURE_CRC32) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size >= 8; size -= 8, bytes += 8) {
+        unsigned long long v;
+        memcpy(&v, bytes, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; size > 0; size--) {
+        crc = __crc32cb(crc, *bytes++);
+    }
+    return ~crc;
+#endif
+    for (; size > 0; size--) {
+        crc = qoy_crc32c_table[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
-    unsigned char *bytes = (unsigned char *)QOY_MALLOC(max_size);
-    if (!bytes) {
-        return NULL;
+/* LZ compress a segment of at most QOY_LZ_SEGMENT bytes into out, which must
+hold QOY_LZ_BOUND(len) bytes. Greedy parsing with a single hash table entry per
+4-byte sequence; the search steps up on incompressible data. Returns the number
+of bytes written. */
+static int qoy_lz_length(unsigned char *out, int op, int n) {
+    for (n -= 15; n >= 255; n -= 255) {
+        out[op++] = 255;
     }
+    out[op++] = n;
+    return op;
+}
 
-    int p = 0;
-    qoy_write_32(bytes, &p, QOY_MAGIC);
-    qoy_write_32(bytes, &p, desc->width);
-    qoy_write_32(bytes, &p, desc->height);
-    bytes[p++] = desc->channels;
-    bytes[p++] = desc->colorspace;
+static int qoy_lz_compress(const unsigned char *in, int len, unsigned char *out) {
+    int table[1 << QOY_LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    int ip = 0, op = 0, anchor = 0;
+    while (ip + QOY_LZ_MIN_MATCH <= len) {
+        unsigned int seq, ref_seq;
+        memcpy(&seq, in + ip, 4);
+        unsigned int h = (seq * 2654435761u) >> (32 - QOY_LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || (memcpy(&ref_seq, in + ref, 4), ref_seq != seq)) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
 
-    const unsigned char *pixels = (const unsigned char *)data;
+        int match = QOY_LZ_MIN_MATCH;
+        while (ip + match < len && in[ref + match] == in[ip + match]) {
+            match++;
+        }
 
-    qoy_ycbcr420a_t px, px_prev = {0};
-    qoy_ycbcr420a_diff_t px_diff;
-    px_prev.a[0] = 255;
-    px_prev.a[1] = 255;
-    px_prev.a[2] = 255;
-    px_prev.a[3] = 255;
-
-    int run = 0;
-    int size_ycbcra = (in_channels == 4) ? 10 : 6;
-    unsigned char *buffer = (in_format != QOY_FORMAT_YCBCR420A) ? QOY_MALLOC(qoy_ycbcra_size(desc->width, desc->height, desc->channels)) : (unsigned char*)pixels;
-    for (int y = 0; y < internal_height; y += 2) {
-        if (in_format != QOY_FORMAT_YCBCR420A) {
-            qoy_rgba_to_ycbcra_two_lines(
-                pixels + y * desc->width * desc->channels,
-                desc->width,
-                desc->height != internal_height && y == desc->height - 1 ? 1 : 2,
-                in_channels,
-                desc->channels,
-                buffer
-            );
+        int literals = ip - anchor;
+        int offset = ip - ref;
+        out[op++] = (literals < 15 ? literals : 15) << 4 | (match - QOY_LZ_MIN_MATCH < 15 ? match - QOY_LZ_MIN_MATCH : 15);
+        if (literals >= 15) op = qoy_lz_length(out, op, literals);
+        memcpy(out + op, in + anchor, literals);
+        op += literals;
+        out[op++] = offset & 0xff;
+        out[op++] = offset >> 8;
+        if (match - QOY_LZ_MIN_MATCH >= 15) op = qoy_lz_length(out, op, match - QOY_LZ_MIN_MATCH);
+
+        ip += match;
+        anchor = ip;
+    }
+
+    int literals = len - anchor;
+    out[op++] = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) op = qoy_lz_length(out, op, literals);
+    memcpy(out + op, in + anchor, literals);
+    return op + literals;
+}
+
+/* Decompress an LZ segment into exactly out_len bytes. Returns 0 on success or
+-1 on invalid data. */
+static int qoy_lz_decompress(const unsigned char *in, int in_len, unsigned char *out, int out_len) {
+    int ip = 0, op = 0;
+    while (ip < in_len) {
+        int token = in[ip++];
+
+        int literals = token >> 4;
+        if (literals == 15) {
+            unsigned char b;
+            do {
+                if (ip >= in_len) return -1;
+                b = in[ip++];
+                literals += b;
+                /* Capped as it grows, so a long run of 255s cannot overflow */
+                if (literals > out_len - op) return -1;
+            } while (b == 255);
+        }
+        if (literals > in_len - ip || literals > out_len - op) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == in_len) {
+            break;
         }
-        unsigned char* px_base = buffer;
-        for (int x = 0; x < internal_width >> 1; x++, px_base += size_ycbcra) {
-            qoy_ycbcr420a_t *px = (qoy_ycbcr420a_t *)px_base;
-            px_diff.y[0] = px->y[0] - px_prev.y[2];
-            px_diff.y[1] = px->y[1] - px_prev.y[3];
-            px_diff.y[2] = px->y[2] - px->y[0];
-            px_diff.y[3] = px->y[3] - px->y[1];
-            px_diff.cb   = px->cb   - px_prev.cb;
-            px_diff.cr   = px->cr   - px_prev.cr;
-
-            int alpha_written = 0;
-            if (desc->channels == 4) {
-                alpha_written = 1;
-                if (px->a[0] == px->a[1] && px->a[0] == px->a[2] && px->a[0] == px->a[3]) {
-                    if (px->a[0] != px_prev.a[2]) {
-                        bytes[p++] = QOY_OP_A18;
-                        bytes[p++] = px->a[0];
-                    } else {
-                        alpha_written = 0;
-                    }
-                } else {
-                    px_diff.a[0] = px->a[0] - px_prev.a[2];
-                    px_diff.a[1] = px->a[1] - px_prev.a[3];
-                    px_diff.a[2] = px->a[2] - px->a[0];
-                    px_diff.a[3] = px->a[3] - px->a[1];
-
-                    int a_bits;
-
-                    signed char a_min = px_diff.a[0], a_max = px_diff.a[0];
-                    if (px_diff.a[1] < a_min) a_min = px_diff.a[1];
-                    if (px_diff.a[1] > a_max) a_max = px_diff.a[1];
-                    if (px_diff.a[2] < a_min) a_min = px_diff.a[2];
-                    if (px_diff.a[2] > a_max) a_max = px_diff.a[2];
-                    if (px_diff.a[3] < a_min) a_min = px_diff.a[3];
-                    if (px_diff.a[3] > a_max) a_max = px_diff.a[3];
-
-                  //if (a_min      >=  -1 && a_max      <  1) a_bits  = 1; else  UNUSED
-                    if (a_min      >=  -2 && a_max      <  2) a_bits  = 2; else
-                  //if (a_min      >=  -4 && a_max      <  4) a_bits  = 3; else  UNUSED
-                    if (a_min      >=  -8 && a_max      <  8) a_bits  = 4; else
-                  //if (a_min      >= -16 && a_max      < 16) a_bits  = 5; else  UNUSED
-                  //if (a_min      >= -32 && a_max      < 32) a_bits  = 6; else  UNUSED
-                  //if (a_min      >= -64 && a_max      < 64) a_bits  = 7; else  UNUSED
-                                                              a_bits  = 8;
-
-                    if        (a_bits <= 2) {
-                        bytes[p++] = QOY_OP_A42;
-                        bytes[p++] = (px_diff.a[0] + 2) << 6 | (px_diff.a[1] + 2) << 4 | (px_diff.a[2] + 2) << 2 | (px_diff.a[3] + 2);
-                    } else if (a_bits <= 4) {
-                        bytes[p++] = QOY_OP_A44;
-                        bytes[p++] = (px_diff.a[0] + 8) << 4 | (px_diff.a[1] + 8);
-                        bytes[p++] = (px_diff.a[2] + 8) << 4 | (px_diff.a[3] + 8);
-                    } else {
-                        bytes[p++] = QOY_OP_A48;
-                        bytes[p++] = px->a[0];
-                        bytes[p++] = px->a[1];
-                        bytes[p++] = px->a[2];
-                        bytes[p++] = px->a[3];
-                    }
-                }
-            }
 
-            if (px_diff.y[0] == 0 && px_diff.y[1] == 0 && px_diff.y[2] == 0 && px_diff.y[3] == 0 && px_diff.y[4] == 0 && px_diff.cb == 0 && px_diff.cr == 0) {
-                run++;
-                if (alpha_written || run == 32770) run = 1;
-                if (run == 1) {
-                    bytes[p++] = QOY_OP_RUN_1;
-                } else if (run == 2) {
-                    bytes[p-1] = QOY_OP_RUN_X;
-                    bytes[p++] = run - 2;
-                } else if (run < 130) {
-                    bytes[p-1] = run - 2;
-                } else {
-                    if (run == 130) p++;
-                    bytes[p-2] = 0x80 | (run - 130) >> 8;
-                    bytes[p-1] = (run - 130) & 0xFF;
-                }
-            } else {
-                run = 0;
-                int y_bits, cr_bits, cb_bits;
-
-                signed char y_min = px_diff.y[0], y_max = px_diff.y[0];
-                if (px_diff.y[1] < y_min) y_min = px_diff.y[1];
-                if (px_diff.y[1] > y_max) y_max = px_diff.y[1];
-                if (px_diff.y[2] < y_min) y_min = px_diff.y[2];
-                if (px_diff.y[2] > y_max) y_max = px_diff.y[2];
-                if (px_diff.y[3] < y_min) y_min = px_diff.y[3];
-                if (px_diff.y[3] > y_max) y_max = px_diff.y[3];
-
-              //if (y_min      >=  -1 && y_max      <  1) y_bits  = 1; else  UNUSED
-              //if (y_min      >=  -2 && y_max      <  2) y_bits  = 2; else  UNUSED
-                if (y_min      >=  -4 && y_max      <  4) y_bits  = 3; else
-                if (y_min      >=  -8 && y_max      <  8) y_bits  = 4; else
-                if (y_min      >= -16 && y_max      < 16) y_bits  = 5; else
-                if (y_min      >= -32 && y_max      < 32) y_bits  = 6; else
-              //if (y_min      >= -64 && y_max      < 64) y_bits  = 7; else  UNUSED
-                                                          y_bits  = 8;
-
-              //if (px_diff.cb >=  -1 && px_diff.cb <  1) cb_bits = 1; else  UNUSED
-                if (px_diff.cb >=  -2 && px_diff.cb <  2) cb_bits = 2; else
-                if (px_diff.cb >=  -4 && px_diff.cb <  4) cb_bits = 3; else
-              //if (px_diff.cb >=  -8 && px_diff.cb <  8) cb_bits = 4; else  UNUSED
-                if (px_diff.cb >= -16 && px_diff.cb < 16) cb_bits = 5; else
-                if (px_diff.cb >= -32 && px_diff.cb < 32) cb_bits = 6; else
-              //if (px_diff.cb >= -64 && px_diff.cb < 64) cb_bits = 7; else  UNUSED
-                                                          cb_bits = 8;
-
-                if (px_diff.cr >=  -1 && px_diff.cr <  1) cr_bits = 1; else
-              //if (px_diff.cr >=  -2 && px_diff.cr <  2) cr_bits = 2; else  UNUSED
-                if (px_diff.cr >=  -4 && px_diff.cr <  4) cr_bits = 3; else
-                if (px_diff.cr >=  -8 && px_diff.cr <  8) cr_bits = 4; else
-                if (px_diff.cr >= -16 && px_diff.cr < 16) cr_bits = 5; else
-                if (px_diff.cr >= -32 && px_diff.cr < 32) cr_bits = 6; else
-              //if (px_diff.cr >= -64 && px_diff.cr < 64) cr_bits = 7; else  UNUSED
-                                                          cr_bits = 8;
-
-                if      (y_bits <= 3 && cb_bits <= 2 && cr_bits <= 1) {
-                    bytes[p++] = QOY_OP_321 | (px_diff.y[0] + 4) << 4 | (px_diff.y[1] + 4) << 1 | (px_diff.y[2] + 4) >> 2;
-                    bytes[p++] = (px_diff.y[2] + 4) << 6 | (px_diff.y[3] + 4) << 3 | (px_diff.cb + 2) << 1 | (px_diff.cr + 1);
-                } else if (y_bits <= 4 && cb_bits <= 3 && cr_bits <= 3) {
-                    bytes[p++] = QOY_OP_433 | (px_diff.y[0] + 8) << 2 | (px_diff.y[1] + 8) >> 2;
-                    bytes[p++] = (px_diff.y[1] + 8) << 6 | (px_diff.y[2] + 8) << 2 | (px_diff.y[3] + 8) >> 2;
-                    bytes[p++] = (px_diff.y[3] + 8) << 6 | (px_diff.cb + 4) << 3 | (px_diff.cr + 4);
-                } else if (y_bits <= 5 && cb_bits <= 5 && cr_bits <= 4) {
-                    bytes[p++] = QOY_OP_554 | (px_diff.y[0] + 16);
-                    bytes[p++] = (px_diff.y[1] + 16) << 3 | (px_diff.y[2] + 16) >> 2;
-                    bytes[p++] = (px_diff.y[2] + 16) << 6 | (px_diff.y[3] + 16) << 1 | (px_diff.cb + 16) >> 4;
-                    bytes[p++] = (px_diff.cb + 16) << 4 | (px_diff.cr + 8);
-                } else if (y_bits <= 6 && cb_bits <= 6 && cr_bits <= 6) {
-                    bytes[p++] = QOY_OP_666 | (px_diff.y[0] + 32) >> 2;
-                    bytes[p++] = (px_diff.y[0] + 32) << 6 | (px_diff.y[1] + 32);
-                    bytes[p++] = (px_diff.y[2] + 32) << 2 | (px_diff.y[3] + 32) >> 4;
-                    bytes[p++] = (px_diff.y[3] + 32) << 4 | (px_diff.cb + 32) >> 2;
-                    bytes[p++] = (px_diff.cb + 32) << 6 | (px_diff.cr + 32);
-                } else if (y_bits <= 8 && cb_bits <= 6 && cr_bits <= 5) {
-                    bytes[p++] = QOY_OP_865 | (px_diff.y[0] + 128) >> 5;
-                    bytes[p++] = (px_diff.y[0] + 128) << 3 | (px_diff.y[1] + 128) >> 5;
-                    bytes[p++] = (px_diff.y[1] + 128) << 3 | (px_diff.y[2] + 128) >> 5;
-                    bytes[p++] = (px_diff.y[2] + 128) << 3 | (px_diff.y[3] + 128) >> 5;
-                    bytes[p++] = (px_diff.y[3] + 128) << 3 | (px_diff.cb + 32) >> 3;
-                    bytes[p++] = (px_diff.cb + 32) << 5 | (px_diff.cr + 16);
-                } else {
-                    bytes[p++] = QOY_OP_888;
-                    bytes[p++] = px->y[0];
-                    bytes[p++] = px->y[1];
-                    bytes[p++] = px->y[2];
-                    bytes[p++] = px->y[3];
-                    bytes[p++] = px->cb;
-                    bytes[p++] = px->cr;
-                }
-            }
+        if (in_len - ip < 2) {
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        int match = (token & 0x0f) + QOY_LZ_MIN_MATCH;
+        if ((token & 0x0f) == 15) {
+            unsigned char b;
+            do {
+                if (ip >= in_len) return -1;
+                b = in[ip++];
+                match += b;
+                if (match > out_len - op) return -1;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > op || match > out_len - op) {
+            return -1;
+        }
 
-            px_prev = *px;
+        const unsigned char *ref = out + op - offset;
+        if (offset >= match) {
+            memcpy(out + op, ref, match);
+        } else {
+            for (int i = 0; i < match; i++) {
+                out[op + i] = ref[i];
+            }
         }
-        if (in_format == QOY_FORMAT_YCBCR420A) buffer += size_ycbcra * (internal_width >> 1);
+        op += match;
     }
-    if (in_format != QOY_FORMAT_YCBCR420A) QOY_FREE(buffer);
+    return op == out_len ? 0 : -1;
+}
 
-    for (int i = 0; i < (int)sizeof(qoy_padding); i++) {
-        bytes[p++] = qoy_padding[i];
+/* Largest size the chunks of a width x height region (the whole image or a
+tile) can have, without end marker. A block takes at most 12 bytes (7 YCbCr +
+5 A), LZ segments at most QOY_LZ_BOUND of their size plus their length. */
+static int qoy_chunks_max(int width, int height, int channels, int flags) {
+    int internal_width = (width + 1) & ~0x01;
+    int internal_height = (height + 1) & ~0x01;
+    int size =
+        ((internal_width * internal_height) >> 2) * (channels == 4 ? 12 : 7) +
+        ((flags & QOY_FLAG_PREDICT) ? internal_height >> 1 : 0);
+    if (flags & QOY_FLAG_LZ) {
+        int segments = (size + QOY_LZ_SEGMENT - 1) / QOY_LZ_SEGMENT;
+        size = 4 + segments * 4 + QOY_LZ_BOUND(size) + segments * 16;
     }
+    return size;
+}
 
-    *out_len = p;
-    return bytes;
+/* Write ops_size bytes of chunks as LZ segments to bytes at p, which must have
+room for qoy_chunks_max of the region with QOY_FLAG_LZ. Returns the new write
+position. */
+static int qoy_lz_pack(const unsigned char *ops, int ops_size, unsigned char *bytes, int p) {
+    qoy_write_32(bytes, &p, ops_size);
+    for (int offset = 0; offset < ops_size; offset += QOY_LZ_SEGMENT) {
+        const unsigned char *segment = ops + offset;
+        int len = ops_size - offset < QOY_LZ_SEGMENT ? ops_size - offset : QOY_LZ_SEGMENT;
+        int lz_len = qoy_lz_compress(segment, len, bytes + p + 4);
+        if (lz_len < len) {
+            qoy_write_32(bytes, &p, lz_len);
+            p += lz_len;
+        } else {
+            qoy_write_32(bytes, &p, QOY_LZ_STORED | len);
+            memcpy(bytes + p, segment, len);
+            p += len;
+        }
+    }
+    return p;
 }
 
-void *qoy_decode(const void *data, int size, qoy_desc *desc, int out_channels, int out_format) {
-    if (
-        data == NULL || desc == NULL ||
-        size < QOY_HEADER_SIZE + (int)sizeof(qoy_padding)
-    ) {
+/* Decompress the LZ segments starting at p into buffer, or a new buffer if it
+is NULL, with the end marker appended. size is the end of the data including
+its end marker, ops_max the largest size the chunks can have for the image or
+tile; buffer must have room for that and the end marker. Returns the chunks,
+or NULL on invalid data or if malloc failed. */
+static unsigned char *qoy_lz_unpack(const unsigned char *bytes, int size, int p, int ops_max, int *ops_size, unsigned char *buffer) {
+    int end = size - (int)sizeof(qoy_padding);
+    if (end - p < 4) {
+        return NULL;
+    }
+    unsigned int total = qoy_read_32(bytes, &p);
+    if (total > (unsigned int)ops_max) {
         return NULL;
     }
 
-    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned char *ops = buffer ? buffer : (unsigned char *)QOY_MALLOC(total + sizeof(qoy_padding));
+    if (!ops) {
+        return NULL;
+    }
 
-    int p = 0;
-    unsigned int header_magic = qoy_read_32(bytes, &p);
-    desc->width = qoy_read_32(bytes, &p);
-    desc->height = qoy_read_32(bytes, &p);
-    desc->channels = bytes[p++];
-    desc->colorspace = bytes[p++];
-    if (out_channels == 0) out_channels = desc->channels;
+    for (int offset = 0; offset < (int)total; offset += QOY_LZ_SEGMENT) {
+        int len = (int)total - offset < QOY_LZ_SEGMENT ? (int)total - offset : QOY_LZ_SEGMENT;
+        if (end - p < 4) {
+            if (!buffer) QOY_FREE(ops);
+            return NULL;
+        }
+        unsigned int info = qoy_read_32(bytes, &p);
+        unsigned int data_len = info & ~QOY_LZ_STORED;
+        int error = data_len > (unsigned int)(end - p) || data_len > (unsigned int)QOY_LZ_BOUND(len);
+        if (!error && (info & QOY_LZ_STORED)) {
+            error = (int)data_len != len;
+            if (!error) memcpy(ops + offset, bytes + p, len);
+        } else if (!error) {
+            error = qoy_lz_decompress(bytes + p, data_len, ops + offset, len);
+        }
+        if (error) {
+            if (!buffer) QOY_FREE(ops);
+            return NULL;
+        }
+        p += data_len;
+    }
 
-    int internal_width = (desc->width + 1) & ~0x01;
-    int internal_height = (desc->height + 1) & ~0x01;
+    memcpy(ops + total, qoy_padding, sizeof(qoy_padding));
+    *ops_size = total;
+    return ops;
+}
 
-    if (
-        desc->width == 0 || desc->height == 0 ||
-        desc->channels < 3 || desc->channels > 4 ||
-        out_channels < 3 || out_channels > 4 ||
-        desc->colorspace > 1 ||
-        header_magic != QOY_MAGIC ||
-        internal_height >= QOY_PIXELS_MAX / internal_width ||
-        out_format > 1
-    ) {
-        return NULL;
-    }
+/* Median edge detector, written as median(a, b, a + b - c) so it compiles
+without branches */
+static inline unsigned char qoy_med(int a, int b, int c) {
+    int lo = a < b ? a : b;
+    int hi = a < b ? b : a;
+    int g = a + b - c;
+    return g < lo ? lo : g > hi ? hi : g;
+}
 
-    unsigned char *pixels = (unsigned char *)QOY_MALLOC(out_format == QOY_FORMAT_YCBCR420A ? qoy_ycbcra_size(desc->width, desc->height, out_channels) : desc->width * desc->height * out_channels);
-    if (!pixels) {
-        return NULL;
+/* Residual of block px against the prediction made by pred. l, u and ul are the
+left, up and up-left blocks; l is the previous block for QOY_PRED_LEFT. */
+static inline void qoy_residual(int pred, const qoy_ycbcr420a_t *px, const qoy_ycbcr420a_t *l, const qoy_ycbcr420a_t *u, const qoy_ycbcr420a_t *ul, qoy_ycbcr420a_diff_t *px_diff) {
+    if (pred == QOY_PRED_LEFT) {
+        px_diff->y[0] = px->y[0] - l->y[2];
+        px_diff->y[1] = px->y[1] - l->y[3];
+        px_diff->y[2] = px->y[2] - px->y[0];
+        px_diff->y[3] = px->y[3] - px->y[1];
+        px_diff->cb   = px->cb   - l->cb;
+        px_diff->cr   = px->cr   - l->cr;
+    } else if (pred == QOY_PRED_UP) {
+        px_diff->y[0] = px->y[0] - u->y[1];
+        px_diff->y[1] = px->y[1] - px->y[0];
+        px_diff->y[2] = px->y[2] - u->y[3];
+        px_diff->y[3] = px->y[3] - px->y[2];
+        px_diff->cb   = px->cb   - u->cb;
+        px_diff->cr   = px->cr   - u->cr;
+    } else {
+        px_diff->y[0] = px->y[0] - qoy_med(l->y[2], u->y[1], ul->y[3]);
+        px_diff->y[1] = px->y[1] - qoy_med(l->y[3], px->y[0], l->y[2]);
+        px_diff->y[2] = px->y[2] - qoy_med(px->y[0], u->y[3], u->y[1]);
+        px_diff->y[3] = px->y[3] - qoy_med(px->y[1], px->y[2], px->y[0]);
+        px_diff->cb   = px->cb   - qoy_med(l->cb, u->cb, ul->cb);
+        px_diff->cr   = px->cr   - qoy_med(l->cr, u->cr, ul->cr);
     }
+}
 
-    qoy_ycbcr420a_t px = {0};
-    px.a[0] = 255;
-    px.a[1] = 255;
-    px.a[2] = 255;
-    px.a[3] = 255;
+/* Rough size in bytes of the op needed for a residual, 0 for a run */
+static inline int qoy_residual_cost(const qoy_ycbcr420a_diff_t *px_diff) {
+    int m = abs(px_diff->y[0]) | abs(px_diff->y[1]) | abs(px_diff->y[2]) | abs(px_diff->y[3]) | abs(px_diff->cb) | abs(px_diff->cr);
+    if (m == 0) return 0;
+    if (m < 4) return 2;
+    if (m < 8) return 3;
+    if (m < 16) return 4;
+    if (m < 32) return 5;
+    return 7;
+}
 
-    int run = 0;
-    int size_ycbcra = (out_channels == 4) ? 10 : 6;
-    int chunks_len = size - (int)sizeof(qoy_padding);
-    unsigned char *buffer = (out_format != QOY_FORMAT_YCBCR420A) ? QOY_MALLOC(qoy_ycbcra_size(desc->width, desc->height, out_channels)) : (unsigned char *)pixels;
-    for (int y = 0; y < internal_height; y += 2) {
-        unsigned char *px_write = buffer;
-        for (int x = 0; x < internal_width >> 1; x++, px_write += size_ycbcra) {
-            if (run > 0) {
-                px.y[0] = px.y[2];
-                px.y[1] = px.y[3];
-                if (desc->channels == 4) {
-                    px.a[0] = px.a[2];
-                    px.a[1] = px.a[2];
-                    px.a[3] = px.a[2];
+/* Pick the predictor with the lowest estimated size for a row pair. Only every
+QOY_PREDICT_SAMPLE-th block is looked at, this is only an estimate, but it is
+much cheaper than trying all of them. */
+#define QOY_PREDICT_SAMPLE 4
+
+static int qoy_choose_predictor(const unsigned char *row, const unsigned char *row_up, int blocks, int stride, const qoy_ycbcr420a_t *px_prev) {
+    qoy_ycbcr420a_diff_t px_diff;
+    int cost[3] = { 0, 0, 0 };
+    for (int x = 0; x < blocks; x += QOY_PREDICT_SAMPLE) {
+        const qoy_ycbcr420a_t *px = (const qoy_ycbcr420a_t *)(row + x * stride);
+        const qoy_ycbcr420a_t *u = (const qoy_ycbcr420a_t *)(row_up + x * stride);
+        const qoy_ycbcr420a_t *l = x > 0 ? (const qoy_ycbcr420a_t *)(row + (x - 1) * stride) : px_prev;
+        const qoy_ycbcr420a_t *ul = x > 0 ? (const qoy_ycbcr420a_t *)(row_up + (x - 1) * stride) : u;
+        qoy_residual(QOY_PRED_LEFT, px, l, u, ul, &px_diff);
+        cost[QOY_PRED_LEFT] += qoy_residual_cost(&px_diff);
+        qoy_residual(QOY_PRED_UP, px, l, u, ul, &px_diff);
+        cost[QOY_PRED_UP] += qoy_residual_cost(&px_diff);
+        qoy_residual(QOY_PRED_MED, px, x > 0 ? l : u, u, ul, &px_diff);
+        cost[QOY_PRED_MED] += qoy_residual_cost(&px_diff);
+    }
+    int best = QOY_PRED_LEFT;
+    if (cost[QOY_PRED_UP] < cost[best]) best = QOY_PRED_UP;
+    if (cost[QOY_PRED_MED] < cost[best]) best = QOY_PRED_MED;
+    return best;
+}
+
+typedef struct {
+    qoy_ycbcr420a_t px_prev;
+    int alpha;
+    int indexed;
+    int alpha_run;
+    int run;
+    unsigned char index[QOY_INDEX_SIZE][6];
+#ifdef QOY_STATS
+    /* Kept by value, so trial encodes count into their own copy of the state
+    and only the chosen one is kept */
+    int stats_enabled;
+    qoy_stats stats;
+    unsigned long long literal_block;
+#endif
+} qoy_encode_state_t;
+
+#ifdef QOY_STATS
+/* A run of run blocks grew by one: a new QOY_OP_RUN_1, which becomes a
+QOY_OP_RUN_X at 2 and takes a third byte from 130 on */
+static void qoy_stats_run(qoy_stats *stats, int run) {
+    stats->run_blocks++;
+    if (run == 1) {
+        stats->ops[QOY_STAT_RUN_1]++;
+        stats->bytes[QOY_STAT_RUN_1]++;
+    } else if (run == 2) {
+        stats->ops[QOY_STAT_RUN_1]--;
+        stats->bytes[QOY_STAT_RUN_1]--;
+        stats->ops[QOY_STAT_RUN_X]++;
+        stats->bytes[QOY_STAT_RUN_X] += 2;
+    } else if (run == 130) {
+        stats->bytes[QOY_STAT_RUN_X]++;
+    }
+
+    /* The run moves to the next bucket at every power of two */
+    if ((run & (run - 1)) == 0) {
+        int bucket = 0;
+        while ((1 << (bucket + 1)) <= run) bucket++;
+        if (bucket > 0) stats->runs[bucket - 1]--;
+        stats->runs[bucket]++;
+    }
+}
+
+/* A QOY_OP_RUN_1 left out under QOY_FLAG_ALPHA_RUN: the block still counts as
+a run of one, but costs no op */
+static void qoy_stats_alpha_run(qoy_stats *stats) {
+    stats->ops[QOY_STAT_RUN_1]--;
+    stats->bytes[QOY_STAT_RUN_1]--;
+}
+
+/* A whole run of run blocks, as the decoder reads it */
+static void qoy_stats_run_length(qoy_stats *stats, int run) {
+    int bucket = 0;
+    while (bucket < QOY_STATS_RUN_BUCKETS - 1 && (2 << bucket) <= run) bucket++;
+    stats->runs[bucket]++;
+    stats->run_blocks += run;
+    if (run == 1) {
+        stats->ops[QOY_STAT_RUN_1]++;
+        stats->bytes[QOY_STAT_RUN_1]++;
+    } else {
+        stats->ops[QOY_STAT_RUN_X]++;
+        stats->bytes[QOY_STAT_RUN_X] += run < 130 ? 2 : 3;
+    }
+}
+
+static void qoy_stats_add(qoy_stats *total, const qoy_stats *stats) {
+    for (int i = 0; i < QOY_STAT_COUNT; i++) {
+        total->ops[i] += stats->ops[i];
+        total->bytes[i] += stats->bytes[i];
+    }
+    for (int i = 0; i < QOY_STATS_RUN_BUCKETS; i++) {
+        total->runs[i] += stats->runs[i];
+    }
+    total->blocks += stats->blocks;
+    total->run_blocks += stats->run_blocks;
+    total->literal_blocks += stats->literal_blocks;
+}
+
+/* Fill in the totals that follow from the op counts */
+static void qoy_stats_finish(qoy_stats *stats) {
+    /* Bits of Y, CbCr and A in every op; the rest of its bytes are tag */
+    static const unsigned char class_bits[QOY_STAT_COUNT][3] = {
+        {12, 3, 0}, {16, 6, 0}, {20, 9, 0}, {24, 12, 0}, {32, 11, 0}, {32, 16, 0},
+        {0, 0, 0}, {0, 0, 0}, {0, 0, 0},
+        {0, 0, 8}, {0, 0, 8}, {0, 0, 16}, {0, 0, 32},
+        {0, 0, 0}
+    };
+    memset(stats->class_bits, 0, sizeof(stats->class_bits));
+    for (int i = 0; i < QOY_STAT_COUNT; i++) {
+        unsigned long long bits = stats->bytes[i] * 8;
+        for (int c = 0; c < 3; c++) {
+            stats->class_bits[c] += stats->ops[i] * class_bits[i][c];
+            bits -= stats->ops[i] * class_bits[i][c];
+        }
+        stats->class_bits[QOY_CLASS_OTHER] += bits;
+    }
+    stats->alpha_ops = stats->ops[QOY_STAT_A18] + stats->ops[QOY_STAT_A42] + stats->ops[QOY_STAT_A44] + stats->ops[QOY_STAT_A48];
+}
+
+/* These take an encode or decode state and whether stats are counted. The op
+loops get the latter as a constant, so their variants without stats have no
+trace of them */
+#define QOY_STAT(s, on, op, len) do { if (on) { (s)->stats.ops[op]++; (s)->stats.bytes[op] += (len); } } while (0)
+#define QOY_STAT_RUN(s, on, run) do { if (on) qoy_stats_run(&(s)->stats, run); } while (0)
+#define QOY_STAT_RUN_LENGTH(s, on, run) do { if (on) qoy_stats_run_length(&(s)->stats, run); } while (0)
+#define QOY_STAT_ALPHA_RUN(s, on) do { if (on) qoy_stats_alpha_run(&(s)->stats); } while (0)
+#define QOY_STAT_BLOCK(s, on) do { if (on) (s)->stats.blocks++; } while (0)
+#define QOY_STAT_LITERAL(s, on) do { \
+        if ((on) && (s)->literal_block != (s)->stats.blocks) { \
+            (s)->stats.literal_blocks++; \
+            (s)->literal_block = (s)->stats.blocks; \
+        } \
+    } while (0)
+#else
+#define QOY_STAT(s, on, op, len) do {} while (0)
+#define QOY_STAT_RUN(s, on, run) do {} while (0)
+#define QOY_STAT_RUN_LENGTH(s, on, run) do {} while (0)
+#define QOY_STAT_ALPHA_RUN(s, on) do {} while (0)
+#define QOY_STAT_BLOCK(s, on) do {} while (0)
+#define QOY_STAT_LITERAL(s, on) do {} while (0)
+#endif
+
+/* The value within max_error of v that is closest to pred, in terms of the
+8-bit wrapping residual the ops code */
+static inline unsigned char qoy_snap(int v, int pred, int max_error) {
+    int lo = v - max_error < 0 ? 0 : v - max_error;
+    int hi = v + max_error > 255 ? 255 : v + max_error;
+    if (pred >= lo && pred <= hi) {
+        return pred;
+    }
+    return abs((signed char)(lo - pred)) <= abs((signed char)(hi - pred)) ? lo : hi;
+}
+
+static inline int qoy_within(const unsigned char *a, const unsigned char *b, int n, int max_error) {
+    for (int i = 0; i < n; i++) {
+        if (abs(a[i] - b[i]) > max_error) return 0;
+    }
+    return 1;
+}
+
+/* Near-lossless: move every block of a row pair, in place, to the values within
+max_error that are cheapest to code with the given predictor. The encoder then
+codes the row pair losslessly, so the row pair holds exactly what the decoder
+will reconstruct, and is used as row_up for the next row pair. s is the state
+the row pair will be encoded with, it is not modified. */
+static void qoy_snap_row_pair(const qoy_encode_state_t *s, unsigned char *row, const unsigned char *row_up, int blocks, int stride, int pred, int max_error) {
+    qoy_ycbcr420a_t l = s->px_prev;
+    unsigned char index[QOY_INDEX_SIZE][6];
+    memcpy(index, s->index, sizeof(index));
+
+    for (int x = 0; x < blocks; x++, row += stride, row_up += stride) {
+        qoy_ycbcr420a_t *px = (qoy_ycbcr420a_t *)row;
+        const qoy_ycbcr420a_t *u = (const qoy_ycbcr420a_t *)row_up;
+        const qoy_ycbcr420a_t *ul = x > 0 ? (const qoy_ycbcr420a_t *)(row_up - stride) : u;
+        unsigned char original[6];
+        memcpy(original, px, 6);
+
+        /* Each value is predicted from already snapped values, in the same
+        order as the decoder reconstructs them */
+        int zero = 1;
+        unsigned char v;
+        if (pred == QOY_PRED_LEFT) {
+            v = l.y[2];                                     zero &= (px->y[0] = qoy_snap(px->y[0], v, max_error)) == v;
+            v = l.y[3];                                     zero &= (px->y[1] = qoy_snap(px->y[1], v, max_error)) == v;
+            v = px->y[0];                                   zero &= (px->y[2] = qoy_snap(px->y[2], v, max_error)) == v;
+            v = px->y[1];                                   zero &= (px->y[3] = qoy_snap(px->y[3], v, max_error)) == v;
+            v = l.cb;                                       zero &= (px->cb   = qoy_snap(px->cb,   v, max_error)) == v;
+            v = l.cr;                                       zero &= (px->cr   = qoy_snap(px->cr,   v, max_error)) == v;
+        } else if (pred == QOY_PRED_UP) {
+            v = u->y[1];                                    zero &= (px->y[0] = qoy_snap(px->y[0], v, max_error)) == v;
+            v = px->y[0];                                   zero &= (px->y[1] = qoy_snap(px->y[1], v, max_error)) == v;
+            v = u->y[3];                                    zero &= (px->y[2] = qoy_snap(px->y[2], v, max_error)) == v;
+            v = px->y[2];                                   zero &= (px->y[3] = qoy_snap(px->y[3], v, max_error)) == v;
+            v = u->cb;                                      zero &= (px->cb   = qoy_snap(px->cb,   v, max_error)) == v;
+            v = u->cr;                                      zero &= (px->cr   = qoy_snap(px->cr,   v, max_error)) == v;
+        } else {
+            const qoy_ycbcr420a_t *left = x > 0 ? &l : u;
+            v = qoy_med(left->y[2], u->y[1], ul->y[3]);     zero &= (px->y[0] = qoy_snap(px->y[0], v, max_error)) == v;
+            v = qoy_med(left->y[3], px->y[0], left->y[2]);  zero &= (px->y[1] = qoy_snap(px->y[1], v, max_error)) == v;
+            v = qoy_med(px->y[0], u->y[3], u->y[1]);        zero &= (px->y[2] = qoy_snap(px->y[2], v, max_error)) == v;
+            v = qoy_med(px->y[1], px->y[2], px->y[0]);      zero &= (px->y[3] = qoy_snap(px->y[3], v, max_error)) == v;
+            v = qoy_med(left->cb, u->cb, ul->cb);           zero &= (px->cb   = qoy_snap(px->cb,   v, max_error)) == v;
+            v = qoy_med(left->cr, u->cr, ul->cr);           zero &= (px->cr   = qoy_snap(px->cr,   v, max_error)) == v;
+        }
+
+        /* Anything but a run costs at least 2 bytes, an index hit costs 1. The
+        entry in slot i always hashes to i, so the encoder will find it. */
+        if (!zero && s->indexed) {
+            for (int i = 0; i < QOY_INDEX_SIZE; i++) {
+                if (qoy_within(index[i], original, 6, max_error)) {
+                    memcpy(px, index[i], 6);
+                    break;
                 }
-                run--;
+            }
+        }
+        if (!zero && s->indexed) {
+            memcpy(index[QOY_INDEX_HASH(px)], px, 6);
+        }
+
+        if (s->alpha) {
+            int a_min = px->a[0], a_max = px->a[0];
+            for (int i = 1; i < 4; i++) {
+                if (px->a[i] < a_min) a_min = px->a[i];
+                if (px->a[i] > a_max) a_max = px->a[i];
+            }
+            if (a_max - max_error <= l.a[2] && a_min + max_error >= l.a[2]) {
+                /* no alpha op */
+                px->a[0] = px->a[1] = px->a[2] = px->a[3] = l.a[2];
+            } else if (a_max - a_min <= 2 * max_error) {
+                /* QOY_OP_A18 */
+                px->a[0] = px->a[1] = px->a[2] = px->a[3] = (a_min + a_max + 1) >> 1;
             } else {
-                if (p >= chunks_len) {
-                    QOY_FREE(pixels);
-                    return NULL;
-                }
+                px->a[0] = qoy_snap(px->a[0], l.a[2], max_error);
+                px->a[1] = qoy_snap(px->a[1], l.a[3], max_error);
+                px->a[2] = qoy_snap(px->a[2], px->a[0], max_error);
+                px->a[3] = qoy_snap(px->a[3], px->a[1], max_error);
+            }
+            l = *px;
+        } else {
+            memcpy(&l, px, 6);
+        }
+    }
+}
 
-                unsigned char b1 = bytes[p++];
-                if (desc->channels == 4 && run == 0) {
-                    if ((b1 & QOY_OP_A_MASK) == QOY_OP_A_ANY) {
-                        if        (b1 == QOY_OP_A18) {
-                            px.a[0] = bytes[p++];
-                            px.a[1] = px.a[0];
-                            px.a[2] = px.a[0];
-                            px.a[3] = px.a[0];
-                        } else if (b1 == QOY_OP_A42) {
-                            unsigned char b2 = bytes[p++];
-                            px.a[0] = px.a[2] + ((b2 >> 6) & 0x03) - 2;
-                            px.a[1] = px.a[3] + ((b2 >> 4) & 0x03) - 2;
-                            px.a[2] = px.a[0] + ((b2 >> 2) & 0x03) - 2;
-                            px.a[3] = px.a[1] +  (b2 & 0x03) - 2;
-                        } else if (b1 == QOY_OP_A44) {
-                            unsigned char b2 = bytes[p++];
-                            unsigned char b3 = bytes[p++];
-                            px.a[0] = px.a[2] + ((b2 >> 4) & 0x0F) - 8;
-                            px.a[1] = px.a[3] +  (b2 & 0x0F) - 8;
-                            px.a[2] = px.a[0] + ((b3 >> 4) & 0x0F) - 8;
-                            px.a[3] = px.a[1] +  (b3 & 0x0F) - 8;
-                        } else if (b1 == QOY_OP_A48) {
-                            px.a[0] = bytes[p++];
-                            px.a[1] = bytes[p++];
-                            px.a[2] = bytes[p++];
-                            px.a[3] = bytes[p++];
-                        }
-                        b1 = bytes[p++];
-                    } else {
-                        px.a[0] = px.a[2];
-                        px.a[1] = px.a[2];
-                        px.a[3] = px.a[2];
-                    }
-                }
+/* Encode a row pair of blocks with the given predictor. row_up is the row pair
+above, it is only read if pred is not QOY_PRED_LEFT. Returns the new write
+position in bytes.
 
-                if        ((b1 & QOY_OP_EOF_MASK) == QOY_OP_EOF) {
-                    QOY_FREE(pixels);
-                    return NULL;
-                } else if ((b1 & QOY_OP_RUN_MASK) == QOY_OP_RUN_1) {
-                    px.y[0] = px.y[2];
-                    px.y[1] = px.y[3];
-                } else if ((b1 & QOY_OP_RUN_MASK) == QOY_OP_RUN_X) {
-                    px.y[0] = px.y[2];
-                    px.y[1] = px.y[3];
-                    unsigned char b2 = bytes[p++];
-                    if (b2 < 128) {
-                        run = b2 + 2 - 1;
-                    } else {
-                        unsigned char b3 = bytes[p++];
-                        run = ((b2 & 0x7F) << 8 | b3) + 130 - 1;
-                    }
-                } else if ((b1 & QOY_OP_888_MASK) == QOY_OP_888) {
-                    px.y[0] = bytes[p++];
-                    px.y[1] = bytes[p++];
-                    px.y[2] = bytes[p++];
-                    px.y[3] = bytes[p++];
-                    px.cb   = bytes[p++];
-                    px.cr   = bytes[p++];
-                } else if ((b1 & QOY_OP_321_MASK) == QOY_OP_321) {
-                    unsigned char b2 = bytes[p++];
-                    px.y[0] = px.y[2] + ((b1 >> 4) & 0x07) - 4;
-                    px.y[1] = px.y[3] + ((b1 >> 1) & 0x07) - 4;
-                    px.y[2] = px.y[0] + ((b1 & 0x01) << 2) + ((b2 >> 6) & 0x03) - 4;
-                    px.y[3] = px.y[1] + ((b2 >> 3) & 0x07) - 4;
-                    px.cb   = px.cb   + ((b2 >> 1) & 0x03) - 2;
-                    px.cr   = px.cr   +  (b2 & 0x01) - 1;
-                } else if ((b1 & QOY_OP_433_MASK) == QOY_OP_433) {
-                    unsigned char b2 = bytes[p++];
-                    unsigned char b3 = bytes[p++];
-                    px.y[0] = px.y[2] + ((b1 >> 2) & 0x0F) - 8;
-                    px.y[1] = px.y[3] + ((b1 & 0x03) << 2) + ((b2 >> 6) & 0x03) - 8;
-                    px.y[2] = px.y[0] + ((b2 >> 2) & 0x0F) - 8;
-                    px.y[3] = px.y[1] + ((b2 & 0x03) << 2) + ((b3 >> 6) & 0x03) - 8;
-                    px.cb   = px.cb   + ((b3 >> 3) & 0x07) - 4;
-                    px.cr   = px.cr   +  (b3 & 0x07) - 4;
-                } else if ((b1 & QOY_OP_554_MASK) == QOY_OP_554) {
-                    unsigned char b2 = bytes[p++];
-                    unsigned char b3 = bytes[p++];
-                    unsigned char b4 = bytes[p++];
-                    px.y[0] = px.y[2] +  (b1 & 0x1F) - 16;
-                    px.y[1] = px.y[3] + ((b2 >> 3) & 0x1F) - 16;
-                    px.y[2] = px.y[0] + ((b2 & 0x07) << 2) + ((b3 >> 6) & 0x03) - 16;
-                    px.y[3] = px.y[1] + ((b3 >> 1) & 0x1F) - 16;
-                    px.cb   = px.cb   + ((b3 & 0x01) << 4) + ((b4 >> 4) & 0x0F) - 16;
-                    px.cr   = px.cr   +  (b4 & 0x0F) - 8;
-                } else if ((b1 & QOY_OP_666_MASK) == QOY_OP_666) {
-                    unsigned char b2 = bytes[p++];
-                    unsigned char b3 = bytes[p++];
-                    unsigned char b4 = bytes[p++];
-                    unsigned char b5 = bytes[p++];
-                    px.y[0] = px.y[2] + ((b1 & 0x0F) << 2) + ((b2 >> 6) & 0x03) - 32;
-                    px.y[1] = px.y[3] +  (b2 & 0x3F) - 32;
-                    px.y[2] = px.y[0] + ((b3 >> 2) & 0x3F) - 32;
-                    px.y[3] = px.y[1] + ((b3 & 0x03) << 4) + ((b4 >> 4) & 0x0F) - 32;
-                    px.cb   = px.cb   + ((b4 & 0x0F) << 2) + ((b5 >> 6) & 0x03) - 32;
-                    px.cr   = px.cr   +  (b5 & 0x3F) - 32;
-                } else if ((b1 & QOY_OP_865_MASK) == QOY_OP_865) {
-                    unsigned char b2 = bytes[p++];
-                    unsigned char b3 = bytes[p++];
-                    unsigned char b4 = bytes[p++];
-                    unsigned char b5 = bytes[p++];
-                    unsigned char b6 = bytes[p++];
-                    px.y[0] = px.y[2] + ((b1 & 0x07) << 5) + ((b2 >> 3) & 0x1F) - 128;
-                    px.y[1] = px.y[3] + ((b2 & 0x07) << 5) + ((b3 >> 3) & 0x1F) - 128;
-                    px.y[2] = px.y[0] + ((b3 & 0x07) << 5) + ((b4 >> 3) & 0x1F) - 128;
-                    px.y[3] = px.y[1] + ((b4 & 0x07) << 5) + ((b5 >> 3) & 0x1F) - 128;
-                    px.cb   = px.cb   + ((b5 & 0x07) << 3) + ((b6 >> 5) & 0x07) - 32;
-                    px.cr   = px.cr   +  (b6 & 0x1F) - 16;
+pred and counting (whether QOY_STATS counts the ops) are passed as constants
+by qoy_encode_row_pair_with, which gets an op loop for every combination. */
+static inline __attribute__((__always_inline__)) int qoy_encode_row_pair(qoy_encode_state_t *s, const unsigned char *row, const unsigned char *row_up, int blocks, int stride, int pred, int counting, unsigned char *bytes, int p) {
+    qoy_ycbcr420a_t px_prev = s->px_prev;
+    qoy_ycbcr420a_diff_t px_diff;
+    int alpha = s->alpha;
+    int indexed = s->indexed;
+    int alpha_run = s->alpha_run;
+    int run = s->run;
+#ifndef QOY_STATS
+    (void)counting;
+#endif
+
+    /* Position of the QOY_OP_RUN_1 the previous block wrote right after its
+    alpha op, or -1. With QOY_FLAG_ALPHA_RUN an alpha op of this block replaces
+    it. Not kept across row pairs, whose predictor bytes would come between. */
+    int run_1 = -1;
+
+    for (int x = 0; x < blocks; x++, row += stride, row_up += stride) {
+        const qoy_ycbcr420a_t *px = (const qoy_ycbcr420a_t *)row;
+        if (pred == QOY_PRED_LEFT) {
+            qoy_residual(QOY_PRED_LEFT, px, &px_prev, NULL, NULL, &px_diff);
+        } else {
+            const qoy_ycbcr420a_t *u = (const qoy_ycbcr420a_t *)row_up;
+            const qoy_ycbcr420a_t *ul = x > 0 ? (const qoy_ycbcr420a_t *)(row_up - stride) : u;
+            qoy_residual(pred, px, x > 0 ? &px_prev : u, u, ul, &px_diff);
+        }
+
+        QOY_STAT_BLOCK(s, counting);
+
+        int alpha_written = 0;
+        int alpha_start = p;
+        if (alpha) {
+            alpha_written = 1;
+            if (px->a[0] == px->a[1] && px->a[0] == px->a[2] && px->a[0] == px->a[3]) {
+                if (px->a[0] != px_prev.a[2]) {
+                    bytes[p++] = QOY_OP_A18;
+                    bytes[p++] = px->a[0];
+                    QOY_STAT(s, counting, QOY_STAT_A18, 2);
+                } else {
+                    alpha_written = 0;
+                }
+            } else {
+                px_diff.a[0] = px->a[0] - px_prev.a[2];
+                px_diff.a[1] = px->a[1] - px_prev.a[3];
+                px_diff.a[2] = px->a[2] - px->a[0];
+                px_diff.a[3] = px->a[3] - px->a[1];
+
+                int a_bits;
+
+                signed char a_min = px_diff.a[0], a_max = px_diff.a[0];
+                if (px_diff.a[1] < a_min) a_min = px_diff.a[1];
+                if (px_diff.a[1] > a_max) a_max = px_diff.a[1];
+                if (px_diff.a[2] < a_min) a_min = px_diff.a[2];
+                if (px_diff.a[2] > a_max) a_max = px_diff.a[2];
+                if (px_diff.a[3] < a_min) a_min = px_diff.a[3];
+                if (px_diff.a[3] > a_max) a_max = px_diff.a[3];
+
+              //if (a_min      >=  -1 && a_max      <  1) a_bits  = 1; else  UNUSED
+                if (a_min      >=  -2 && a_max      <  2) a_bits  = 2; else
+              //if (a_min      >=  -4 && a_max      <  4) a_bits  = 3; else  UNUSED
+                if (a_min      >=  -8 && a_max      <  8) a_bits  = 4; else
+              //if (a_min      >= -16 && a_max      < 16) a_bits  = 5; else  UNUSED
+              //if (a_min      >= -32 && a_max      < 32) a_bits  = 6; else  UNUSED
+              //if (a_min      >= -64 && a_max      < 64) a_bits  = 7; else  UNUSED
+                                                          a_bits  = 8;
+
+                if        (a_bits <= 2) {
+                    bytes[p++] = QOY_OP_A42;
+                    bytes[p++] = (px_diff.a[0] + 2) << 6 | (px_diff.a[1] + 2) << 4 | (px_diff.a[2] + 2) << 2 | (px_diff.a[3] + 2);
+                    QOY_STAT(s, counting, QOY_STAT_A42, 2);
+                } else if (a_bits <= 4) {
+                    bytes[p++] = QOY_OP_A44;
+                    bytes[p++] = (px_diff.a[0] + 8) << 4 | (px_diff.a[1] + 8);
+                    bytes[p++] = (px_diff.a[2] + 8) << 4 | (px_diff.a[3] + 8);
+                    QOY_STAT(s, counting, QOY_STAT_A44, 3);
+                } else {
+                    bytes[p++] = QOY_OP_A48;
+                    bytes[p++] = px->a[0];
+                    bytes[p++] = px->a[1];
+                    bytes[p++] = px->a[2];
+                    bytes[p++] = px->a[3];
+                    QOY_STAT(s, counting, QOY_STAT_A48, 5);
+                    QOY_STAT_LITERAL(s, counting);
                 }
             }
+        }
+        if (alpha_written && run_1 >= 0) {
+            memmove(bytes + run_1, bytes + alpha_start, p - alpha_start);
+            p--;
+            QOY_STAT_ALPHA_RUN(s, counting);
+        }
+        run_1 = -1;
+
+        if (px_diff.y[0] == 0 && px_diff.y[1] == 0 && px_diff.y[2] == 0 && px_diff.y[3] == 0 && px_diff.cb == 0 && px_diff.cr == 0) {
+            run++;
+            if (alpha_written || run == 32770) run = 1;
+            QOY_STAT_RUN(s, counting, run);
+            if (run == 1) {
+                if (alpha_written && alpha_run) run_1 = p;
+                bytes[p++] = QOY_OP_RUN_1;
+            } else if (run == 2) {
+                bytes[p-1] = QOY_OP_RUN_X;
+                bytes[p++] = run - 2;
+            } else if (run < 130) {
+                bytes[p-1] = run - 2;
+            } else {
+                if (run == 130) p++;
+                bytes[p-2] = 0x80 | (run - 130) >> 8;
+                bytes[p-1] = (run - 130) & 0xFF;
+            }
+        } else if (indexed && memcmp(s->index[QOY_INDEX_HASH(px)], px, 6) == 0) {
+            run = 0;
+            bytes[p++] = QOY_OP_INDEX | QOY_INDEX_HASH(px);
+            QOY_STAT(s, counting, QOY_STAT_INDEX, 1);
+        } else {
+            run = 0;
+            if (indexed) memcpy(s->index[QOY_INDEX_HASH(px)], px, 6);
+
+            int y_bits, cr_bits, cb_bits;
+
+            signed char y_min = px_diff.y[0], y_max = px_diff.y[0];
+            if (px_diff.y[1] < y_min) y_min = px_diff.y[1];
+            if (px_diff.y[1] > y_max) y_max = px_diff.y[1];
+            if (px_diff.y[2] < y_min) y_min = px_diff.y[2];
+            if (px_diff.y[2] > y_max) y_max = px_diff.y[2];
+            if (px_diff.y[3] < y_min) y_min = px_diff.y[3];
+            if (px_diff.y[3] > y_max) y_max = px_diff.y[3];
+
+          //if (y_min      >=  -1 && y_max      <  1) y_bits  = 1; else  UNUSED
+          //if (y_min      >=  -2 && y_max      <  2) y_bits  = 2; else  UNUSED
+            if (y_min      >=  -4 && y_max      <  4) y_bits  = 3; else
+            if (y_min      >=  -8 && y_max      <  8) y_bits  = 4; else
+            if (y_min      >= -16 && y_max      < 16) y_bits  = 5; else
+            if (y_min      >= -32 && y_max      < 32) y_bits  = 6; else
+          //if (y_min      >= -64 && y_max      < 64) y_bits  = 7; else  UNUSED
+                                                      y_bits  = 8;
+
+          //if (px_diff.cb >=  -1 && px_diff.cb <  1) cb_bits = 1; else  UNUSED
+            if (px_diff.cb >=  -2 && px_diff.cb <  2) cb_bits = 2; else
+            if (px_diff.cb >=  -4 && px_diff.cb <  4) cb_bits = 3; else
+          //if (px_diff.cb >=  -8 && px_diff.cb <  8) cb_bits = 4; else  UNUSED
+            if (px_diff.cb >= -16 && px_diff.cb < 16) cb_bits = 5; else
+            if (px_diff.cb >= -32 && px_diff.cb < 32) cb_bits = 6; else
+          //if (px_diff.cb >= -64 && px_diff.cb < 64) cb_bits = 7; else  UNUSED
+                                                      cb_bits = 8;
+
+            if (px_diff.cr >=  -1 && px_diff.cr <  1) cr_bits = 1; else
+          //if (px_diff.cr >=  -2 && px_diff.cr <  2) cr_bits = 2; else  UNUSED
+            if (px_diff.cr >=  -4 && px_diff.cr <  4) cr_bits = 3; else
+            if (px_diff.cr >=  -8 && px_diff.cr <  8) cr_bits = 4; else
+            if (px_diff.cr >= -16 && px_diff.cr < 16) cr_bits = 5; else
+            if (px_diff.cr >= -32 && px_diff.cr < 32) cr_bits = 6; else
+          //if (px_diff.cr >= -64 && px_diff.cr < 64) cr_bits = 7; else  UNUSED
+                                                      cr_bits = 8;
+
+            if      (y_bits <= 3 && cb_bits <= 2 && cr_bits <= 1) {
+                bytes[p++] = QOY_OP_321 | (px_diff.y[0] + 4) << 4 | (px_diff.y[1] + 4) << 1 | (px_diff.y[2] + 4) >> 2;
+                bytes[p++] = (px_diff.y[2] + 4) << 6 | (px_diff.y[3] + 4) << 3 | (px_diff.cb + 2) << 1 | (px_diff.cr + 1);
+                QOY_STAT(s, counting, QOY_STAT_321, 2);
+            } else if (y_bits <= 4 && cb_bits <= 3 && cr_bits <= 3) {
+                bytes[p++] = QOY_OP_433 | (px_diff.y[0] + 8) << 2 | (px_diff.y[1] + 8) >> 2;
+                bytes[p++] = (px_diff.y[1] + 8) << 6 | (px_diff.y[2] + 8) << 2 | (px_diff.y[3] + 8) >> 2;
+                bytes[p++] = (px_diff.y[3] + 8) << 6 | (px_diff.cb + 4) << 3 | (px_diff.cr + 4);
+                QOY_STAT(s, counting, QOY_STAT_433, 3);
+            } else if (y_bits <= 5 && cb_bits <= 5 && cr_bits <= 4) {
+                bytes[p++] = QOY_OP_554 | (px_diff.y[0] + 16);
+                bytes[p++] = (px_diff.y[1] + 16) << 3 | (px_diff.y[2] + 16) >> 2;
+                bytes[p++] = (px_diff.y[2] + 16) << 6 | (px_diff.y[3] + 16) << 1 | (px_diff.cb + 16) >> 4;
+                bytes[p++] = (px_diff.cb + 16) << 4 | (px_diff.cr + 8);
+                QOY_STAT(s, counting, QOY_STAT_554, 4);
+            } else if (y_bits <= 6 && cb_bits <= 6 && cr_bits <= 6) {
+                bytes[p++] = QOY_OP_666 | (px_diff.y[0] + 32) >> 2;
+                bytes[p++] = (px_diff.y[0] + 32) << 6 | (px_diff.y[1] + 32);
+                bytes[p++] = (px_diff.y[2] + 32) << 2 | (px_diff.y[3] + 32) >> 4;
+                bytes[p++] = (px_diff.y[3] + 32) << 4 | (px_diff.cb + 32) >> 2;
+                bytes[p++] = (px_diff.cb + 32) << 6 | (px_diff.cr + 32);
+                QOY_STAT(s, counting, QOY_STAT_666, 5);
+            } else if (y_bits <= 8 && cb_bits <= 6 && cr_bits <= 5 && !indexed) {
+                bytes[p++] = QOY_OP_865 | (px_diff.y[0] + 128) >> 5;
+                bytes[p++] = (px_diff.y[0] + 128) << 3 | (px_diff.y[1] + 128) >> 5;
+                bytes[p++] = (px_diff.y[1] + 128) << 3 | (px_diff.y[2] + 128) >> 5;
+                bytes[p++] = (px_diff.y[2] + 128) << 3 | (px_diff.y[3] + 128) >> 5;
+                bytes[p++] = (px_diff.y[3] + 128) << 3 | (px_diff.cb + 32) >> 3;
+                bytes[p++] = (px_diff.cb + 32) << 5 | (px_diff.cr + 16);
+                QOY_STAT(s, counting, QOY_STAT_865, 6);
+            } else {
+                bytes[p++] = QOY_OP_888;
+                bytes[p++] = px->y[0];
+                bytes[p++] = px->y[1];
+                bytes[p++] = px->y[2];
+                bytes[p++] = px->y[3];
+                bytes[p++] = px->cb;
+                bytes[p++] = px->cr;
+                QOY_STAT(s, counting, QOY_STAT_888, 7);
+                QOY_STAT_LITERAL(s, counting);
+            }
+        }
+
+        if (alpha) {
+            px_prev = *px;
+        } else {
+            memcpy(&px_prev, px, 6);
+        }
+    }
+
+    s->px_prev = px_prev;
+    s->run = run;
+    return p;
+}
 
-            memcpy(px_write, &px, size_ycbcra);
+/* Encode a row pair with the op loop for its predictor, counting the ops if
+the state has stats enabled */
+static int qoy_encode_row_pair_with(qoy_encode_state_t *s, const unsigned char *row, const unsigned char *row_up, int blocks, int stride, int pred, unsigned char *bytes, int p) {
+#ifdef QOY_STATS
+    if (s->stats_enabled) {
+        switch (pred) {
+            case QOY_PRED_LEFT: return qoy_encode_row_pair(s, row, row_up, blocks, stride, QOY_PRED_LEFT, 1, bytes, p);
+            case QOY_PRED_UP:   return qoy_encode_row_pair(s, row, row_up, blocks, stride, QOY_PRED_UP,   1, bytes, p);
+            default:            return qoy_encode_row_pair(s, row, row_up, blocks, stride, QOY_PRED_MED,  1, bytes, p);
         }
-        if (out_format != QOY_FORMAT_YCBCR420A) {
-            qoy_ycbcra_to_rgba_two_lines(
-                buffer,
-                desc->width,
-                desc->height != internal_height && y == desc->height - 1 ? 1 : 2,
-                desc->channels,
-                out_channels,
-                pixels + y * desc->width * out_channels
+    }
+#endif
+    switch (pred) {
+        case QOY_PRED_LEFT: return qoy_encode_row_pair(s, row, row_up, blocks, stride, QOY_PRED_LEFT, 0, bytes, p);
+        case QOY_PRED_UP:   return qoy_encode_row_pair(s, row, row_up, blocks, stride, QOY_PRED_UP,   0, bytes, p);
+        default:            return qoy_encode_row_pair(s, row, row_up, blocks, stride, QOY_PRED_MED,  0, bytes, p);
+    }
+}
+
+/* Encode a row pair with every predictor into the two halves of trial, each
+trial_size bytes, and write the predictor byte and the smallest result to
+bytes. Returns the new write position in bytes.
+
+For near-lossless encoding (max_error > 0) trial also has room for two snapped
+row pairs after the encoded halves, and the snapped row pair of the smallest
+result is written to row, which must be writable. */
+static int qoy_encode_row_pair_trial(qoy_encode_state_t *s, const unsigned char *row, const unsigned char *row_up, int blocks, int stride, unsigned char *bytes, int p, unsigned char *trial, int trial_size, int max_error) {
+    qoy_encode_state_t best_state = *s;
+    int best_len = -1, best_pred = QOY_PRED_LEFT, best_half = 0, half = 0;
+    int row_size = blocks * stride;
+    unsigned char *snapped = trial + trial_size * 2;
+
+    for (int pred = QOY_PRED_LEFT; pred <= QOY_PRED_MED; pred++) {
+        qoy_encode_state_t state = *s;
+        unsigned char *out = trial + half * trial_size;
+        const unsigned char *in = row;
+        int len;
+        if (max_error) {
+            unsigned char *in_snapped = snapped + half * row_size;
+            memcpy(in_snapped, row, row_size);
+            qoy_snap_row_pair(s, in_snapped, row_up, blocks, stride, pred, max_error);
+            in = in_snapped;
+        }
+        len = qoy_encode_row_pair_with(&state, in, row_up, blocks, stride, pred, out, 0);
+        if (best_len < 0 || len < best_len) {
+            best_state = state;
+            best_len = len;
+            best_pred = pred;
+            best_half = half;
+            half ^= 1;
+        }
+    }
+
+    *s = best_state;
+    if (max_error) {
+        memcpy((unsigned char *)row, snapped + best_half * row_size, row_size);
+    }
+    bytes[p++] = best_pred;
+    memcpy(bytes + p, trial + best_half * trial_size, best_len);
+    return p + best_len;
+}
+
+/* Position and size of a tile, the whole image without QOY_FLAG_TILED */
+static void qoy_tile_rect(const qoy_desc *desc, int tile, int *x, int *y, int *width, int *height) {
+    if (!(desc->flags & QOY_FLAG_TILED)) {
+        *x = 0;
+        *y = 0;
+        *width = desc->width;
+        *height = desc->height;
+        return;
+    }
+    int tiles_x = (desc->width + QOY_TILE_SIZE - 1) / QOY_TILE_SIZE;
+    *x = (tile % tiles_x) * QOY_TILE_SIZE;
+    *y = (tile / tiles_x) * QOY_TILE_SIZE;
+    *width = (int)desc->width - *x < QOY_TILE_SIZE ? (int)desc->width - *x : QOY_TILE_SIZE;
+    *height = (int)desc->height - *y < QOY_TILE_SIZE ? (int)desc->height - *y : QOY_TILE_SIZE;
+}
+
+int qoy_tiles(const qoy_desc *desc) {
+    if (!(desc->flags & QOY_FLAG_TILED)) {
+        return 1;
+    }
+    return ((desc->width + QOY_TILE_SIZE - 1) / QOY_TILE_SIZE) * ((desc->height + QOY_TILE_SIZE - 1) / QOY_TILE_SIZE);
+}
+
+/* Position of the checksums of QOY_FLAG_CRC, after the header and the tile
+offsets of QOY_FLAG_TILED */
+static int qoy_crcs_start(const qoy_desc *desc) {
+    return QOY_HEADER_SIZE + ((desc->flags & QOY_FLAG_TILED) ? qoy_tiles(desc) * 4 : 0);
+}
+
+/* Size of the tile offsets of QOY_FLAG_TILED and the checksums of QOY_FLAG_CRC
+that follow the header */
+static int qoy_tables_size(const qoy_desc *desc) {
+    int tiles = qoy_tiles(desc);
+    return ((desc->flags & QOY_FLAG_TILED) ? tiles * 4 : 0) + ((desc->flags & QOY_FLAG_CRC) ? (1 + tiles) * 4 : 0);
+}
+
+/* Encoder for the row pairs of a region of the image, the whole image or a
+tile */
+typedef struct {
+    qoy_encode_state_t state;
+    int width;
+    int height;
+    int in_channels;
+    int in_format;
+    int channels;
+    int flags;
+    int max_error;
+    int size_ycbcra;
+    int blocks;
+    int row_size;
+    unsigned char *buffer;
+    unsigned char *trial;
+    int trial_size;
+    int borrowed;
+    int y;
+} qoy_region_encoder_t;
+
+/* Scratch space of a region encoder for regions up to width pixels wide: two
+row pairs of 10 byte blocks, and for trial encoding two row pairs of 12 byte
+blocks plus two snapped row pairs */
+#define QOY_REGION_SCRATCH(width) ((((width) + 1) >> 1) * (20 + 24 + 20))
+
+/* Set up a region encoder. YCbCrA input is read in place, the row pair above
+included, unless copy is set. The row pair buffers are taken from scratch if
+it is not NULL, which must then have room for QOY_REGION_SCRATCH(width) bytes.
+Returns 0 on success, or -1 if malloc failed. */
+static int qoy_region_encoder_init(qoy_region_encoder_t *e, int width, int height, int in_channels, int in_format, int channels, int flags, int effort, int max_error, int copy, unsigned char *scratch) {
+    memset(e, 0, sizeof(*e));
+    e->width = width;
+    e->height = height;
+    e->in_channels = in_channels;
+    e->in_format = in_format;
+    e->channels = channels;
+    e->flags = flags;
+    e->max_error = max_error;
+
+    /* RGBA input is converted to the channel count of the output, YCbCrA input
+    is used as-is */
+    e->size_ycbcra = ((in_format == QOY_FORMAT_YCBCR420A ? in_channels : channels) == 4) ? 10 : 6;
+    e->blocks = (width + 1) >> 1;
+    e->row_size = e->size_ycbcra * e->blocks;
+
+    e->state.px_prev.a[0] = 255;
+    e->state.px_prev.a[1] = 255;
+    e->state.px_prev.a[2] = 255;
+    e->state.px_prev.a[3] = 255;
+    e->state.alpha = channels == 4 && e->size_ycbcra == 10;
+    e->state.indexed = (flags & QOY_FLAG_INDEX) != 0;
+    e->state.alpha_run = (flags & QOY_FLAG_ALPHA_RUN) != 0;
+
+    /* Two row pairs are kept for RGBA input, so the predictors can look at the
+    row pair above. Near-lossless encoding snaps the row pairs in place, so
+    YCbCrA input is copied to them as well. */
+    if (scratch) {
+        e->borrowed = 1;
+        if (in_format != QOY_FORMAT_YCBCR420A || max_error || copy) {
+            e->buffer = scratch;
+        }
+        e->trial_size = e->blocks * 12;
+        if (effort >= QOY_EFFORT_BETTER && (flags & QOY_FLAG_PREDICT)) {
+            e->trial = scratch + e->blocks * 20;
+        }
+        return 0;
+    }
+
+    if (in_format != QOY_FORMAT_YCBCR420A || max_error || copy) {
+        e->buffer = (unsigned char *)QOY_MALLOC(e->row_size * 2);
+        if (!e->buffer) {
+            return -1;
+        }
+    }
+
+    /* Trial encoding keeps the best and the current attempt of a row pair, a
+    block takes at most 12 bytes (7 YCbCr + 5 A) */
+    e->trial_size = e->blocks * 12;
+    if (effort >= QOY_EFFORT_BETTER && (flags & QOY_FLAG_PREDICT)) {
+        e->trial = (unsigned char *)QOY_MALLOC(e->trial_size * 2 + (max_error ? e->row_size * 2 : 0));
+        if (!e->trial) {
+            if (e->buffer) QOY_FREE(e->buffer);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void qoy_region_encoder_free(qoy_region_encoder_t *e) {
+    if (e->borrowed) return;
+    if (e->buffer) QOY_FREE(e->buffer);
+    if (e->trial) QOY_FREE(e->trial);
+}
+
+/* Encode the next row pair to bytes at p. in points to its first line (RGBA)
+or its blocks (YCbCrA), stride is the distance in bytes to the second line
+(RGBA) or from the row pair above (YCbCrA, read in place). Returns the new
+write position. */
+static inline int qoy_region_encode_row_pair(qoy_region_encoder_t *e, const unsigned char *in, int stride, unsigned char *bytes, int p) {
+    int y = e->y;
+    int blocks = e->blocks;
+    int size_ycbcra = e->size_ycbcra;
+    int row_size = e->row_size;
+    e->y += 2;
+
+    const unsigned char *row, *row_up;
+    unsigned char *row_buffer = NULL;
+    if (e->buffer) {
+        row_buffer = e->buffer + ((y >> 1) & 1) * row_size;
+        if (e->in_format != QOY_FORMAT_YCBCR420A) {
+            qoy_rgba_to_ycbcra_two_lines(
+                in,
+                e->width,
+                (e->height & 0x01) && y == e->height - 1 ? 1 : 2,
+                stride,
+                e->in_channels,
+                e->channels,
+                row_buffer
             );
         } else {
-            buffer += size_ycbcra * (internal_width >> 1);
+            memcpy(row_buffer, in, row_size);
         }
+        row = row_buffer;
+        row_up = e->buffer + (((y >> 1) + 1) & 1) * row_size;
+    } else {
+        row = in;
+        row_up = row - stride;
     }
-    if (out_format != QOY_FORMAT_YCBCR420A) QOY_FREE(buffer);
 
-    return pixels;
+    int pred = QOY_PRED_LEFT;
+    if (e->flags & QOY_FLAG_PREDICT) {
+        e->state.run = 0;
+        QOY_STAT(&e->state, e->state.stats_enabled, QOY_STAT_PRED, 1);
+        if (y > 0 && e->trial) {
+            return qoy_encode_row_pair_trial(&e->state, row, row_up, blocks, size_ycbcra, bytes, p, e->trial, e->trial_size, e->max_error);
+        }
+        if (y > 0) {
+            pred = qoy_choose_predictor(row, row_up, blocks, size_ycbcra, &e->state.px_prev);
+        }
+        bytes[p++] = pred;
+    }
+
+    if (e->max_error) {
+        qoy_snap_row_pair(&e->state, row_buffer, row_up, blocks, size_ycbcra, pred, e->max_error);
+    }
+
+    return qoy_encode_row_pair_with(&e->state, row, row_up, blocks, size_ycbcra, pred, bytes, p);
 }
 
-#ifndef QOY_NO_STDIO
-#include <stdio.h>
+/* Encode the chunks of a region of the image, the whole image or a tile, to
+bytes at p. pixels points to the top left pixel (RGBA) or block (YCbCrA) of the
+region, stride is the distance in bytes between its lines (RGBA) or row pairs
+(YCbCrA). scratch may be NULL, as for qoy_region_encoder_init. Returns the new
+write position, or -1 if malloc failed. */
+static int qoy_encode_chunks(const unsigned char *pixels, int stride, int width, int height, int in_channels, int in_format, int channels, int flags, int effort, int max_error, unsigned char *bytes, int p, qoy_stats *stats, unsigned char *scratch) {
+    qoy_region_encoder_t e;
+    if (qoy_region_encoder_init(&e, width, height, in_channels, in_format, channels, flags, effort, max_error, 0, scratch) < 0) {
+        return -1;
+    }
+#ifdef QOY_STATS
+    e.state.stats_enabled = stats != NULL;
+#else
+    (void)stats;
+#endif
+
+    int internal_height = (height + 1) & ~0x01;
+    for (int y = 0; y < internal_height; y += 2) {
+        const unsigned char *in = pixels + (in_format == QOY_FORMAT_YCBCR420A ? y >> 1 : y) * stride;
+        p = qoy_region_encode_row_pair(&e, in, stride, bytes, p);
+    }
+
+#ifdef QOY_STATS
+    if (stats) {
+        qoy_stats_add(stats, &e.state.stats);
+    }
+#endif
+    qoy_region_encoder_free(&e);
+    return p;
+}
+
+/* Validate the encoder parameters. Returns the largest size the encoded image
+can have, or 0 if the parameters are invalid. */
+static int qoy_encode_bound(const qoy_desc *desc, int in_channels, int in_format) {
+    int internal_width = (desc->width + 1) & ~0x01;
+    int internal_height = (desc->height + 1) & ~0x01;
+
+    if (
+        desc == NULL ||
+        desc->width == 0 || desc->height == 0 ||
+        desc->channels < 3 || desc->channels > 4 ||
+        in_channels < 3 || in_channels > 4 ||
+        desc->colorspace > 1 ||
+        (desc->flags & ~QOY_FLAGS_ALL) != 0 ||
+        (unsigned int)internal_height >= QOY_PIXELS_MAX / internal_width ||
+        in_format > 1
+    ) {
+        return 0;
+    }
+
+    int tiles = qoy_tiles(desc);
+    int max_size = QOY_HEADER_SIZE + qoy_tables_size(desc);
+    for (int tile = 0; tile < tiles; tile++) {
+        int x, y, width, height;
+        qoy_tile_rect(desc, tile, &x, &y, &width, &height);
+        max_size += qoy_chunks_max(width, height, desc->channels, desc->flags) + (int)sizeof(qoy_padding);
+    }
+    return max_size;
+}
+
+/* Size of the scratch space qoy_encode_into needs for an image: the row pair
+buffers of the widest region and, for QOY_FLAG_LZ, the uncompressed chunks of
+the largest region. Both are those of the first region. */
+static int qoy_encode_scratch_size(const qoy_desc *desc) {
+    int x, y, width, height;
+    qoy_tile_rect(desc, 0, &x, &y, &width, &height);
+    return QOY_REGION_SCRATCH(width) + ((desc->flags & QOY_FLAG_LZ) ? qoy_chunks_max(width, height, desc->channels, desc->flags & ~QOY_FLAG_LZ) : 0);
+}
+
+/* Encode a tile of an image, the whole image without QOY_FLAG_TILED, to bytes
+at p, followed by the end marker. ops is the buffer for the uncompressed chunks
+with QOY_FLAG_LZ, else NULL. Returns the new write position, or -1 if malloc
+failed. */
+static int qoy_encode_tile(const unsigned char *pixels, const qoy_desc *desc, int tile, int in_channels, int in_format, int effort, int max_error, unsigned char *ops, unsigned char *bytes, int p, qoy_stats *stats, unsigned char *scratch) {
+    int internal_width = (desc->width + 1) & ~0x01;
+    int in_stride = in_format == QOY_FORMAT_YCBCR420A ?
+        (internal_width >> 1) * (in_channels == 4 ? 10 : 6) :
+        (int)desc->width * in_channels;
+
+    int x, y, width, height;
+    qoy_tile_rect(desc, tile, &x, &y, &width, &height);
+    const unsigned char *region = in_format == QOY_FORMAT_YCBCR420A ?
+        pixels + (y >> 1) * in_stride + (x >> 1) * (in_channels == 4 ? 10 : 6) :
+        pixels + y * in_stride + x * in_channels;
+    if (ops) {
+        int ops_size = qoy_encode_chunks(region, in_stride, width, height, in_channels, in_format, desc->channels, desc->flags, effort, max_error, ops, 0, stats, scratch);
+        p = ops_size < 0 ? -1 : qoy_lz_pack(ops, ops_size, bytes, p);
+    } else {
+        p = qoy_encode_chunks(region, in_stride, width, height, in_channels, in_format, desc->channels, desc->flags, effort, max_error, bytes, p, stats, scratch);
+    }
+
+    if (p >= 0) {
+        for (int i = 0; i < (int)sizeof(qoy_padding); i++) {
+            bytes[p++] = qoy_padding[i];
+        }
+    }
+    return p;
+}
+
+/* The buffer for the uncompressed chunks of the largest region, the first one,
+with QOY_FLAG_LZ: taken from scratch if it is not NULL, as for
+qoy_encode_scratch_size. Returns NULL without QOY_FLAG_LZ or if malloc
+failed. */
+static unsigned char *qoy_encode_ops(const qoy_desc *desc, unsigned char *scratch) {
+    int x, y, width, height;
+    qoy_tile_rect(desc, 0, &x, &y, &width, &height);
+    if (!(desc->flags & QOY_FLAG_LZ)) {
+        return NULL;
+    }
+    if (scratch) {
+        return scratch + QOY_REGION_SCRATCH(width);
+    }
+    return (unsigned char *)QOY_MALLOC(qoy_chunks_max(width, height, desc->channels, desc->flags & ~QOY_FLAG_LZ));
+}
+
+/* Write the header of an image. Returns the position after it. */
+static int qoy_write_header(const qoy_desc *desc, unsigned char *bytes) {
+    int p = 0;
+    qoy_write_32(bytes, &p, QOY_MAGIC);
+    qoy_write_32(bytes, &p, desc->width);
+    qoy_write_32(bytes, &p, desc->height);
+    bytes[p++] = desc->channels;
+    bytes[p++] = desc->colorspace | desc->flags;
+    return p;
+}
+
+/* Encode an image into bytes, which must have room for qoy_encode_bound bytes.
+stats may be NULL, it is only filled with QOY_STATS. scratch may be NULL, else
+all working memory is taken from it and it must have room for
+qoy_encode_scratch_size bytes. Returns the size of the encoded image, or -1 if
+malloc failed. */
+static int qoy_encode_into(const void *data, const qoy_desc *desc, int in_channels, int in_format, int effort, int max_error, unsigned char *bytes, qoy_stats *stats, unsigned char *scratch) {
+    int tiles = qoy_tiles(desc);
+    int tiled = (desc->flags & QOY_FLAG_TILED) != 0;
+    unsigned char *ops = qoy_encode_ops(desc, scratch);
+    if ((desc->flags & QOY_FLAG_LZ) && !ops) {
+        return -1;
+    }
+
+    int p = qoy_write_header(desc, bytes);
+    int table = p;
+    int crcs = qoy_crcs_start(desc);
+    p += qoy_tables_size(desc);
+    int tiles_start = p;
+
+    /* Checksums are taken right after each tile is written, while its bytes
+    are still in the cache */
+    for (int tile = 0; tile < tiles && p >= 0; tile++) {
+        if (tiled) {
+            qoy_write_32(bytes, &table, p - tiles_start);
+        }
+        int start = p;
+        p = qoy_encode_tile((const unsigned char *)data, desc, tile, in_channels, in_format, effort, max_error, ops, bytes, p, stats, scratch);
+        if ((desc->flags & QOY_FLAG_CRC) && p >= 0) {
+            int c = crcs + (1 + tile) * 4;
+            qoy_write_32(bytes, &c, qoy_crc32c(0, bytes + start, p - start));
+        }
+    }
+    if ((desc->flags & QOY_FLAG_CRC) && p >= 0) {
+        qoy_write_32(bytes, &crcs, qoy_crc32c(0, bytes, crcs));
+    }
+    if (ops && !scratch) QOY_FREE(ops);
+    return p;
+}
+
+/* Whether the alpha of 4 channel input is 255 everywhere. RGBA pixels are ANDed
+together as 32 bit words, which compilers turn into a vector loop, and the
+alpha byte of the result is checked every QOY_OPAQUE_SPAN pixels so that
+images with alpha are rejected early. The YCbCrA blocks of odd sizes repeat
+the edge pixels, so all of their alpha bytes are image alpha. */
+#define QOY_OPAQUE_SPAN 4096
+
+static int qoy_is_opaque(const unsigned char *pixels, const qoy_desc *desc, int in_format) {
+    if (in_format == QOY_FORMAT_YCBCR420A) {
+        int blocks = ((desc->width + 1) >> 1) * ((desc->height + 1) >> 1);
+        unsigned char a = 255;
+        for (int i = 0; i < blocks; i++) {
+            const unsigned char *block = pixels + i * 10;
+            a &= block[6] & block[7] & block[8] & block[9];
+        }
+        return a == 255;
+    }
+
+    int count = (int)(desc->width * desc->height);
+    for (int i = 0; i < count; ) {
+        int end = count - i < QOY_OPAQUE_SPAN ? count : i + QOY_OPAQUE_SPAN;
+        unsigned int all = 0xffffffff;
+        for (; i < end; i++) {
+            unsigned int px;
+            memcpy(&px, pixels + i * 4, 4);
+            all &= px;
+        }
+        unsigned char bytes[4];
+        memcpy(bytes, &all, 4);
+        if (bytes[3] != 255) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The description to encode with: desc, or a copy with 3 channels if
+drop_opaque_alpha applies to the image */
+static const qoy_desc *qoy_encode_desc(const void *data, const qoy_desc *desc, int in_channels, int in_format, int drop_opaque_alpha, qoy_desc *reduced) {
+    if (in_channels == 0) in_channels = desc->channels;
+    if (
+        !drop_opaque_alpha || data == NULL ||
+        desc->channels != 4 || in_channels != 4 ||
+        qoy_encode_bound(desc, in_channels, in_format) == 0 ||
+        !qoy_is_opaque((const unsigned char *)data, desc, in_format)
+    ) {
+        return desc;
+    }
+    *reduced = *desc;
+    reduced->channels = 3;
+    return reduced;
+}
+
+static void *qoy_encode_effort(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format, int effort, int max_error, qoy_stats *stats) {
+    if (in_channels == 0) in_channels = desc->channels;
+    int max_size = qoy_encode_bound(desc, in_channels, in_format);
+    if (data == NULL || out_len == NULL || max_size == 0) {
+        return NULL;
+    }
+
+    unsigned char *bytes = (unsigned char *)QOY_MALLOC(max_size);
+    if (!bytes) {
+        return NULL;
+    }
+
+    int len = qoy_encode_into(data, desc, in_channels, in_format, effort, max_error, bytes, stats, NULL);
+    if (len < 0) {
+        QOY_FREE(bytes);
+        return NULL;
+    }
+
+    *out_len = len;
+    return bytes;
+}
+
+/* Encode an image with QOY_EFFORT_BEST into bytes. Every subset of the
+requested flags is tried, starting with all of them: an extension can cost
+more than it saves (QOY_FLAG_INDEX gives up QOY_OP_865, QOY_FLAG_PREDICT adds a
+byte per row pair and breaks runs at row pair boundaries), so the largest set
+is not always the smallest file. Tiles and checksums are kept as requested. bytes
+and trial must both have room for qoy_encode_bound bytes, which no subset
+exceeds; stats and scratch are as for qoy_encode_into. Returns the size of the
+smallest encoding, or -1 if malloc failed. */
+static int qoy_encode_best_into(const void *data, const qoy_desc *desc, int in_channels, int in_format, int max_error, unsigned char *bytes, unsigned char *trial, qoy_stats *stats, unsigned char *scratch) {
+    qoy_desc trial_desc = *desc;
+    int best_len = -1;
+    int optional = desc->flags & ~(QOY_FLAG_TILED | QOY_FLAG_CRC);
+    qoy_stats trial_stats;
+    for (int flags = optional; ; flags = (flags - 1) & optional) {
+        trial_desc.flags = flags | (desc->flags & (QOY_FLAG_TILED | QOY_FLAG_CRC));
+        memset(&trial_stats, 0, sizeof(trial_stats));
+        unsigned char *out = best_len < 0 ? bytes : trial;
+        int len = qoy_encode_into(data, &trial_desc, in_channels, in_format, QOY_EFFORT_BETTER, max_error, out, stats ? &trial_stats : NULL, scratch);
+        if (len < 0) {
+            return -1;
+        }
+        if (best_len < 0 || len < best_len) {
+            if (out != bytes) memcpy(bytes, out, len);
+            best_len = len;
+            if (stats) *stats = trial_stats;
+        }
+        if (flags == 0) {
+            break;
+        }
+    }
+    return best_len;
+}
+
+static void *qoy_encode_options(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format, const qoy_options *options, qoy_stats *stats) {
+    int effort = options ? options->effort : QOY_EFFORT_FAST;
+    int max_error = options ? options->max_error : 0;
+    if (
+        desc == NULL ||
+        effort < QOY_EFFORT_FAST || effort > QOY_EFFORT_BEST ||
+        max_error < 0 || max_error > 255
+    ) {
+        return NULL;
+    }
+    qoy_desc reduced;
+    desc = qoy_encode_desc(data, desc, in_channels, in_format, options && options->drop_opaque_alpha, &reduced);
+    if (effort < QOY_EFFORT_BEST) {
+        return qoy_encode_effort(data, desc, out_len, in_channels, in_format, effort, max_error, stats);
+    }
+
+    if (in_channels == 0) in_channels = desc->channels;
+    int max_size = qoy_encode_bound(desc, in_channels, in_format);
+    if (data == NULL || out_len == NULL || max_size == 0) {
+        return NULL;
+    }
+
+    unsigned char *bytes = (unsigned char *)QOY_MALLOC(max_size);
+    unsigned char *trial = (unsigned char *)QOY_MALLOC(max_size);
+    int len = bytes && trial ? qoy_encode_best_into(data, desc, in_channels, in_format, max_error, bytes, trial, stats, NULL) : -1;
+    if (trial) QOY_FREE(trial);
+    if (len < 0) {
+        if (bytes) QOY_FREE(bytes);
+        return NULL;
+    }
+
+    *out_len = len;
+    return bytes;
+}
+
+void *qoy_encode_ex(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format, const qoy_options *options) {
+    return qoy_encode_options(data, desc, out_len, in_channels, in_format, options, NULL);
+}
+
+#ifdef QOY_STATS
+void *qoy_encode_stats(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format, const qoy_options *options, qoy_stats *stats) {
+    if (stats == NULL) {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(*stats));
+    void *encoded = qoy_encode_options(data, desc, out_len, in_channels, in_format, options, stats);
+    qoy_stats_finish(stats);
+    return encoded;
+}
+#endif
+
+void *qoy_encode(const void *data, const qoy_desc *desc, int *out_len, int in_channels, int in_format) {
+    return qoy_encode_effort(data, desc, out_len, in_channels, in_format, QOY_EFFORT_FAST, 0, NULL);
+}
+
+typedef struct {
+    qoy_ycbcr420a_t px;
+    int alpha;
+    int indexed;
+    int alpha_run;
+    int run;
+    unsigned char index[QOY_INDEX_SIZE][6];
+#ifdef QOY_STATS
+    int stats_enabled;
+    qoy_stats stats;
+    unsigned long long literal_block;
+#endif
+} qoy_decode_state_t;
+
+/* Apply differences to the prediction made by pred, the inverse of
+qoy_residual. px holds the previous block on entry. */
+static inline void qoy_reconstruct(int pred, qoy_ycbcr420a_t *px, const qoy_ycbcr420a_t *u, const qoy_ycbcr420a_t *ul, int first, int d0, int d1, int d2, int d3, int dcb, int dcr) {
+    if (pred == QOY_PRED_LEFT) {
+        px->y[0] = px->y[2] + d0;
+        px->y[1] = px->y[3] + d1;
+        px->y[2] = px->y[0] + d2;
+        px->y[3] = px->y[1] + d3;
+        px->cb   = px->cb   + dcb;
+        px->cr   = px->cr   + dcr;
+    } else if (pred == QOY_PRED_UP) {
+        px->y[0] = u->y[1]  + d0;
+        px->y[1] = px->y[0] + d1;
+        px->y[2] = u->y[3]  + d2;
+        px->y[3] = px->y[2] + d3;
+        px->cb   = u->cb    + dcb;
+        px->cr   = u->cr    + dcr;
+    } else {
+        qoy_ycbcr420a_t l = first ? *u : *px;
+        px->y[0] = qoy_med(l.y[2], u->y[1], ul->y[3]) + d0;
+        px->y[1] = qoy_med(l.y[3], px->y[0], l.y[2]) + d1;
+        px->y[2] = qoy_med(px->y[0], u->y[3], u->y[1]) + d2;
+        px->y[3] = qoy_med(px->y[1], px->y[2], px->y[0]) + d3;
+        px->cb   = qoy_med(l.cb, u->cb, ul->cb) + dcb;
+        px->cr   = qoy_med(l.cr, u->cr, ul->cr) + dcr;
+    }
+}
+
+/* Decode a row pair of blocks with the given predictor. row_up is the row pair
+above and may be the same as row, in which case it is read before it is
+overwritten. Returns the new read position in bytes, or -1 on error.
+
+pred, indexed and counting (whether QOY_STATS counts the ops) are passed as
+constants and the function is always inlined, so every combination gets its own
+op loop and plain streams don't pay for the extensions or the stats. */
+static inline __attribute__((__always_inline__)) int qoy_decode_row_pair(qoy_decode_state_t *s, const unsigned char *bytes, int p, int chunks_len, unsigned char *row, const unsigned char *row_up, int blocks, int stride, int pred, int indexed, int counting) {
+    qoy_ycbcr420a_t px = s->px;
+    qoy_ycbcr420a_t up, up_left;
+    memset(&up, 0, sizeof(up));
+    memset(&up_left, 0, sizeof(up_left));
+    int alpha = s->alpha;
+    int alpha_run = s->alpha_run;
+    int run = s->run;
+#ifndef QOY_STATS
+    (void)counting;
+#endif
+
+    for (int x = 0; x < blocks; x++, row += stride, row_up += stride) {
+        if (pred != QOY_PRED_LEFT) {
+            up_left = up;
+            memcpy(&up, row_up, 6);
+            if (x == 0) up_left = up;
+        }
+
+        QOY_STAT_BLOCK(s, counting);
+
+        if (run > 0) {
+            if (alpha) {
+                px.a[0] = px.a[2];
+                px.a[1] = px.a[2];
+                px.a[3] = px.a[2];
+            }
+            qoy_reconstruct(pred, &px, &up, &up_left, x == 0, 0, 0, 0, 0, 0, 0);
+            run--;
+        } else {
+            if (p >= chunks_len) {
+                return -1;
+            }
+
+            unsigned char b1 = bytes[p++];
+            if (alpha) {
+                if ((b1 & QOY_OP_A_MASK) == QOY_OP_A_ANY) {
+                    if        (b1 == QOY_OP_A18) {
+                        px.a[0] = bytes[p++];
+                        px.a[1] = px.a[0];
+                        px.a[2] = px.a[0];
+                        px.a[3] = px.a[0];
+                        QOY_STAT(s, counting, QOY_STAT_A18, 2);
+                    } else if (b1 == QOY_OP_A42) {
+                        QOY_STAT(s, counting, QOY_STAT_A42, 2);
+                        unsigned char b2 = bytes[p++];
+                        px.a[0] = px.a[2] + ((b2 >> 6) & 0x03) - 2;
+                        px.a[1] = px.a[3] + ((b2 >> 4) & 0x03) - 2;
+                        px.a[2] = px.a[0] + ((b2 >> 2) & 0x03) - 2;
+                        px.a[3] = px.a[1] +  (b2 & 0x03) - 2;
+                    } else if (b1 == QOY_OP_A44) {
+                        QOY_STAT(s, counting, QOY_STAT_A44, 3);
+                        unsigned char b2 = bytes[p++];
+                        unsigned char b3 = bytes[p++];
+                        px.a[0] = px.a[2] + ((b2 >> 4) & 0x0F) - 8;
+                        px.a[1] = px.a[3] +  (b2 & 0x0F) - 8;
+                        px.a[2] = px.a[0] + ((b3 >> 4) & 0x0F) - 8;
+                        px.a[3] = px.a[1] +  (b3 & 0x0F) - 8;
+                    } else if (b1 == QOY_OP_A48) {
+                        px.a[0] = bytes[p++];
+                        px.a[1] = bytes[p++];
+                        px.a[2] = bytes[p++];
+                        px.a[3] = bytes[p++];
+                        QOY_STAT(s, counting, QOY_STAT_A48, 5);
+                        QOY_STAT_LITERAL(s, counting);
+                    }
+                    b1 = bytes[p++];
+                    if (alpha_run && (b1 & QOY_OP_A_MASK) == QOY_OP_A_ANY) {
+                        /* The alpha op of the next block, this one repeats */
+                        p--;
+                        b1 = QOY_OP_RUN_1;
+                        QOY_STAT_ALPHA_RUN(s, counting);
+                    }
+                } else {
+                    px.a[0] = px.a[2];
+                    px.a[1] = px.a[2];
+                    px.a[3] = px.a[2];
+                }
+            }
+
+            if        ((b1 & QOY_OP_EOF_MASK) == QOY_OP_EOF) {
+                return -1;
+            } else if ((b1 & QOY_OP_RUN_MASK) == QOY_OP_RUN_1) {
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, 0, 0, 0, 0, 0, 0);
+                QOY_STAT_RUN_LENGTH(s, counting, 1);
+            } else if ((b1 & QOY_OP_RUN_MASK) == QOY_OP_RUN_X) {
+                unsigned char b2 = bytes[p++];
+                if (b2 < 128) {
+                    run = b2 + 2 - 1;
+                } else {
+                    unsigned char b3 = bytes[p++];
+                    run = ((b2 & 0x7F) << 8 | b3) + 130 - 1;
+                }
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, 0, 0, 0, 0, 0, 0);
+                QOY_STAT_RUN_LENGTH(s, counting, run + 1);
+            } else if ((b1 & QOY_OP_888_MASK) == QOY_OP_888) {
+                px.y[0] = bytes[p++];
+                px.y[1] = bytes[p++];
+                px.y[2] = bytes[p++];
+                px.y[3] = bytes[p++];
+                px.cb   = bytes[p++];
+                px.cr   = bytes[p++];
+                QOY_STAT(s, counting, QOY_STAT_888, 7);
+                QOY_STAT_LITERAL(s, counting);
+            } else if ((b1 & QOY_OP_321_MASK) == QOY_OP_321) {
+                QOY_STAT(s, counting, QOY_STAT_321, 2);
+                unsigned char b2 = bytes[p++];
+                int d0  = ((b1 >> 4) & 0x07) - 4;
+                int d1  = ((b1 >> 1) & 0x07) - 4;
+                int d2  = ((b1 & 0x01) << 2) + ((b2 >> 6) & 0x03) - 4;
+                int d3  = ((b2 >> 3) & 0x07) - 4;
+                int dcb = ((b2 >> 1) & 0x03) - 2;
+                int dcr =  (b2 & 0x01) - 1;
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, d0, d1, d2, d3, dcb, dcr);
+            } else if ((b1 & QOY_OP_433_MASK) == QOY_OP_433) {
+                QOY_STAT(s, counting, QOY_STAT_433, 3);
+                unsigned char b2 = bytes[p++];
+                unsigned char b3 = bytes[p++];
+                int d0  = ((b1 >> 2) & 0x0F) - 8;
+                int d1  = ((b1 & 0x03) << 2) + ((b2 >> 6) & 0x03) - 8;
+                int d2  = ((b2 >> 2) & 0x0F) - 8;
+                int d3  = ((b2 & 0x03) << 2) + ((b3 >> 6) & 0x03) - 8;
+                int dcb = ((b3 >> 3) & 0x07) - 4;
+                int dcr =  (b3 & 0x07) - 4;
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, d0, d1, d2, d3, dcb, dcr);
+            } else if ((b1 & QOY_OP_554_MASK) == QOY_OP_554) {
+                QOY_STAT(s, counting, QOY_STAT_554, 4);
+                unsigned char b2 = bytes[p++];
+                unsigned char b3 = bytes[p++];
+                unsigned char b4 = bytes[p++];
+                int d0  =  (b1 & 0x1F) - 16;
+                int d1  = ((b2 >> 3) & 0x1F) - 16;
+                int d2  = ((b2 & 0x07) << 2) + ((b3 >> 6) & 0x03) - 16;
+                int d3  = ((b3 >> 1) & 0x1F) - 16;
+                int dcb = ((b3 & 0x01) << 4) + ((b4 >> 4) & 0x0F) - 16;
+                int dcr =  (b4 & 0x0F) - 8;
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, d0, d1, d2, d3, dcb, dcr);
+            } else if ((b1 & QOY_OP_666_MASK) == QOY_OP_666) {
+                QOY_STAT(s, counting, QOY_STAT_666, 5);
+                unsigned char b2 = bytes[p++];
+                unsigned char b3 = bytes[p++];
+                unsigned char b4 = bytes[p++];
+                unsigned char b5 = bytes[p++];
+                int d0  = ((b1 & 0x0F) << 2) + ((b2 >> 6) & 0x03) - 32;
+                int d1  =  (b2 & 0x3F) - 32;
+                int d2  = ((b3 >> 2) & 0x3F) - 32;
+                int d3  = ((b3 & 0x03) << 4) + ((b4 >> 4) & 0x0F) - 32;
+                int dcb = ((b4 & 0x0F) << 2) + ((b5 >> 6) & 0x03) - 32;
+                int dcr =  (b5 & 0x3F) - 32;
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, d0, d1, d2, d3, dcb, dcr);
+            } else if ((b1 & QOY_OP_INDEX_MASK) == QOY_OP_INDEX && indexed) {
+                memcpy(&px, s->index[b1 & 0x07], 6);
+                QOY_STAT(s, counting, QOY_STAT_INDEX, 1);
+            } else if ((b1 & QOY_OP_865_MASK) == QOY_OP_865) {
+                QOY_STAT(s, counting, QOY_STAT_865, 6);
+                unsigned char b2 = bytes[p++];
+                unsigned char b3 = bytes[p++];
+                unsigned char b4 = bytes[p++];
+                unsigned char b5 = bytes[p++];
+                unsigned char b6 = bytes[p++];
+                int d0  = ((b1 & 0x07) << 5) + ((b2 >> 3) & 0x1F) - 128;
+                int d1  = ((b2 & 0x07) << 5) + ((b3 >> 3) & 0x1F) - 128;
+                int d2  = ((b3 & 0x07) << 5) + ((b4 >> 3) & 0x1F) - 128;
+                int d3  = ((b4 & 0x07) << 5) + ((b5 >> 3) & 0x1F) - 128;
+                int dcb = ((b5 & 0x07) << 3) + ((b6 >> 5) & 0x07) - 32;
+                int dcr =  (b6 & 0x1F) - 16;
+                qoy_reconstruct(pred, &px, &up, &up_left, x == 0, d0, d1, d2, d3, dcb, dcr);
+            }
+
+            if (indexed && (b1 & QOY_OP_RUN_MASK) != QOY_OP_RUN_1 && (b1 & QOY_OP_RUN_MASK) != QOY_OP_RUN_X) {
+                memcpy(s->index[QOY_INDEX_HASH(&px)], &px, 6);
+            }
+        }
+
+        memcpy(row, &px, stride);
+    }
+
+    s->px = px;
+    s->run = run;
+    return p;
+}
+
+/* Pick the op loop for the predictor and index flag of a row pair, for a
+constant stride and counting */
+static inline __attribute__((__always_inline__)) int qoy_decode_row_pair_with(qoy_decode_state_t *s, const unsigned char *bytes, int p, int chunks_len, unsigned char *row, const unsigned char *row_up, int blocks, int stride, int pred, int counting) {
+    if (s->indexed) {
+        switch (pred) {
+            case QOY_PRED_LEFT: return qoy_decode_row_pair(s, bytes, p, chunks_len, row, row_up, blocks, stride, QOY_PRED_LEFT, 1, counting);
+            case QOY_PRED_UP:   return qoy_decode_row_pair(s, bytes, p, chunks_len, row, row_up, blocks, stride, QOY_PRED_UP,   1, counting);
+            default:            return qoy_decode_row_pair(s, bytes, p, chunks_len, row, row_up, blocks, stride, QOY_PRED_MED,  1, counting);
+        }
+    }
+    switch (pred) {
+        case QOY_PRED_LEFT: return qoy_decode_row_pair(s, bytes, p, chunks_len, row, row_up, blocks, stride, QOY_PRED_LEFT, 0, counting);
+        case QOY_PRED_UP:   return qoy_decode_row_pair(s, bytes, p, chunks_len, row, row_up, blocks, stride, QOY_PRED_UP,   0, counting);
+        default:            return qoy_decode_row_pair(s, bytes, p, chunks_len, row, row_up, blocks, stride, QOY_PRED_MED,  0, counting);
+    }
+}
+
+/* Decode the predictor byte, if any, and the blocks of the next row pair. first
+is set for the first row pair of a region. stride is the size of an output
+block, 6 or 10; it is made a constant as well, so storing a block doesn't
+go through a variable length memcpy. Returns the new read position, or -1 on
+invalid data. */
+static inline __attribute__((__always_inline__)) int qoy_decode_next_row_pair(qoy_decode_state_t *s, int flags, int first, const unsigned char *bytes, int p, int chunks_len, unsigned char *row, const unsigned char *row_up, int blocks, int stride) {
+    int pred = QOY_PRED_LEFT;
+    if (flags & QOY_FLAG_PREDICT) {
+        if (p >= chunks_len) {
+            return -1;
+        }
+        pred = bytes[p++];
+        if (pred > QOY_PRED_MED || (first && pred != QOY_PRED_LEFT)) {
+            return -1;
+        }
+        QOY_STAT(s, s->stats_enabled, QOY_STAT_PRED, 1);
+    }
+
+#ifdef QOY_STATS
+    if (s->stats_enabled) {
+        if (stride == 10) {
+            return qoy_decode_row_pair_with(s, bytes, p, chunks_len, row, row_up, blocks, 10, pred, 1);
+        }
+        return qoy_decode_row_pair_with(s, bytes, p, chunks_len, row, row_up, blocks, 6, pred, 1);
+    }
+#endif
+    if (stride == 10) {
+        return qoy_decode_row_pair_with(s, bytes, p, chunks_len, row, row_up, blocks, 10, pred, 0);
+    }
+    return qoy_decode_row_pair_with(s, bytes, p, chunks_len, row, row_up, blocks, 6, pred, 0);
+}
+
+/* Scratch space of qoy_decode_region: a row pair of 10 byte blocks for RGBA
+output and, for QOY_FLAG_LZ, the unpacked chunks with the end marker */
+#define QOY_DECODE_ROW_SCRATCH(width) ((((width) + 1) >> 1) * 10)
+
+static int qoy_decode_scratch_size(const qoy_desc *desc) {
+    int x, y, width, height;
+    qoy_tile_rect(desc, 0, &x, &y, &width, &height);
+    return QOY_DECODE_ROW_SCRATCH(width) + ((desc->flags & QOY_FLAG_LZ) ? qoy_chunks_max(width, height, desc->channels, desc->flags & ~QOY_FLAG_LZ) + (int)sizeof(qoy_padding) : 0);
+}
+
+/* Check the out_channels and out_format of a decode and resolve out_channels: 0
+is the channels of the image, the packed formats decode to 3 (RGB565) or 4
+(RGBA4444) channels before they are packed. Returns the channels to decode to,
+or 0 if out_channels or out_format are invalid. */
+static int qoy_out_channels(int channels, int out_channels, int out_format) {
+    int format = out_format & ~QOY_FORMAT_DITHER;
+    if (format == QOY_FORMAT_RGB565) {
+        return 3;
+    } else if (format == QOY_FORMAT_RGBA4444) {
+        return 4;
+    } else if (out_format != QOY_FORMAT_RGBA && out_format != QOY_FORMAT_YCBCR420A) {
+        return 0;
+    }
+    if (out_channels == 0) out_channels = channels;
+    return out_channels == 3 || out_channels == 4 ? out_channels : 0;
+}
+
+/* Bytes per pixel of the formats other than QOY_FORMAT_YCBCR420A, for
+out_channels as resolved by qoy_out_channels */
+static inline int qoy_pixel_size(int out_channels, int out_format) {
+    return out_format == QOY_FORMAT_RGBA ? out_channels : 2;
+}
+
+static size_t qoy_decoded_size(const qoy_desc *desc, int out_channels, int out_format) {
+    return out_format == QOY_FORMAT_YCBCR420A ?
+        (size_t)qoy_ycbcra_size(desc->width, desc->height, out_channels) :
+        (size_t)desc->width * desc->height * qoy_pixel_size(out_channels, out_format);
+}
+
+/* Decode the chunks of a region of the image, the whole image or a tile, from
+bytes at p. end is the end of the data of the region including its end marker.
+pixels points to the top left pixel (RGBA or packed) or block (YCbCrA) of the
+region in the output, stride is the distance in bytes between its lines (RGBA
+or packed) or row pairs (YCbCrA). Tiles start at multiples of 4 pixels, so the
+dither matrix is aligned to the region. scratch may be NULL, else all working memory is taken from it
+and it must have room for qoy_decode_scratch_size bytes of an image at least as
+large as the region. Returns 0 on success, or -1 on invalid data or if malloc
+failed. */
+static int qoy_decode_region(const unsigned char *bytes, int p, int end, int channels, int flags, unsigned char *pixels, int stride, int width, int height, int out_channels, int out_format, qoy_stats *stats, unsigned char *scratch) {
+    int internal_height = (height + 1) & ~0x01;
+    int size_ycbcra = (out_channels == 4) ? 10 : 6;
+    int blocks = (width + 1) >> 1;
+    int row_size = size_ycbcra * blocks;
+
+    /* LZ compressed chunks are unpacked up front, the ops are then decoded from
+    the unpacked copy */
+    int chunks_len = end - (int)sizeof(qoy_padding);
+    unsigned char *unpacked = NULL;
+    if (flags & QOY_FLAG_LZ) {
+        unpacked = qoy_lz_unpack(bytes, end, p, qoy_chunks_max(width, height, channels, flags & ~QOY_FLAG_LZ), &chunks_len, scratch ? scratch + QOY_DECODE_ROW_SCRATCH(width) : NULL);
+        if (!unpacked) {
+            return -1;
+        }
+        bytes = unpacked;
+        p = 0;
+    }
+
+    /* RGBA output is converted per row pair from a single row pair buffer,
+    which still holds the row pair above while it is being overwritten */
+    unsigned char *buffer = pixels;
+    if (out_format != QOY_FORMAT_YCBCR420A) {
+        buffer = scratch ? scratch : (unsigned char *)QOY_MALLOC(row_size);
+        if (!buffer) {
+            if (unpacked) QOY_FREE(unpacked);
+            return -1;
+        }
+    }
+
+    qoy_decode_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.px.a[0] = 255;
+    state.px.a[1] = 255;
+    state.px.a[2] = 255;
+    state.px.a[3] = 255;
+    state.alpha = channels == 4;
+    state.indexed = (flags & QOY_FLAG_INDEX) != 0;
+    state.alpha_run = (flags & QOY_FLAG_ALPHA_RUN) != 0;
+#ifdef QOY_STATS
+    state.stats_enabled = stats != NULL;
+#else
+    (void)stats;
+#endif
+
+    for (int y = 0; y < internal_height; y += 2) {
+        unsigned char *row_up = (out_format == QOY_FORMAT_YCBCR420A) ? buffer - stride : buffer;
+        p = qoy_decode_next_row_pair(&state, flags, y == 0, bytes, p, chunks_len, buffer, row_up, blocks, size_ycbcra);
+        if (p < 0) {
+            break;
+        }
+
+        if (out_format != QOY_FORMAT_YCBCR420A) {
+            qoy_ycbcra_to_rgba_two_lines(
+                buffer,
+                width,
+                height != internal_height && y == height - 1 ? 1 : 2,
+                stride,
+                out_channels,
+                out_channels,
+                out_format,
+                y,
+                pixels + (size_t)y * stride
+            );
+        } else {
+            buffer += stride;
+        }
+    }
+    if (!scratch) {
+        if (out_format != QOY_FORMAT_YCBCR420A) QOY_FREE(buffer);
+        if (unpacked) QOY_FREE(unpacked);
+    }
+
+#ifdef QOY_STATS
+    if (stats) {
+        qoy_stats_add(stats, &state.stats);
+    }
+#endif
+    return p < 0 ? -1 : 0;
+}
+
+/* Read and validate the QOY_HEADER_SIZE bytes of the header. Returns the
+position after it, or -1 on invalid data. */
+static int qoy_parse_header(const unsigned char *bytes, qoy_desc *desc) {
+    int p = 0;
+    unsigned int header_magic = qoy_read_32(bytes, &p);
+    desc->width = qoy_read_32(bytes, &p);
+    desc->height = qoy_read_32(bytes, &p);
+    desc->channels = bytes[p++];
+    desc->colorspace = bytes[p] & 0x01;
+    desc->flags = bytes[p++] & ~0x01;
+
+    if (
+        desc->width == 0 || desc->height == 0 ||
+        desc->width >= QOY_PIXELS_MAX || desc->height >= QOY_PIXELS_MAX ||
+        desc->channels < 3 || desc->channels > 4 ||
+        (desc->flags & ~QOY_FLAGS_ALL) != 0 ||
+        header_magic != QOY_MAGIC ||
+        ((desc->height + 1) & ~0x01) >= QOY_PIXELS_MAX / ((desc->width + 1) & ~0x01)
+    ) {
+        return -1;
+    }
+    return p;
+}
+
+/* Read and validate the header, and check that the tile offsets and checksums
+fit and that the checksum of the header and tile offsets matches. Returns the
+position after the header, or -1 on invalid data. */
+static int qoy_read_header(const unsigned char *bytes, int size, qoy_desc *desc) {
+    if (size < QOY_HEADER_SIZE + (int)sizeof(qoy_padding)) {
+        return -1;
+    }
+
+    int p = qoy_parse_header(bytes, desc);
+    if (p < 0 || (size - p) / 4 < qoy_tables_size(desc) / 4) {
+        return -1;
+    }
+
+    if (desc->flags & QOY_FLAG_CRC) {
+        int crcs = qoy_crcs_start(desc);
+        int c = crcs;
+        if (qoy_read_32(bytes, &c) != qoy_crc32c(0, bytes, crcs)) {
+            return -1;
+        }
+    }
+    return p;
+}
+
+/* The data of a tile, from start up to end including its end marker, the whole
+data without QOY_FLAG_TILED. Returns 0 on success or -1 on an invalid tile
+table. */
+static int qoy_tile_span(const unsigned char *bytes, int size, const qoy_desc *desc, int tile, int *start, int *end) {
+    int tiles_start = QOY_HEADER_SIZE + qoy_tables_size(desc);
+    *start = tiles_start;
+    *end = size;
+    if (desc->flags & QOY_FLAG_TILED) {
+        int tiles = qoy_tiles(desc);
+        int p = QOY_HEADER_SIZE + tile * 4;
+        unsigned int tile_start = qoy_read_32(bytes, &p);
+        unsigned int tile_end = tile + 1 < tiles ? qoy_read_32(bytes, &p) : (unsigned int)(size - tiles_start);
+        if (
+            tile_start > tile_end ||
+            tile_end > (unsigned int)(size - tiles_start) ||
+            tile_end - tile_start < sizeof(qoy_padding)
+        ) {
+            return -1;
+        }
+        *start = tiles_start + tile_start;
+        *end = tiles_start + tile_end;
+    } else if (size - tiles_start < (int)sizeof(qoy_padding)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether the QOY_FLAG_CRC checksum of the data of a tile from start to end
+matches, always true without the flag */
+static int qoy_tile_crc_ok(const unsigned char *bytes, const qoy_desc *desc, int tile, int start, int end) {
+    if (!(desc->flags & QOY_FLAG_CRC)) {
+        return 1;
+    }
+    int p = qoy_crcs_start(desc) + (1 + tile) * 4;
+    return qoy_read_32(bytes, &p) == qoy_crc32c(0, bytes + start, end - start);
+}
+
+/* Decode a tile into its place in the image, the whole image without
+QOY_FLAG_TILED. stats and scratch may be NULL, as for qoy_decode_region.
+Returns 0 on success, or -1 on invalid data or if malloc failed. */
+static int qoy_decode_tile_at(const unsigned char *bytes, int size, const qoy_desc *desc, int tile, unsigned char *pixels, int out_channels, int out_format, qoy_stats *stats, unsigned char *scratch) {
+    int start, end;
+    if (
+        qoy_tile_span(bytes, size, desc, tile, &start, &end) < 0 ||
+        !qoy_tile_crc_ok(bytes, desc, tile, start, end)
+    ) {
+        return -1;
+    }
+
+    int x, y, width, height;
+    qoy_tile_rect(desc, tile, &x, &y, &width, &height);
+
+    int stride;
+    if (out_format == QOY_FORMAT_YCBCR420A) {
+        stride = qoy_ycbcra_size(desc->width, 2, out_channels);
+        pixels += (y >> 1) * stride + (x >> 1) * (out_channels == 4 ? 10 : 6);
+    } else {
+        int pixel_size = qoy_pixel_size(out_channels, out_format);
+        stride = desc->width * pixel_size;
+        pixels += y * stride + x * pixel_size;
+    }
+    return qoy_decode_region(bytes, start, end, desc->channels, desc->flags, pixels, stride, width, height, out_channels, out_format, stats, scratch);
+}
+
+int qoy_decode_header(const void *data, int size, qoy_desc *desc) {
+    if (data == NULL || desc == NULL) {
+        return 0;
+    }
+    return qoy_read_header((const unsigned char *)data, size, desc) >= 0;
+}
+
+int qoy_decode_tile(const void *data, int size, int tile, void *pixels, int out_channels, int out_format) {
+    qoy_desc desc;
+    if (
+        data == NULL || pixels == NULL ||
+        qoy_read_header((const unsigned char *)data, size, &desc) < 0
+    ) {
+        return 0;
+    }
+
+    out_channels = qoy_out_channels(desc.channels, out_channels, out_format);
+    if (out_channels == 0 || tile < 0 || tile >= qoy_tiles(&desc)) {
+        return 0;
+    }
+
+    return qoy_decode_tile_at((const unsigned char *)data, size, &desc, tile, (unsigned char *)pixels, out_channels, out_format, NULL, NULL) == 0;
+}
+
+int qoy_verify(const void *data, int size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    qoy_desc desc;
+    if (
+        data == NULL ||
+        qoy_read_header(bytes, size, &desc) < 0 ||
+        !(desc.flags & QOY_FLAG_CRC)
+    ) {
+        return 0;
+    }
+
+    int tiles = qoy_tiles(&desc);
+    for (int tile = 0; tile < tiles; tile++) {
+        int start, end;
+        if (
+            qoy_tile_span(bytes, size, &desc, tile, &start, &end) < 0 ||
+            !qoy_tile_crc_ok(bytes, &desc, tile, start, end)
+        ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *qoy_decode_with_stats(const void *data, int size, qoy_desc *desc, int out_channels, int out_format, qoy_stats *stats) {
+    if (
+        data == NULL || desc == NULL ||
+        qoy_read_header((const unsigned char *)data, size, desc) < 0
+    ) {
+        return NULL;
+    }
+
+    out_channels = qoy_out_channels(desc->channels, out_channels, out_format);
+    if (out_channels == 0) {
+        return NULL;
+    }
+
+    unsigned char *pixels = (unsigned char *)QOY_MALLOC(qoy_decoded_size(desc, out_channels, out_format));
+    if (!pixels) {
+        return NULL;
+    }
+
+    int tiles = qoy_tiles(desc);
+    for (int tile = 0; tile < tiles; tile++) {
+        if (qoy_decode_tile_at((const unsigned char *)data, size, desc, tile, pixels, out_channels, out_format, stats, NULL) < 0) {
+            QOY_FREE(pixels);
+            return NULL;
+        }
+    }
+
+    return pixels;
+}
+
+void *qoy_decode(const void *data, int size, qoy_desc *desc, int out_channels, int out_format) {
+    return qoy_decode_with_stats(data, size, desc, out_channels, out_format, NULL);
+}
+
+#ifdef QOY_STATS
+void *qoy_decode_stats(const void *data, int size, qoy_desc *desc, int out_channels, int out_format, qoy_stats *stats) {
+    if (stats == NULL) {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(*stats));
+    void *pixels = qoy_decode_with_stats(data, size, desc, out_channels, out_format, stats);
+    qoy_stats_finish(stats);
+    return pixels;
+}
+#endif
+
+/* -----------------------------------------------------------------------------
+Damage */
+
+/* Whether [a, a + a_len) and [b, b + b_len) overlap, where b + b_len does not
+overflow */
+static int qoy_spans_overlap(unsigned int a, unsigned int a_len, unsigned int b, unsigned int b_len) {
+    return a_len > 0 && a < b + b_len && (a >= b || b - a < a_len);
+}
+
+static int qoy_tile_damaged(const qoy_desc *desc, int tile, const qoy_rect *rects, int count) {
+    int x, y, width, height;
+    qoy_tile_rect(desc, tile, &x, &y, &width, &height);
+    for (int i = 0; i < count; i++) {
+        if (
+            qoy_spans_overlap(rects[i].x, rects[i].width, x, width) &&
+            qoy_spans_overlap(rects[i].y, rects[i].height, y, height)
+        ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *qoy_encode_damage(const void *prev, int prev_size, const void *data, const qoy_rect *rects, int count, int *out_len, int in_channels, int in_format, const qoy_options *options) {
+    const unsigned char *prev_bytes = (const unsigned char *)prev;
+    int effort = options ? options->effort : QOY_EFFORT_FAST;
+    int max_error = options ? options->max_error : 0;
+    qoy_desc desc;
+    if (
+        prev == NULL || data == NULL || out_len == NULL ||
+        count < 0 || (count > 0 && rects == NULL) ||
+        effort < QOY_EFFORT_FAST || effort > QOY_EFFORT_BEST ||
+        max_error < 0 || max_error > 255 ||
+        qoy_read_header(prev_bytes, prev_size, &desc) < 0
+    ) {
+        return NULL;
+    }
+    if (effort == QOY_EFFORT_BEST) effort = QOY_EFFORT_BETTER;
+    if (in_channels == 0) in_channels = desc.channels;
+    if (!(desc.flags & QOY_FLAG_TILED)) {
+        return qoy_encode_effort(data, &desc, out_len, in_channels, in_format, effort, max_error, NULL);
+    }
+    if (qoy_encode_bound(&desc, in_channels, in_format) == 0) {
+        return NULL;
+    }
+
+    /* Copied tiles keep their size, encoded ones take at most their bound */
+    int tiles = qoy_tiles(&desc);
+    long long max_size = QOY_HEADER_SIZE + qoy_tables_size(&desc);
+    for (int tile = 0; tile < tiles; tile++) {
+        int start, end;
+        if (qoy_tile_span(prev_bytes, prev_size, &desc, tile, &start, &end) < 0) {
+            return NULL;
+        }
+        if (qoy_tile_damaged(&desc, tile, rects, count)) {
+            int x, y, width, height;
+            qoy_tile_rect(&desc, tile, &x, &y, &width, &height);
+            max_size += qoy_chunks_max(width, height, desc.channels, desc.flags) + (int)sizeof(qoy_padding);
+        } else {
+            max_size += end - start;
+        }
+    }
+    if (max_size > 0x7fffffff) {
+        return NULL;
+    }
+
+    unsigned char *bytes = (unsigned char *)QOY_MALLOC(max_size);
+    unsigned char *scratch = (unsigned char *)QOY_MALLOC(qoy_encode_scratch_size(&desc));
+    unsigned char *ops = scratch ? qoy_encode_ops(&desc, scratch) : NULL;
+    int p = -1;
+    if (bytes && scratch) {
+        p = qoy_write_header(&desc, bytes);
+        int table = p;
+        int crcs = qoy_crcs_start(&desc);
+        p += qoy_tables_size(&desc);
+        int tiles_start = p;
+        for (int tile = 0; tile < tiles && p >= 0; tile++) {
+            qoy_write_32(bytes, &table, p - tiles_start);
+            /* The checksum of a copied tile is copied along with it */
+            int c = crcs + (1 + tile) * 4;
+            if (qoy_tile_damaged(&desc, tile, rects, count)) {
+                int tile_start = p;
+                p = qoy_encode_tile((const unsigned char *)data, &desc, tile, in_channels, in_format, effort, max_error, ops, bytes, p, NULL, scratch);
+                if ((desc.flags & QOY_FLAG_CRC) && p >= 0) {
+                    qoy_write_32(bytes, &c, qoy_crc32c(0, bytes + tile_start, p - tile_start));
+                }
+            } else {
+                int start, end;
+                qoy_tile_span(prev_bytes, prev_size, &desc, tile, &start, &end);
+                memcpy(bytes + p, prev_bytes + start, end - start);
+                p += end - start;
+                if (desc.flags & QOY_FLAG_CRC) {
+                    memcpy(bytes + c, prev_bytes + c, 4);
+                }
+            }
+        }
+        if ((desc.flags & QOY_FLAG_CRC) && p >= 0) {
+            qoy_write_32(bytes, &crcs, qoy_crc32c(0, bytes, crcs));
+        }
+    }
+    if (scratch) QOY_FREE(scratch);
+    if (p < 0) {
+        if (bytes) QOY_FREE(bytes);
+        return NULL;
+    }
+
+    *out_len = p;
+    return bytes;
+}
+
+
+/* -----------------------------------------------------------------------------
+Batches */
+
+#ifdef QOY_THREADS
+#include <pthread.h>
+#endif
+
+/* A contiguous range of the images of a batch, processed by one thread */
+typedef struct qoy_batch_range {
+    void (*run)(struct qoy_batch_range *r);
+    const unsigned char *const *data;
+    const int *sizes;
+    const qoy_desc *descs;
+    int channels;
+    int format;
+    int effort;
+    int max_error;
+    int drop_opaque_alpha;
+    unsigned char *arena;
+    size_t *offsets;
+    int begin;
+    int end;
+    size_t start;
+    size_t stop;
+    int error;
+} qoy_batch_range_t;
+
+#ifdef QOY_THREADS
+static void *qoy_batch_thread(void *arg) {
+    qoy_batch_range_t *r = (qoy_batch_range_t *)arg;
+    r->run(r);
+    return NULL;
+}
+#endif
+
+/* Run the ranges, all but the first on threads of their own. A range whose
+thread can't be started is run on the calling thread. Returns -1 if any range
+failed. */
+static int qoy_batch_run(qoy_batch_range_t *ranges, int count) {
+#ifdef QOY_THREADS
+    pthread_t threads[64];
+    int started[64];
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, qoy_batch_thread, &ranges[i]) == 0;
+    }
+    ranges[0].run(&ranges[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            ranges[i].run(&ranges[i]);
+        }
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        ranges[i].run(&ranges[i]);
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        if (ranges[i].error) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Number of ranges to split count images into. At most 64 threads are used. */
+static int qoy_batch_ranges(int count, int threads) {
+#ifdef QOY_THREADS
+    if (threads > 64) threads = 64;
+    if (threads > count) threads = count;
+    return threads > 1 ? threads : 1;
+#else
+    (void)count;
+    (void)threads;
+    return 1;
+#endif
+}
+
+static void qoy_encode_batch_range(qoy_batch_range_t *r) {
+    int scratch_size = 0;
+    int trial_size = 0;
+    for (int i = r->begin; i < r->end; i++) {
+        int size = qoy_encode_scratch_size(&r->descs[i]);
+        if (size > scratch_size) scratch_size = size;
+        if (r->effort == QOY_EFFORT_BEST) {
+            size = qoy_encode_bound(&r->descs[i], r->channels ? r->channels : r->descs[i].channels, r->format);
+            if (size > trial_size) trial_size = size;
+        }
+    }
+    unsigned char *scratch = (unsigned char *)QOY_MALLOC(scratch_size + trial_size);
+    if (!scratch) {
+        r->error = 1;
+        return;
+    }
+
+    /* With scratch, encoding does no mallocs and can't fail. Dropping alpha
+    only makes the scratch and the encoded image smaller. */
+    size_t p = r->start;
+    for (int i = r->begin; i < r->end; i++) {
+        int channels = r->channels ? r->channels : r->descs[i].channels;
+        qoy_desc reduced;
+        const qoy_desc *desc = qoy_encode_desc(r->data[i], &r->descs[i], channels, r->format, r->drop_opaque_alpha, &reduced);
+        r->offsets[i] = p;
+        if (r->effort == QOY_EFFORT_BEST) {
+            p += qoy_encode_best_into(r->data[i], desc, channels, r->format, r->max_error, r->arena + p, scratch + scratch_size, NULL, scratch);
+        } else {
+            p += qoy_encode_into(r->data[i], desc, channels, r->format, r->effort, r->max_error, r->arena + p, NULL, scratch);
+        }
+    }
+    r->stop = p;
+    QOY_FREE(scratch);
+}
+
+size_t qoy_encode_batch_bound(int count, const qoy_desc *descs, int in_channels, int in_format) {
+    if (count <= 0 || descs == NULL) {
+        return 0;
+    }
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        int size = qoy_encode_bound(&descs[i], in_channels ? in_channels : descs[i].channels, in_format);
+        if (size == 0) {
+            return 0;
+        }
+        total += size;
+    }
+    return total;
+}
+
+int qoy_encode_batch(int count, const void *const *data, const qoy_desc *descs, int in_channels, int in_format, const qoy_options *options, void *arena, size_t *offsets, int threads) {
+    int effort = options ? options->effort : QOY_EFFORT_FAST;
+    int max_error = options ? options->max_error : 0;
+    if (
+        data == NULL || arena == NULL || offsets == NULL ||
+        qoy_encode_batch_bound(count, descs, in_channels, in_format) == 0 ||
+        effort < QOY_EFFORT_FAST || effort > QOY_EFFORT_BEST ||
+        max_error < 0 || max_error > 255
+    ) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (data[i] == NULL) {
+            return -1;
+        }
+    }
+
+    /* Each range starts where the bounds of the images before it end */
+    qoy_batch_range_t ranges[64];
+    int n = qoy_batch_ranges(count, threads);
+    size_t start = 0;
+    for (int t = 0, i = 0; t < n; t++) {
+        qoy_batch_range_t *r = &ranges[t];
+        memset(r, 0, sizeof(*r));
+        r->run = qoy_encode_batch_range;
+        r->data = (const unsigned char *const *)data;
+        r->descs = descs;
+        r->channels = in_channels;
+        r->format = in_format;
+        r->effort = effort;
+        r->max_error = max_error;
+        r->drop_opaque_alpha = options && options->drop_opaque_alpha;
+        r->arena = (unsigned char *)arena;
+        r->offsets = offsets;
+        r->begin = (int)((long long)count * t / n);
+        r->end = (int)((long long)count * (t + 1) / n);
+        for (; i < r->begin; i++) {
+            start += qoy_encode_bound(&descs[i], in_channels ? in_channels : descs[i].channels, in_format);
+        }
+        r->start = start;
+    }
+    if (qoy_batch_run(ranges, n) < 0) {
+        return -1;
+    }
+
+    size_t p = ranges[0].stop;
+    for (int t = 1; t < n; t++) {
+        qoy_batch_range_t *r = &ranges[t];
+        memmove((unsigned char *)arena + p, (unsigned char *)arena + r->start, r->stop - r->start);
+        for (int i = r->begin; i < r->end; i++) {
+            offsets[i] -= r->start - p;
+        }
+        p += r->stop - r->start;
+    }
+    offsets[count] = p;
+    return 0;
+}
+
+static void qoy_decode_batch_range(qoy_batch_range_t *r) {
+    qoy_desc desc;
+    int scratch_size = 0;
+    for (int i = r->begin; i < r->end; i++) {
+        qoy_read_header(r->data[i], r->sizes[i], &desc);
+        int size = qoy_decode_scratch_size(&desc);
+        if (size > scratch_size) scratch_size = size;
+    }
+    unsigned char *scratch = (unsigned char *)QOY_MALLOC(scratch_size);
+    if (!scratch) {
+        r->error = 1;
+        return;
+    }
+
+    for (int i = r->begin; i < r->end && !r->error; i++) {
+        qoy_read_header(r->data[i], r->sizes[i], &desc);
+        int channels = qoy_out_channels(desc.channels, r->channels, r->format);
+        int tiles = qoy_tiles(&desc);
+        for (int tile = 0; tile < tiles; tile++) {
+            if (qoy_decode_tile_at(r->data[i], r->sizes[i], &desc, tile, r->arena + r->offsets[i], channels, r->format, NULL, scratch) < 0) {
+                r->error = 1;
+                break;
+            }
+        }
+    }
+    QOY_FREE(scratch);
+}
+
+size_t qoy_decode_batch_size(int count, const void *const *data, const int *sizes, qoy_desc *descs, int out_channels, int out_format) {
+    if (
+        count <= 0 || data == NULL || sizes == NULL ||
+        qoy_out_channels(3, out_channels, out_format) == 0
+    ) {
+        return 0;
+    }
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        qoy_desc desc;
+        if (data[i] == NULL || qoy_read_header((const unsigned char *)data[i], sizes[i], &desc) < 0) {
+            return 0;
+        }
+        if (descs) {
+            descs[i] = desc;
+        }
+        total += qoy_decoded_size(&desc, qoy_out_channels(desc.channels, out_channels, out_format), out_format);
+    }
+    return total;
+}
+
+int qoy_decode_batch(int count, const void *const *data, const int *sizes, int out_channels, int out_format, void *arena, size_t *offsets, int threads) {
+    if (
+        arena == NULL || offsets == NULL ||
+        qoy_decode_batch_size(count, data, sizes, NULL, out_channels, out_format) == 0
+    ) {
+        return -1;
+    }
+
+    /* The decoded sizes are known up front, so all offsets are final */
+    size_t p = 0;
+    for (int i = 0; i < count; i++) {
+        qoy_desc desc;
+        qoy_read_header((const unsigned char *)data[i], sizes[i], &desc);
+        offsets[i] = p;
+        p += qoy_decoded_size(&desc, qoy_out_channels(desc.channels, out_channels, out_format), out_format);
+    }
+    offsets[count] = p;
+
+    qoy_batch_range_t ranges[64];
+    int n = qoy_batch_ranges(count, threads);
+    for (int t = 0; t < n; t++) {
+        qoy_batch_range_t *r = &ranges[t];
+        memset(r, 0, sizeof(*r));
+        r->run = qoy_decode_batch_range;
+        r->data = (const unsigned char *const *)data;
+        r->sizes = sizes;
+        r->channels = out_channels;
+        r->format = out_format;
+        r->arena = (unsigned char *)arena;
+        r->offsets = offsets;
+        r->begin = (int)((long long)count * t / n);
+        r->end = (int)((long long)count * (t + 1) / n);
+    }
+    return qoy_batch_run(ranges, n);
+}
+
+
+/* -----------------------------------------------------------------------------
+Streaming */
+
+#define QOY_STREAM_CHUNK 65536
+
+/* Read size bytes unless the data ends first. Returns the number of bytes read,
+or -1 on a read error. */
+static int qoy_read_all(qoy_read_fn read, void *user, unsigned char *buffer, int size) {
+    int total = 0;
+    while (total < size) {
+        int n = read(user, buffer + total, size - total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+struct qoy_decoder {
+    qoy_read_fn read;
+    void *user;
+    qoy_desc desc;
+    int out_channels;
+    int out_format;
+    int row_size;
+    int y;
+    int error;
+
+    /* Without QOY_FLAG_TILED: the decode state, two row pairs of blocks and a
+    window of chunks, read or unpacked from the LZ segments as needed */
+    qoy_decode_state_t state;
+    unsigned char *rows;
+    unsigned char *window;
+    int window_size;
+    int window_len;
+    int window_p;
+    int window_end;
+    unsigned int ops_left;
+    unsigned char *segment;
+
+    /* With QOY_FLAG_CRC: the checksums, and that of the chunks read so far
+    without QOY_FLAG_TILED */
+    unsigned int *crcs;
+    unsigned int crc;
+
+    /* With QOY_FLAG_TILED: the tile offsets, and a strip of tiles decoded in
+    the output format */
+    unsigned int *offsets;
+    unsigned int offset;
+    unsigned char *strip;
+    unsigned char *strip_data;
+    int strip_y;
+    int strip_lines;
+};
+
+/* qoy_read_all for the data after the header and tables, which is added to the
+checksum of QOY_FLAG_CRC */
+static int qoy_decoder_read_all(qoy_decoder *d, unsigned char *buffer, int size) {
+    int n = qoy_read_all(d->read, d->user, buffer, size);
+    if (d->crcs && n > 0) {
+        d->crc = qoy_crc32c(d->crc, buffer, n);
+    }
+    return n;
+}
+
+/* Make sure the window holds at least need bytes of chunks, or all that are
+left. Returns 0 on success or -1 on invalid data or read errors. */
+static int qoy_decoder_fill(qoy_decoder *d, int need) {
+    if (d->window_len - d->window_p >= need || d->window_end) {
+        return 0;
+    }
+
+    memmove(d->window, d->window + d->window_p, d->window_len - d->window_p);
+    d->window_len -= d->window_p;
+    d->window_p = 0;
+
+    while (d->window_len < need && !d->window_end) {
+        if (d->desc.flags & QOY_FLAG_LZ) {
+            if (d->ops_left == 0) {
+                d->window_end = 1;
+                break;
+            }
+            int len = d->ops_left < QOY_LZ_SEGMENT ? (int)d->ops_left : QOY_LZ_SEGMENT;
+            unsigned char info_bytes[4];
+            if (qoy_decoder_read_all(d, info_bytes, 4) != 4) {
+                return -1;
+            }
+            int p = 0;
+            unsigned int info = qoy_read_32(info_bytes, &p);
+            unsigned int data_len = info & ~QOY_LZ_STORED;
+            if ((info & QOY_LZ_STORED) ? (int)data_len != len : data_len > (unsigned int)QOY_LZ_BOUND(len)) {
+                return -1;
+            }
+            if ((int)data_len != qoy_decoder_read_all(d, d->segment, data_len)) {
+                return -1;
+            }
+            if (info & QOY_LZ_STORED) {
+                memcpy(d->window + d->window_len, d->segment, len);
+            } else if (qoy_lz_decompress(d->segment, data_len, d->window + d->window_len, len) < 0) {
+                return -1;
+            }
+            d->window_len += len;
+            d->ops_left -= len;
+        } else {
+            int n = d->read(d->user, d->window + d->window_len, d->window_size - d->window_len);
+            if (n < 0) {
+                return -1;
+            }
+            if (d->crcs && n > 0) {
+                d->crc = qoy_crc32c(d->crc, d->window + d->window_len, n);
+            }
+            d->window_end = n == 0;
+            d->window_len += n;
+        }
+    }
+
+    /* ops may read a few bytes past the bounds check, as past the end marker */
+    memset(d->window + d->window_len, QOY_OP_EOF, 16);
+    return 0;
+}
+
+/* Read the rest of the data after the last row pair, the end marker, and
+compare the checksum of QOY_FLAG_CRC. Returns 0 if it matches or -1 on a
+mismatch or read errors. */
+static int qoy_decoder_check(qoy_decoder *d) {
+    if (d->desc.flags & QOY_FLAG_LZ) {
+        unsigned char end[sizeof(qoy_padding)];
+        if (qoy_decoder_read_all(d, end, (int)sizeof(end)) != (int)sizeof(end)) {
+            return -1;
+        }
+    } else {
+        while (!d->window_end) {
+            d->window_p = d->window_len;
+            if (qoy_decoder_fill(d, d->window_size) < 0) {
+                return -1;
+            }
+        }
+    }
+    return d->crc == d->crcs[1] ? 0 : -1;
+}
+
+/* Read the next strip of tiles and decode it. Returns 0 on success or -1 on
+invalid data, read errors or if malloc failed. */
+static int qoy_decoder_strip(qoy_decoder *d) {
+    int tiles_x = (d->desc.width + QOY_TILE_SIZE - 1) / QOY_TILE_SIZE;
+    int tiles = qoy_tiles(&d->desc);
+    int first = (d->y / QOY_TILE_SIZE) * tiles_x;
+    int last = first + tiles_x;
+
+    /* Tiles are stored in order, the strip ends where the next one starts, or
+    at the end of the data */
+    unsigned int start = d->offsets[first];
+    if (start < d->offset) {
+        return -1;
+    }
+    for (; d->offset < start; d->offset++) {
+        unsigned char skip;
+        if (qoy_read_all(d->read, d->user, &skip, 1) != 1) {
+            return -1;
+        }
+    }
+
+    int len;
+    if (d->strip_data) QOY_FREE(d->strip_data);
+    d->strip_data = NULL;
+    if (last < tiles) {
+        unsigned int end = d->offsets[last];
+        if (end < start || end - start > 0x7fffffff) {
+            return -1;
+        }
+        len = end - start;
+        d->strip_data = (unsigned char *)QOY_MALLOC(len > 0 ? len : 1);
+        if (!d->strip_data || qoy_read_all(d->read, d->user, d->strip_data, len) != len) {
+            return -1;
+        }
+    } else {
+        int size = QOY_STREAM_CHUNK;
+        len = 0;
+        for (;;) {
+            unsigned char *grown = (unsigned char *)QOY_MALLOC(size);
+            if (!grown) {
+                return -1;
+            }
+            if (d->strip_data) {
+                memcpy(grown, d->strip_data, len);
+                QOY_FREE(d->strip_data);
+            }
+            d->strip_data = grown;
+            int n = qoy_read_all(d->read, d->user, d->strip_data + len, size - len);
+            if (n < 0) {
+                return -1;
+            }
+            len += n;
+            if (len < size) {
+                break;
+            }
+            size *= 2;
+        }
+    }
+    d->offset += len;
+
+    d->strip_y = (first / tiles_x) * QOY_TILE_SIZE;
+    d->strip_lines = (int)d->desc.height - d->strip_y < QOY_TILE_SIZE ? (int)d->desc.height - d->strip_y : QOY_TILE_SIZE;
+    int pixel_size = qoy_pixel_size(d->out_channels, d->out_format);
+    int stride = d->out_format == QOY_FORMAT_YCBCR420A ? d->row_size : (int)d->desc.width * pixel_size;
+    for (int tile = first; tile < last; tile++) {
+        unsigned int tile_start = d->offsets[tile] - start;
+        unsigned int tile_end = tile + 1 < last ? d->offsets[tile + 1] - start : (unsigned int)len;
+        if (tile_start > tile_end || tile_end > (unsigned int)len || tile_end - tile_start < sizeof(qoy_padding)) {
+            return -1;
+        }
+        if (d->crcs && qoy_crc32c(0, d->strip_data + tile_start, tile_end - tile_start) != d->crcs[1 + tile]) {
+            return -1;
+        }
+
+        int x, y, width, height;
+        qoy_tile_rect(&d->desc, tile, &x, &y, &width, &height);
+        unsigned char *pixels = d->out_format == QOY_FORMAT_YCBCR420A ?
+            d->strip + (x >> 1) * (d->out_channels == 4 ? 10 : 6) :
+            d->strip + x * pixel_size;
+        if (qoy_decode_region(d->strip_data, tile_start, tile_end, d->desc.channels, d->desc.flags, pixels, stride, width, height, d->out_channels, d->out_format, NULL, NULL) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+qoy_decoder *qoy_decoder_open(qoy_read_fn read, void *user, qoy_desc *desc, int out_channels, int out_format) {
+    unsigned char header[QOY_HEADER_SIZE];
+    if (
+        read == NULL || desc == NULL ||
+        qoy_read_all(read, user, header, QOY_HEADER_SIZE) != QOY_HEADER_SIZE
+    ) {
+        return NULL;
+    }
+
+    /* The size of the data is not known up front, the tile table and chunks
+    are checked as they are read */
+    if (qoy_parse_header(header, desc) < 0) {
+        return NULL;
+    }
+
+    out_channels = qoy_out_channels(desc->channels, out_channels, out_format);
+    if (out_channels == 0) {
+        return NULL;
+    }
+
+    qoy_decoder *d = (qoy_decoder *)QOY_MALLOC(sizeof(qoy_decoder));
+    if (!d) {
+        return NULL;
+    }
+    memset(d, 0, sizeof(*d));
+    d->read = read;
+    d->user = user;
+    d->desc = *desc;
+    d->out_channels = out_channels;
+    d->out_format = out_format;
+    d->row_size = qoy_ycbcra_size(desc->width, 2, out_channels);
+
+    int ok = 1;
+    int tiles = qoy_tiles(desc);
+    unsigned int crc = qoy_crc32c(0, header, QOY_HEADER_SIZE);
+    if (desc->flags & QOY_FLAG_TILED) {
+        /* The strip holds one row of tiles. Lines in it are addressed with
+        int offsets, wider images than that allows are refused */
+        size_t lines = desc->height < QOY_TILE_SIZE ? desc->height : QOY_TILE_SIZE;
+        size_t strip_size = out_format == QOY_FORMAT_YCBCR420A ?
+            (size_t)d->row_size * ((lines + 1) >> 1) :
+            (size_t)desc->width * qoy_pixel_size(out_channels, out_format) * lines;
+        if (strip_size > 0x7fffffff) {
+            qoy_decoder_close(d);
+            return NULL;
+        }
+        d->offsets = (unsigned int *)QOY_MALLOC(tiles * sizeof(unsigned int));
+        d->strip = (unsigned char *)QOY_MALLOC(strip_size);
+        ok = d->offsets && d->strip;
+        for (int tile = 0; ok && tile < tiles; tile++) {
+            unsigned char offset_bytes[4];
+            int p = 0;
+            ok = qoy_read_all(read, user, offset_bytes, 4) == 4;
+            d->offsets[tile] = qoy_read_32(offset_bytes, &p);
+            crc = qoy_crc32c(crc, offset_bytes, 4);
+        }
+    }
+
+    if (ok && (desc->flags & QOY_FLAG_CRC)) {
+        d->crcs = (unsigned int *)QOY_MALLOC((1 + tiles) * sizeof(unsigned int));
+        ok = d->crcs != NULL;
+        for (int i = 0; ok && i < 1 + tiles; i++) {
+            unsigned char crc_bytes[4];
+            int p = 0;
+            ok = qoy_read_all(read, user, crc_bytes, 4) == 4;
+            d->crcs[i] = qoy_read_32(crc_bytes, &p);
+        }
+        ok = ok && d->crcs[0] == crc;
+    }
+
+    if (ok && !(desc->flags & QOY_FLAG_TILED)) {
+        /* A row pair takes at most a predictor byte and 12 bytes per block,
+        the window has room for that and a full read or LZ segment */
+        d->window_size = 1 + ((desc->width + 1) >> 1) * 12 + QOY_STREAM_CHUNK;
+        d->window = (unsigned char *)QOY_MALLOC(d->window_size + 16);
+        d->rows = (unsigned char *)QOY_MALLOC(d->row_size * 2);
+        ok = d->window && d->rows;
+        if (ok && (desc->flags & QOY_FLAG_LZ)) {
+            unsigned char size_bytes[4];
+            int p = 0;
+            d->segment = (unsigned char *)QOY_MALLOC(QOY_LZ_BOUND(QOY_LZ_SEGMENT));
+            ok = d->segment && qoy_decoder_read_all(d, size_bytes, 4) == 4;
+            d->ops_left = qoy_read_32(size_bytes, &p);
+            ok = ok && d->ops_left <= (unsigned int)qoy_chunks_max(desc->width, desc->height, desc->channels, desc->flags & ~QOY_FLAG_LZ);
+        }
+
+        d->state.px.a[0] = 255;
+        d->state.px.a[1] = 255;
+        d->state.px.a[2] = 255;
+        d->state.px.a[3] = 255;
+        d->state.alpha = desc->channels == 4;
+        d->state.indexed = (desc->flags & QOY_FLAG_INDEX) != 0;
+        d->state.alpha_run = (desc->flags & QOY_FLAG_ALPHA_RUN) != 0;
+    }
+
+    if (!ok) {
+        qoy_decoder_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+int qoy_decoder_lines(qoy_decoder *d, void *pixels) {
+    if (d == NULL || pixels == NULL || d->error) {
+        return -1;
+    }
+    if (d->y >= (int)d->desc.height) {
+        return 0;
+    }
+
+    int y = d->y;
+    int lines = (int)d->desc.height - y < 2 ? 1 : 2;
+    int line_size = d->desc.width * qoy_pixel_size(d->out_channels, d->out_format);
+    d->y += 2;
+
+    if (d->desc.flags & QOY_FLAG_TILED) {
+        if (y % QOY_TILE_SIZE == 0 && qoy_decoder_strip(d) < 0) {
+            d->error = 1;
+            return -1;
+        }
+        if (d->out_format == QOY_FORMAT_YCBCR420A) {
+            memcpy(pixels, d->strip + ((y - d->strip_y) >> 1) * d->row_size, d->row_size);
+        } else {
+            memcpy(pixels, d->strip + (y - d->strip_y) * line_size, line_size * lines);
+        }
+        return lines;
+    }
+
+    int blocks = (d->desc.width + 1) >> 1;
+    unsigned char *row = d->rows + ((y >> 1) & 1) * d->row_size;
+    unsigned char *row_up = d->rows + (((y >> 1) + 1) & 1) * d->row_size;
+    if (qoy_decoder_fill(d, 1 + blocks * 12) < 0) {
+        d->error = 1;
+        return -1;
+    }
+    /* The end marker follows the chunks, LZ segments only hold the chunks */
+    int chunks_len = d->window_len;
+    if (d->window_end && !(d->desc.flags & QOY_FLAG_LZ)) {
+        chunks_len -= (int)sizeof(qoy_padding);
+    }
+    d->window_p = qoy_decode_next_row_pair(&d->state, d->desc.flags, y == 0, d->window, d->window_p, chunks_len, row, row_up, blocks, d->out_channels == 4 ? 10 : 6);
+    if (d->window_p < 0 || (d->crcs && d->y >= (int)d->desc.height && qoy_decoder_check(d) < 0)) {
+        d->error = 1;
+        return -1;
+    }
+
+    if (d->out_format == QOY_FORMAT_YCBCR420A) {
+        memcpy(pixels, row, d->row_size);
+    } else {
+        qoy_ycbcra_to_rgba_two_lines(row, d->desc.width, lines, line_size, d->out_channels, d->out_channels, d->out_format, y, pixels);
+    }
+    return lines;
+}
+
+void qoy_decoder_close(qoy_decoder *d) {
+    if (d == NULL) {
+        return;
+    }
+    if (d->rows) QOY_FREE(d->rows);
+    if (d->window) QOY_FREE(d->window);
+    if (d->segment) QOY_FREE(d->segment);
+    if (d->offsets) QOY_FREE(d->offsets);
+    if (d->crcs) QOY_FREE(d->crcs);
+    if (d->strip) QOY_FREE(d->strip);
+    if (d->strip_data) QOY_FREE(d->strip_data);
+    QOY_FREE(d);
+}
+
+struct qoy_encoder {
+    qoy_write_fn write;
+    void *user;
+    qoy_region_encoder_t region;
+    int line_size;
+    unsigned char *bytes;
+    int p;
+    int size;
+    int error;
+};
+
+/* Write out the encoded bytes so far, except for the last keep bytes. A run
+continues into the next row pair without QOY_FLAG_PREDICT and rewrites the last
+two bytes of its op as it grows. */
+static void qoy_encoder_flush(qoy_encoder *e, int keep) {
+    int len = e->p - keep;
+    if (!e->error && len > 0 && e->write(e->user, e->bytes, len) < 0) {
+        e->error = 1;
+    }
+    memmove(e->bytes, e->bytes + len, keep);
+    e->size += len;
+    e->p = keep;
+}
+
+qoy_encoder *qoy_encoder_open(qoy_write_fn write, void *user, const qoy_desc *desc, int in_channels, int in_format, const qoy_options *options) {
+    int effort = options ? options->effort : QOY_EFFORT_FAST;
+    int max_error = options ? options->max_error : 0;
+    if (desc && in_channels == 0) in_channels = desc->channels;
+    if (
+        write == NULL || desc == NULL ||
+        qoy_encode_bound(desc, in_channels, in_format) == 0 ||
+        (desc->flags & (QOY_FLAG_LZ | QOY_FLAG_TILED | QOY_FLAG_CRC)) != 0 ||
+        effort < QOY_EFFORT_FAST || effort > QOY_EFFORT_BETTER ||
+        max_error < 0 || max_error > 255
+    ) {
+        return NULL;
+    }
+
+    qoy_encoder *e = (qoy_encoder *)QOY_MALLOC(sizeof(qoy_encoder));
+    if (!e) {
+        return NULL;
+    }
+    memset(e, 0, sizeof(*e));
+    e->write = write;
+    e->user = user;
+    e->line_size = in_format == QOY_FORMAT_YCBCR420A ? qoy_ycbcra_size(desc->width, 2, in_channels) : (int)desc->width * in_channels;
+
+    /* Encoded row pairs are collected and written in chunks, a row pair takes
+    at most a predictor byte and 12 bytes per block */
+    e->bytes = (unsigned char *)QOY_MALLOC(QOY_STREAM_CHUNK + 1 + ((desc->width + 1) >> 1) * 12);
+    if (!e->bytes || qoy_region_encoder_init(&e->region, desc->width, desc->height, in_channels, in_format, desc->channels, desc->flags, effort, max_error, 1, NULL) < 0) {
+        if (e->bytes) QOY_FREE(e->bytes);
+        QOY_FREE(e);
+        return NULL;
+    }
+
+    qoy_write_32(e->bytes, &e->p, QOY_MAGIC);
+    qoy_write_32(e->bytes, &e->p, desc->width);
+    qoy_write_32(e->bytes, &e->p, desc->height);
+    e->bytes[e->p++] = desc->channels;
+    e->bytes[e->p++] = desc->colorspace | desc->flags;
+    return e;
+}
+
+int qoy_encoder_lines(qoy_encoder *e, const void *pixels) {
+    if (e == NULL || pixels == NULL || e->error || e->region.y >= e->region.height) {
+        return -1;
+    }
+
+    e->p = qoy_region_encode_row_pair(&e->region, (const unsigned char *)pixels, e->line_size, e->bytes, e->p);
+    if (e->p >= QOY_STREAM_CHUNK) {
+        qoy_encoder_flush(e, 2);
+    }
+    return e->error ? -1 : 0;
+}
+
+int qoy_encoder_close(qoy_encoder *e) {
+    if (e == NULL) {
+        return 0;
+    }
+
+    int complete = e->region.y >= e->region.height;
+    if (complete) {
+        for (int i = 0; i < (int)sizeof(qoy_padding); i++) {
+            e->bytes[e->p++] = qoy_padding[i];
+        }
+        qoy_encoder_flush(e, 0);
+    }
+    int size = complete && !e->error ? e->size : 0;
+
+    qoy_region_encoder_free(&e->region);
+    QOY_FREE(e->bytes);
+    QOY_FREE(e);
+    return size;
+}
+
+#ifndef QOY_NO_STDIO
+#include <stdio.h>
+
+/* Memory mapped files where POSIX provides them. Strict ISO C modes hide the
+POSIX functions, so _POSIX_C_SOURCE must be defined for them there. */
+#if !defined(QOY_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0 && \
+    (defined(__APPLE__) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L))
+#define QOY_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
+
+#ifdef QOY_MMAP
+
+/* Encode an image into memory and write it to fd. Returns the number of bytes
+written, or 0 on failure. */
+static int qoy_write_buffered(int fd, const void *data, const qoy_desc *desc) {
+    int size;
+    unsigned char *encoded = (unsigned char *)qoy_encode(data, desc, &size, desc->channels, QOY_FORMAT_RGBA);
+    if (!encoded) {
+        return 0;
+    }
+    for (int done = 0; done < size; ) {
+        ssize_t n = write(fd, encoded + done, size - done);
+        if (n <= 0) {
+            size = 0;
+            break;
+        }
+        done += (int)n;
+    }
+    QOY_FREE(encoded);
+    return size;
+}
+
+/* The file is sized for the largest possible encoding and mapped, the image is
+encoded straight into the mapping and the file then truncated to the encoded
+size. A write to a page of a shared mapping that the file system has no room
+for raises SIGBUS instead of failing, so the space is reserved first. That
+trades an up front reservation of the whole bound, released again by the
+truncate, for not copying the encoded image.
+
+The mapping is only used where the reservation is native, an extent the file
+system records without writing it. glibc's posix_fallocate falls back to
+writing every block on file systems without fallocate, which costs more than
+the copy; with glibc the mapping needs _GNU_SOURCE for fallocate, which fails
+there instead. Everywhere else (a full disk, no native reservation) the image
+is encoded into memory and written. */
+int qoy_write(const char *filename, const void *data, const qoy_desc *desc) {
+    int max_size = qoy_encode_bound(desc, desc->channels, QOY_FORMAT_RGBA);
+    if (data == NULL || max_size == 0) {
+        return 0;
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return 0;
+    }
+
+    int size = 0;
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+    int reserved = fallocate(fd, 0, 0, max_size) == 0;
+#elif !defined(__GLIBC__) && defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+    int reserved = posix_fallocate(fd, 0, max_size) == 0;
+#else
+    int reserved = 0;
+#endif
+    if (reserved) {
+        void *mapped = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            size = qoy_encode_into(data, desc, desc->channels, QOY_FORMAT_RGBA, QOY_EFFORT_FAST, 0, (unsigned char *)mapped, NULL, NULL);
+            munmap(mapped, max_size);
+        }
+        if (size > 0 && ftruncate(fd, size) != 0) {
+            size = 0;
+        }
+    } else if (ftruncate(fd, 0) == 0) {
+        size = qoy_write_buffered(fd, data, desc);
+    }
+    close(fd);
+
+    if (size <= 0) {
+        unlink(filename);
+        return 0;
+    }
+    return size;
+}
+
+void *qoy_read(const char *filename, qoy_desc *desc, int channels) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+        close(fd);
+        return NULL;
+    }
+
+    int size = (int)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+    void *pixels = qoy_decode(data, size, desc, channels, QOY_FORMAT_RGBA);
+    munmap(data, size);
+    return pixels;
+}
+
+#else
 
 int qoy_write(const char *filename, const void *data, const qoy_desc *desc) {
     FILE *f = fopen(filename, "wb");
@@ -1286,5 +4476,6 @@ void *qoy_read(const char *filename, qoy_desc *desc, int channels) {
     return pixels;
 }
 
+#endif /* QOY_MMAP */
 #endif /* QOY_NO_STDIO */
 #endif /* QOY_IMPLEMENTATION */
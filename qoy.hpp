@@ -0,0 +1,764 @@
+/*
+
+QOY - C++17/20 wrapper for qoy.h
+
+Dominic Szablewski - https://phoboslab.org
+Jorrit "Chainfire" Jongma
+
+
+-- LICENSE: The MIT License(MIT)
+
+Copyright(c) 2021 Dominic Szablewski
+Copyright(c) 2021 Jorrit "Chainfire" Jongma
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files(the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and / or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions :
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+NOTICE: QOY follows QOI's license. If QOI is re-licensed, you may apply that
+license to QOY as well.
+
+
+-- Synopsis
+
+// Define `QOY_IMPLEMENTATION` in *one* C or C++ file before including this
+// header (or qoy.h), to create the implementation.
+
+#define QOY_IMPLEMENTATION
+#include "qoy.hpp"
+
+// Decode to RGBA; the pixels are freed when img goes out of scope
+auto img = qoy::decode<4>(file_bytes);
+if (!img) { ... }
+upload(img.data(), img.desc.width, img.desc.height);
+
+// Encode RGB pixels with options
+auto encoded = qoy::encode<3>(rgb_pixels, desc, {QOY_EFFORT_BETTER, 0});
+write(encoded.data(), encoded.size());
+
+// Decode into memory owned elsewhere, or from a memory resource
+std::vector<unsigned char> out(qoy::image_size<4>(desc));
+qoy::decode_into<4>(file_bytes, out);
+std::pmr::vector<unsigned char> pixels = qoy::pmr::decode<4>(file_bytes, &arena);
+
+// Stream two lines at a time
+qoy::decoder<4> dec(file_bytes);
+std::vector<unsigned char> lines(dec.lines_size());
+while (dec.lines(lines) > 0) { ... }
+
+// C++20: iterate over row pairs as they are decoded
+auto rows = qoy::row_pairs<4>(file_bytes);
+for (const qoy::row_pair &r : rows) {
+    upload_rows(r.y, r.lines, r.pixels.data());
+}
+if (!rows.ok()) { ... }
+
+
+-- Documentation
+
+All functions are thin inline wrappers around the C API of qoy.h; see there
+for the meaning of qoy_desc, qoy_options and the formats.
+
+The number of channels of the pixels in memory (3 or 4) and their format
+(QOY_FORMAT_RGBA, QOY_FORMAT_YCBCR420A, or for decoding one of the packed
+16-bit formats) are template parameters. They are
+checked at compile time and are constants at every call into qoy.h, so with
+the implementation in the same translation unit the compiler specializes the
+call for them. Within qoy.h the op loops are already instantiated per block
+size, predictor and index flag.
+
+Inputs and outputs are spans: std::span with C++20, a minimal equivalent
+(qoy::span) with C++17. Both convert from arrays, std::vector, std::array and
+any other contiguous container with data() and size().
+
+Memory from the C library is owned by qoy::buffer, a std::unique_ptr that
+releases it with QOY_FREE. If QOY_MALLOC and QOY_FREE are overridden, they
+must be defined the same in every file that includes qoy.hpp.
+
+None of the functions throw; failures (invalid parameters or data, malloc
+failed) are reported by an empty result or a false/negative return value, as
+with the C API. That includes allocations of the wrapper itself and of a
+std::pmr::memory_resource, whose exceptions are caught. The read and write
+callables of decoder and encoder are called from within the C library and must
+not throw either; a failure there is reported by returning -1.
+
+*/
+
+
+#ifndef QOY_HPP
+#define QOY_HPP
+
+#include "qoy.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+    #include <span>
+    #define QOY_HPP_STD_SPAN
+#endif
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    #include <coroutine>
+    #include <exception>
+    #include <iterator>
+    #define QOY_HPP_COROUTINES
+#endif
+
+#ifndef QOY_FREE
+    #define QOY_FREE(p) free(p)
+#endif
+
+namespace qoy {
+
+/* -----------------------------------------------------------------------------
+Spans */
+
+#ifdef QOY_HPP_STD_SPAN
+
+template <typename T>
+using span = std::span<T>;
+
+#else
+
+template <typename T>
+class span {
+public:
+    constexpr span() noexcept : ptr_(nullptr), size_(0) {}
+    constexpr span(T *ptr, std::size_t size) noexcept : ptr_(ptr), size_(size) {}
+
+    template <std::size_t N>
+    constexpr span(T (&array)[N]) noexcept : ptr_(array), size_(N) {}
+
+    /* Any contiguous container of T, or of non-const T for span<const T>.
+    Temporaries only bind to spans of const T, as with std::span. */
+    template <
+        typename C,
+        typename = std::enable_if_t<
+            !std::is_same_v<std::remove_cv_t<std::remove_reference_t<C>>, span> &&
+            (std::is_lvalue_reference_v<C> || std::is_const_v<T>) &&
+            std::is_convertible_v<decltype(std::declval<C &>().data()), T *>
+        >
+    >
+    constexpr span(C &&container) noexcept : ptr_(container.data()), size_(container.size()) {}
+
+    template <
+        typename U,
+        typename = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>
+    >
+    constexpr span(const span<U> &other) noexcept : ptr_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return ptr_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T *begin() const noexcept { return ptr_; }
+    constexpr T *end() const noexcept { return ptr_ + size_; }
+    constexpr T &operator[](std::size_t i) const noexcept { return ptr_[i]; }
+
+    constexpr span subspan(std::size_t offset, std::size_t count) const noexcept {
+        return span(ptr_ + offset, count);
+    }
+
+private:
+    T *ptr_;
+    std::size_t size_;
+};
+
+#endif
+
+using bytes = span<const unsigned char>;
+
+
+/* -----------------------------------------------------------------------------
+Buffers and sizes */
+
+struct free_deleter {
+    void operator()(void *p) const noexcept { QOY_FREE(p); }
+};
+
+using buffer = std::unique_ptr<unsigned char[], free_deleter>;
+
+template <int Format>
+constexpr bool is_packed = (Format & ~QOY_FORMAT_DITHER) == QOY_FORMAT_RGB565 || (Format & ~QOY_FORMAT_DITHER) == QOY_FORMAT_RGBA4444;
+
+/* The packed formats are decode only, Channels is ignored for them */
+template <int Channels, int Format>
+constexpr void check_layout() {
+    static_assert(Channels == 3 || Channels == 4, "Channels must be 3 (no alpha) or 4 (alpha)");
+    static_assert(Format == QOY_FORMAT_RGBA || Format == QOY_FORMAT_YCBCR420A || is_packed<Format>, "Format must be QOY_FORMAT_RGBA, QOY_FORMAT_YCBCR420A or a packed format");
+}
+
+template <int Channels, int Format>
+constexpr void check_encode_layout() {
+    check_layout<Channels, Format>();
+    static_assert(!is_packed<Format>, "The packed formats can only be decoded");
+}
+
+/* Size in bytes of width x height pixels with Channels in Format */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline std::size_t image_size(unsigned int width, unsigned int height) {
+    check_layout<Channels, Format>();
+    if constexpr (Format == QOY_FORMAT_RGBA) {
+        return (std::size_t)width * height * Channels;
+    } else if constexpr (is_packed<Format>) {
+        return (std::size_t)width * height * 2;
+    } else {
+        return (std::size_t)qoy_ycbcra_size(width, height, Channels);
+    }
+}
+
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline std::size_t image_size(const qoy_desc &desc) {
+    return image_size<Channels, Format>(desc.width, desc.height);
+}
+
+/* Pixels decoded by the library, with the description from the header */
+struct image {
+    buffer pixels;
+    std::size_t size = 0;
+    qoy_desc desc = {};
+
+    explicit operator bool() const noexcept { return pixels != nullptr; }
+    unsigned char *data() const noexcept { return pixels.get(); }
+    span<const unsigned char> view() const noexcept { return {pixels.get(), size}; }
+};
+
+/* An encoded QOY image */
+struct encoded {
+    buffer bytes;
+    std::size_t length = 0;
+
+    explicit operator bool() const noexcept { return bytes != nullptr; }
+    unsigned char *data() const noexcept { return bytes.get(); }
+    std::size_t size() const noexcept { return length; }
+    span<const unsigned char> view() const noexcept { return {bytes.get(), length}; }
+};
+
+
+/* -----------------------------------------------------------------------------
+Whole images in memory */
+
+/* Read the header of an encoded image. Returns false on invalid data. */
+inline bool decode_header(bytes data, qoy_desc &desc) {
+    return qoy_decode_header(data.data(), (int)data.size(), &desc) != 0;
+}
+
+/* Check the QOY_FLAG_CRC checksums of an encoded image. Returns false if it has
+none, or on a mismatch or invalid data. */
+inline bool verify(bytes data) {
+    return qoy_verify(data.data(), (int)data.size()) != 0;
+}
+
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline image decode(bytes data) {
+    check_layout<Channels, Format>();
+    image img;
+    img.pixels.reset((unsigned char *)qoy_decode(data.data(), (int)data.size(), &img.desc, Channels, Format));
+    if (img.pixels) {
+        img.size = image_size<Channels, Format>(img.desc);
+    }
+    return img;
+}
+
+/* Decode into out, which must hold image_size<Channels, Format>(desc) bytes.
+desc may be NULL. Returns false on failure; out may be partially written. */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline bool decode_into(bytes data, span<unsigned char> out, qoy_desc *desc = nullptr) {
+    check_layout<Channels, Format>();
+    qoy_desc header;
+    if (!decode_header(data, header) || out.size() < image_size<Channels, Format>(header)) {
+        return false;
+    }
+    int tiles = qoy_tiles(&header);
+    for (int tile = 0; tile < tiles; tile++) {
+        if (!qoy_decode_tile(data.data(), (int)data.size(), tile, out.data(), Channels, Format)) {
+            return false;
+        }
+    }
+    if (desc) {
+        *desc = header;
+    }
+    return true;
+}
+
+/* Encode pixels, laid out as image_size<Channels, Format>(desc). desc.channels
+is the number of channels stored in the image and may differ from Channels. */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline encoded encode(span<const unsigned char> pixels, const qoy_desc &desc, const qoy_options &options = {}) {
+    check_encode_layout<Channels, Format>();
+    encoded result;
+    if (pixels.size() < image_size<Channels, Format>(desc)) {
+        return result;
+    }
+    int len = 0;
+    result.bytes.reset((unsigned char *)qoy_encode_ex(pixels.data(), &desc, &len, Channels, Format, &options));
+    if (result.bytes) {
+        result.length = (std::size_t)len;
+    }
+    return result;
+}
+
+
+/* -----------------------------------------------------------------------------
+Streaming, two lines at a time */
+
+/* Move-only owner of a qoy_decoder. Reads from memory or from a callable
+int(void *buffer, int size) with the semantics of qoy_read_fn. */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+class decoder {
+public:
+    decoder() noexcept = default;
+
+    /* If the reader cannot be allocated, the decoder is empty */
+    explicit decoder(bytes data) {
+        check_layout<Channels, Format>();
+        memory_.reset(new (std::nothrow) memory_reader{data, 0});
+        if (memory_) {
+            handle_ = qoy_decoder_open(&memory_reader::read, memory_.get(), &desc_, Channels, Format);
+        }
+    }
+
+    template <typename Read, typename = std::enable_if_t<std::is_invocable_r_v<int, Read &, void *, int>>>
+    explicit decoder(Read read) {
+        check_layout<Channels, Format>();
+        std::unique_ptr<callable_reader<Read>> callable(new (std::nothrow) callable_reader<Read>(std::move(read)));
+        if (callable) {
+            handle_ = qoy_decoder_open(&callable_reader<Read>::read, callable.get(), &desc_, Channels, Format);
+            reader_ = std::move(callable);
+        }
+    }
+
+    decoder(decoder &&other) noexcept { *this = std::move(other); }
+
+    decoder &operator=(decoder &&other) noexcept {
+        if (this != &other) {
+            close();
+            handle_ = std::exchange(other.handle_, nullptr);
+            desc_ = other.desc_;
+            memory_ = std::move(other.memory_);
+            reader_ = std::move(other.reader_);
+        }
+        return *this;
+    }
+
+    decoder(const decoder &) = delete;
+    decoder &operator=(const decoder &) = delete;
+
+    ~decoder() { close(); }
+
+    explicit operator bool() const noexcept { return handle_ != nullptr; }
+    const qoy_desc &desc() const noexcept { return desc_; }
+
+    /* Bytes needed for the two lines of lines() */
+    std::size_t lines_size() const noexcept { return image_size<Channels, Format>(desc_.width, 2); }
+
+    /* Decode the next two lines into out. Returns 2, 1 for the last line of an
+    odd height, 0 at the end of the image or -1 on failure. */
+    int lines(span<unsigned char> out) {
+        if (!handle_ || out.size() < lines_size()) {
+            return -1;
+        }
+        return qoy_decoder_lines(handle_, out.data());
+    }
+
+    void close() noexcept {
+        if (handle_) {
+            qoy_decoder_close(handle_);
+            handle_ = nullptr;
+        }
+    }
+
+private:
+    struct memory_reader {
+        bytes data;
+        std::size_t p;
+
+        static int read(void *user, void *buffer, int size) {
+            memory_reader *r = static_cast<memory_reader *>(user);
+            std::size_t n = r->data.size() - r->p < (std::size_t)size ? r->data.size() - r->p : (std::size_t)size;
+            for (std::size_t i = 0; i < n; i++) {
+                static_cast<unsigned char *>(buffer)[i] = r->data[r->p + i];
+            }
+            r->p += n;
+            return (int)n;
+        }
+    };
+
+    struct reader_base {
+        virtual ~reader_base() = default;
+    };
+
+    template <typename Read>
+    struct callable_reader : reader_base {
+        explicit callable_reader(Read r) : read_fn(std::move(r)) {}
+        Read read_fn;
+
+        static int read(void *user, void *buffer, int size) {
+            return static_cast<callable_reader *>(user)->read_fn(buffer, size);
+        }
+    };
+
+    qoy_decoder *handle_ = nullptr;
+    qoy_desc desc_ = {};
+    std::unique_ptr<memory_reader> memory_;
+    std::unique_ptr<reader_base> reader_;
+};
+
+/* Move-only owner of a qoy_encoder. Writes to a callable
+int(const void *buffer, int size) with the semantics of qoy_write_fn. */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+class encoder {
+public:
+    encoder() noexcept = default;
+
+    /* If the writer cannot be allocated, the encoder is empty */
+    template <typename Write>
+    encoder(Write write, const qoy_desc &desc, const qoy_options &options = {}) : desc_(desc) {
+        check_encode_layout<Channels, Format>();
+        std::unique_ptr<callable_writer<Write>> callable(new (std::nothrow) callable_writer<Write>(std::move(write)));
+        if (callable) {
+            handle_ = qoy_encoder_open(&callable_writer<Write>::write, callable.get(), &desc, Channels, Format, &options);
+            writer_ = std::move(callable);
+        }
+    }
+
+    encoder(encoder &&other) noexcept { *this = std::move(other); }
+
+    encoder &operator=(encoder &&other) noexcept {
+        if (this != &other) {
+            abandon();
+            handle_ = std::exchange(other.handle_, nullptr);
+            desc_ = other.desc_;
+            y_ = other.y_;
+            writer_ = std::move(other.writer_);
+        }
+        return *this;
+    }
+
+    encoder(const encoder &) = delete;
+    encoder &operator=(const encoder &) = delete;
+
+    /* An encoder that wasn't closed still frees its resources; the stream it
+    wrote is incomplete */
+    ~encoder() { abandon(); }
+
+    explicit operator bool() const noexcept { return handle_ != nullptr; }
+    const qoy_desc &desc() const noexcept { return desc_; }
+    std::size_t lines_size() const noexcept { return image_size<Channels, Format>(desc_.width, 2); }
+
+    /* Encode the next two lines. For the last line of an RGBA image with an
+    odd height, pixels only needs to hold that line. Returns false on
+    failure. */
+    bool lines(span<const unsigned char> pixels) {
+        std::size_t size = lines_size();
+        if (Format == QOY_FORMAT_RGBA && y_ + 1 == desc_.height) {
+            size /= 2;
+        }
+        if (!handle_ || pixels.size() < size || qoy_encoder_lines(handle_, pixels.data()) != 0) {
+            return false;
+        }
+        y_ += 2;
+        return true;
+    }
+
+    /* Write the end marker. Returns the size of the stream, or 0 on failure. */
+    std::size_t close() {
+        if (!handle_) {
+            return 0;
+        }
+        int size = qoy_encoder_close(std::exchange(handle_, nullptr));
+        return size > 0 ? (std::size_t)size : 0;
+    }
+
+private:
+    void abandon() noexcept {
+        if (handle_) {
+            qoy_encoder_close(std::exchange(handle_, nullptr));
+        }
+    }
+
+    struct writer_base {
+        virtual ~writer_base() = default;
+    };
+
+    template <typename Write>
+    struct callable_writer : writer_base {
+        explicit callable_writer(Write w) : write_fn(std::move(w)) {}
+        Write write_fn;
+
+        static int write(void *user, const void *buffer, int size) {
+            return static_cast<callable_writer *>(user)->write_fn(buffer, size);
+        }
+    };
+
+    qoy_encoder *handle_ = nullptr;
+    qoy_desc desc_ = {};
+    unsigned int y_ = 0;
+    std::unique_ptr<writer_base> writer_;
+};
+
+
+#ifdef QOY_HPP_COROUTINES
+
+/* -----------------------------------------------------------------------------
+Coroutines
+
+row_pairs() decodes lazily: each step of the iteration decodes the next two
+lines into a buffer owned by the coroutine and hands out a view of it, which
+stays valid until the next step. Only that buffer and the state of a
+qoy_decoder (a read window, or a strip of tiles for tiled images) are held,
+whatever the height of the image, and the consumer's work on a row pair
+(upload, hashing, scaling) is interleaved with decoding instead of waiting for
+the whole image. */
+
+/* Two decoded lines, starting at line y. pixels is laid out as for
+qoy_decoder_lines: lines*width*Channels bytes (QOY_FORMAT_RGBA), lines*width*2
+bytes (packed formats), or one row pair of YCbCrA (QOY_FORMAT_YCBCR420A). */
+struct row_pair {
+    span<const unsigned char> pixels;
+    unsigned int y = 0;
+    int lines = 0;
+    const qoy_desc *desc = nullptr;
+};
+
+/* A single pass, move-only generator. The coroutine co_returns whether it
+finished successfully, which ok() reports once the iteration is done. */
+template <typename T>
+class generator {
+public:
+    struct promise_type {
+        const T *value = nullptr;
+        bool ok = false;
+
+        generator get_return_object() noexcept { return generator(handle::from_promise(*this)); }
+        /* The frame is allocated with the nothrow operator new; without it
+        the generator is empty and ok() false */
+        static generator get_return_object_on_allocation_failure() noexcept { return generator(nullptr); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        std::suspend_always final_suspend() const noexcept { return {}; }
+        std::suspend_always yield_value(const T &v) noexcept { value = &v; return {}; }
+        void return_value(bool success) noexcept { ok = success; }
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() noexcept = default;
+        explicit iterator(handle h) noexcept : h_(h) {}
+
+        const T &operator*() const noexcept { return *h_.promise().value; }
+        const T *operator->() const noexcept { return h_.promise().value; }
+        iterator &operator++() { h_.resume(); return *this; }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const noexcept { return !h_ || h_.done(); }
+
+    private:
+        handle h_;
+    };
+
+    generator(generator &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+
+    generator &operator=(generator &&other) noexcept {
+        if (this != &other) {
+            if (h_) h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+
+    generator(const generator &) = delete;
+    generator &operator=(const generator &) = delete;
+
+    ~generator() { if (h_) h_.destroy(); }
+
+    iterator begin() {
+        if (h_ && !h_.done()) h_.resume();
+        return iterator(h_);
+    }
+
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+    /* True once all values were produced without failure */
+    bool ok() const noexcept { return h_ && h_.done() && h_.promise().ok; }
+
+private:
+    explicit generator(handle h) noexcept : h_(h) {}
+    handle h_;
+};
+
+namespace detail {
+
+/* Source is the data or the read callable of decoder, so the stream is only
+opened once the iteration begins */
+template <int Channels, int Format, typename Source>
+inline generator<row_pair> row_pairs(Source source) {
+    decoder<Channels, Format> dec(std::move(source));
+    if (!dec) {
+        co_return false;
+    }
+    std::size_t size = dec.lines_size();
+    std::unique_ptr<unsigned char[]> buffer(new (std::nothrow) unsigned char[size]);
+    if (!buffer) {
+        co_return false;
+    }
+    row_pair r;
+    r.desc = &dec.desc();
+    for (;;) {
+        int lines = dec.lines(span<unsigned char>(buffer.get(), size));
+        if (lines <= 0) {
+            co_return lines == 0;
+        }
+        r.lines = lines;
+        r.pixels = span<const unsigned char>(buffer.get(), Format != QOY_FORMAT_YCBCR420A ? image_size<Channels, Format>(dec.desc().width, lines) : size);
+        co_yield r;
+        r.y += lines;
+    }
+}
+
+} // namespace detail
+
+/* Row pairs of an encoded image in memory, which must outlive the generator */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline generator<row_pair> row_pairs(bytes data) {
+    check_layout<Channels, Format>();
+    return detail::row_pairs<Channels, Format>(data);
+}
+
+/* Row pairs of a stream read by a callable int(void *buffer, int size), as
+for decoder */
+template <int Channels, int Format = QOY_FORMAT_RGBA, typename Read, typename = std::enable_if_t<std::is_invocable_r_v<int, Read &, void *, int>>>
+inline generator<row_pair> row_pairs(Read read) {
+    check_layout<Channels, Format>();
+    return detail::row_pairs<Channels, Format>(std::move(read));
+}
+
+#endif // QOY_HPP_COROUTINES
+
+
+/* -----------------------------------------------------------------------------
+std::pmr
+
+Results in containers of a std::pmr::memory_resource instead of QOY_MALLOC,
+e.g. a per-request arena. An empty vector means failure. */
+
+namespace pmr {
+
+namespace detail {
+
+/* Resize v, or append size bytes to it; false where the memory resource throws
+instead */
+inline bool resize(std::pmr::vector<unsigned char> &v, std::size_t size) noexcept {
+#ifdef __cpp_exceptions
+    try {
+        v.resize(size);
+    } catch (...) {
+        return false;
+    }
+#else
+    v.resize(size);
+#endif
+    return true;
+}
+
+inline bool append(std::pmr::vector<unsigned char> &v, const unsigned char *b, std::size_t size) noexcept {
+#ifdef __cpp_exceptions
+    try {
+        v.insert(v.end(), b, b + size);
+    } catch (...) {
+        return false;
+    }
+#else
+    v.insert(v.end(), b, b + size);
+#endif
+    return true;
+}
+
+} // namespace detail
+
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline std::pmr::vector<unsigned char> decode(bytes data, std::pmr::memory_resource *resource = std::pmr::get_default_resource(), qoy_desc *desc = nullptr) {
+    std::pmr::vector<unsigned char> pixels(resource);
+    qoy_desc header;
+    if (!decode_header(data, header)) {
+        return pixels;
+    }
+    if (
+        !detail::resize(pixels, image_size<Channels, Format>(header)) ||
+        !decode_into<Channels, Format>(data, pixels, desc)
+    ) {
+        pixels.clear();
+    }
+    return pixels;
+}
+
+/* The chunks are written into the vector as they are encoded, unless desc or
+options ask for QOY_FLAG_LZ, QOY_FLAG_TILED, QOY_FLAG_CRC, QOY_EFFORT_BEST or
+drop_opaque_alpha, which the streaming encoder does not support; those are
+encoded by the library and copied. */
+template <int Channels, int Format = QOY_FORMAT_RGBA>
+inline std::pmr::vector<unsigned char> encode(span<const unsigned char> pixels, const qoy_desc &desc, const qoy_options &options = {}, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) {
+    std::pmr::vector<unsigned char> out(resource);
+    if (pixels.size() < image_size<Channels, Format>(desc)) {
+        return out;
+    }
+
+    if (
+        (desc.flags & (QOY_FLAG_LZ | QOY_FLAG_TILED | QOY_FLAG_CRC)) ||
+        options.effort >= QOY_EFFORT_BEST ||
+        options.drop_opaque_alpha
+    ) {
+        encoded e = qoy::encode<Channels, Format>(pixels, desc, options);
+        if (e && !detail::append(out, e.data(), e.size())) {
+            out.clear();
+        }
+        return out;
+    }
+
+    /* Called from within qoy_encoder_lines, so a failed allocation is
+    returned as a write error instead of thrown through the C library */
+    auto append = [&out](const void *buffer, int size) {
+        return detail::append(out, static_cast<const unsigned char *>(buffer), (std::size_t)size) ? 0 : -1;
+    };
+    encoder<Channels, Format> enc(append, desc, options);
+    std::size_t stride = enc.lines_size();
+    for (unsigned int y = 0; y < desc.height; y += 2) {
+        std::size_t offset = (y / 2) * stride;
+        if (!enc.lines(span<const unsigned char>(pixels.data() + offset, pixels.size() - offset))) {
+            out.clear();
+            return out;
+        }
+    }
+    if (enc.close() == 0) {
+        out.clear();
+    }
+    return out;
+}
+
+} // namespace pmr
+
+} // namespace qoy
+
+#endif // QOY_HPP
@@ -4,7 +4,11 @@ Simple benchmark suite for png, stbi, qoi and qoy
 
 Requires libpng, "stb_image.h" and "stb_image_write.h", "qoi.h"
 Compile with: 
-	gcc qoybench.c -std=gnu99 -lpng -O3 -o qoybench
+	gcc qoybench.c -std=gnu99 -lpng -pthread -O3 -o qoybench
+
+Without libpng (stbi still reads and writes png), e.g. to run the built-in
+synthetic corpus with --synthetic:
+	gcc qoybench.c -std=gnu99 -DQOYBENCH_NO_LIBPNG -pthread -O3 -o qoybench
 
 Dominic Szablewski - https://phoboslab.org
 Jorrit "Chainfire" Jongma
@@ -38,7 +42,10 @@ license to QOY as well.
 
 #include <stdio.h>
 #include <dirent.h>
-#include <png.h>
+#include <pthread.h>
+#ifndef QOYBENCH_NO_LIBPNG
+	#include <png.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
@@ -51,6 +58,9 @@ license to QOY as well.
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
 
+// The op loops counting stats are separate copies, the timed runs don't
+// pay for them
+#define QOY_STATS
 #define QOY_IMPLEMENTATION
 #include "qoy.h"
 
@@ -118,6 +128,124 @@ static uint64_t ns() {
 #define ERROR(...) printf("abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); printf("\n"); exit(1)
 
 
+// -----------------------------------------------------------------------------
+// Hardware performance counters with Linux perf_event_open, user space only.
+// All counters that could be opened run as one group, so they count exactly
+// the same instructions. Counters the kernel or CPU doesn't have are left out;
+// without perf at all qoybench just times.
+
+#define PERF_CYCLES        0
+#define PERF_INSTRUCTIONS  1
+#define PERF_BRANCH_MISSES 2
+#define PERF_L1D_MISSES    3
+#define PERF_LLC_MISSES    4
+#define PERF_COUNTERS      5
+
+const char *perf_names[PERF_COUNTERS] = {
+	"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"
+};
+
+#if defined(__linux)
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+	#include <errno.h>
+
+int perf_leader = -1;
+int perf_fd[PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+
+// Position of each counter in a group read, -1 if not available
+int perf_slot[PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+int perf_slots = 0;
+
+int perf_open_counter(int counter, int group) {
+	static const struct { uint32_t type; uint64_t config; } events[PERF_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+	};
+
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[counter].type;
+	attr.config = events[counter].config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Open the counters. Returns the number of counters available; prints why
+// not if there are none.
+int perf_open(void) {
+	perf_leader = perf_open_counter(PERF_CYCLES, -1);
+	if (perf_leader < 0) {
+		fprintf(stderr, "Hardware counters not available (perf_event_open: %s), timing only\n", strerror(errno));
+		return 0;
+	}
+	perf_fd[PERF_CYCLES] = perf_leader;
+	perf_slot[PERF_CYCLES] = perf_slots++;
+
+	for (int i = PERF_CYCLES + 1; i < PERF_COUNTERS; i++) {
+		perf_fd[i] = perf_open_counter(i, perf_leader);
+		if (perf_fd[i] >= 0) {
+			perf_slot[i] = perf_slots++;
+		}
+	}
+	return perf_slots;
+}
+
+void perf_start(void) {
+	if (perf_leader >= 0) {
+		ioctl(perf_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+// Stop counting and add the counts since perf_start() to counts
+void perf_stop(uint64_t *counts) {
+	if (perf_leader < 0) {
+		return;
+	}
+	ioctl(perf_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	uint64_t values[1 + PERF_COUNTERS];
+	if (read(perf_leader, values, sizeof(values)) < (ssize_t)sizeof(uint64_t) * (1 + perf_slots)) {
+		return;
+	}
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (perf_slot[i] >= 0) {
+			counts[i] += values[1 + perf_slot[i]];
+		}
+	}
+}
+
+int perf_available(int counter) {
+	return perf_slot[counter] >= 0;
+}
+
+#else
+
+int perf_open(void) {
+	fprintf(stderr, "Hardware counters are only supported on Linux, timing only\n");
+	return 0;
+}
+void perf_start(void) {}
+void perf_stop(uint64_t *counts) {}
+int perf_available(int counter) { return 0; }
+
+#endif
+
+
+#ifndef QOYBENCH_NO_LIBPNG
+
 // -----------------------------------------------------------------------------
 // libpng encode/decode wrappers
 // Seriously, who thought this was a good abstraction for an API to read/write
@@ -170,10 +298,13 @@ void *libpng_encode(void *pixels, int w, int h, int channels, int *out_len) {
 		row_pointers[y] = ((unsigned char *)pixels + y * w * channels);
 	}
 
+	// Incompressible images grow by the filter byte per row, the deflate block
+	// headers and the png chunks
+	int capacity = (size_t)(w * channels + 1) * h * 101 / 100 + 1024;
 	libpng_write_t write_data = {
 		.size = 0,
-		.capacity = w * h * channels,
-		.data = malloc(w * h * channels)
+		.capacity = capacity,
+		.data = malloc(capacity)
 	};
 
 	png_set_rows(png, info, row_pointers);
@@ -276,6 +407,8 @@ void *libpng_decode(void *data, int size, int *out_w, int *out_h) {
 	return out;
 }
 
+#endif // QOYBENCH_NO_LIBPNG
+
 
 // -----------------------------------------------------------------------------
 // stb_image encode callback
@@ -287,6 +420,25 @@ void stbi_write_callback(void *context, void *data, int size) {
 	// be fair to the other decode functions...
 }
 
+typedef struct {
+	unsigned char *data;
+	int size;
+	int capacity;
+} stbi_mem_t;
+
+void stbi_mem_callback(void *context, void *data, int size) {
+	stbi_mem_t *mem = (stbi_mem_t *)context;
+	if (mem->size + size > mem->capacity) {
+		mem->capacity = (mem->size + size) * 2;
+		mem->data = realloc(mem->data, mem->capacity);
+		if (!mem->data) {
+			ERROR("Out of memory");
+		}
+	}
+	memcpy(mem->data + mem->size, data, size);
+	mem->size += size;
+}
+
 
 // -----------------------------------------------------------------------------
 // function to load a whole file into memory
@@ -328,12 +480,36 @@ int opt_nodecode = 0;
 int opt_noencode = 0;
 int opt_norecurse = 0;
 int opt_onlytotals = 0;
+int opt_qoyflags = 0;
+int opt_threads = 0;
+int opt_ops = 0;
+int opt_stages = 0;
+int opt_synthetic = 0;
+int opt_latency = 0;
+int opt_cold = 0;
+int opt_counters = 0;
+int opt_output = 0;
+qoy_options opt_qoyoptions = { .effort = QOY_EFFORT_FAST };
 
+#define OUTPUT_TEXT 0
+#define OUTPUT_JSON 1
+#define OUTPUT_CSV  2
+
+
+// min, p50, p90, p99 and max of the timed runs
+#define LATENCY_PERCENTILES 5
+
+const char *latency_names[LATENCY_PERCENTILES] = { "min", "p50", "p90", "p99", "max" };
+const int latency_percentiles[LATENCY_PERCENTILES] = { 0, 50, 90, 99, 100 };
 
 typedef struct {
 	uint64_t size;
 	uint64_t encode_time;
 	uint64_t decode_time;
+	uint64_t encode_latency[LATENCY_PERCENTILES];
+	uint64_t decode_latency[LATENCY_PERCENTILES];
+	uint64_t encode_counters[PERF_COUNTERS];
+	uint64_t decode_counters[PERF_COUNTERS];
 } benchmark_lib_result_t;
 
 typedef struct {
@@ -347,8 +523,54 @@ typedef struct {
 	benchmark_lib_result_t qoi;
 	benchmark_lib_result_t qoyrgb;
 	benchmark_lib_result_t qoyycc;
+	benchmark_lib_result_t qoylz;
+	qoy_stats qoystats;
+	uint64_t stage_time[4];
+	uint64_t stage_counters[4][PERF_COUNTERS];
 } benchmark_result_t;
 
+// Stages of the qoy pipeline timed separately with --stages. Encoding RGBA is
+// the first two, decoding to RGBA the last two.
+#define STAGE_RGBA_TO_YCBCRA 0
+#define STAGE_ENCODE_OPS     1
+#define STAGE_DECODE_OPS     2
+#define STAGE_YCBCRA_TO_RGBA 3
+#define BENCHMARK_STAGES     4
+
+const char *stage_names[BENCHMARK_STAGES] = {
+	"rgba_to_ycbcra", "encode_ops", "decode_ops", "ycbcra_to_rgba"
+};
+
+// Names of the codecs in benchmark_result_t, in order, for machine-readable
+// output
+const char *benchmark_lib_names[] = { "libpng", "stbi", "qoi", "qoy-rgb", "qoy-ycc", "qoy-lz" };
+#define BENCHMARK_LIBS 6
+
+const char *qoy_stat_names[QOY_STAT_COUNT] = {
+	"321", "433", "554", "666", "865", "888", "index",
+	"run_1", "run_x", "a18", "a42", "a44", "a48", "pred"
+};
+
+// Whether a codec of benchmark_lib_names was run at all
+int benchmark_lib_enabled(int lib) {
+#ifdef QOYBENCH_NO_LIBPNG
+	if (lib == 0) {
+		return 0;
+	}
+#endif
+	return lib >= 2 || !opt_nopng;
+}
+
+void benchmark_add_stats(qoy_stats *total, const qoy_stats *stats) {
+	for (int i = 0; i < QOY_STAT_COUNT; i++) {
+		total->ops[i] += stats->ops[i];
+		total->bytes[i] += stats->bytes[i];
+	}
+	for (int i = 0; i < QOY_STATS_RUN_BUCKETS; i++) {
+		total->runs[i] += stats->runs[i];
+	}
+}
+
 
 void benchmark_print_result(benchmark_result_t res) {
 	res.px /= res.count;
@@ -368,10 +590,14 @@ void benchmark_print_result(benchmark_result_t res) {
 	res.qoyycc.encode_time /= res.count;
 	res.qoyycc.decode_time /= res.count;
 	res.qoyycc.size /= res.count;
+	res.qoylz.encode_time /= res.count;
+	res.qoylz.decode_time /= res.count;
+	res.qoylz.size /= res.count;
 
 	double px = res.px;
 	printf("        decode ms   encode ms   decode mpps   encode mpps   size kb    rate\n");
 	if (!opt_nopng) {
+#ifndef QOYBENCH_NO_LIBPNG
 		printf(
 			"libpng:  %8.1f    %8.1f      %8.2f      %8.2f  %8lu   %4.1f%%\n",
 			(double)res.libpng.decode_time/1000000.0, 
@@ -381,6 +607,7 @@ void benchmark_print_result(benchmark_result_t res) {
 			res.libpng.size/1024,
 			((double)res.libpng.size/(double)res.raw_size) * 100.0
 		);
+#endif
 		printf(
 			"stbi:    %8.1f    %8.1f      %8.2f      %8.2f  %8lu   %4.1f%%\n",
 			(double)res.stbi.decode_time/1000000.0,
@@ -418,62 +645,582 @@ void benchmark_print_result(benchmark_result_t res) {
 		res.qoyycc.size/1024,
 		((double)res.qoyycc.size/(double)res.raw_size) * 100.0
 	);
+	printf(
+		"qoy-lz:  %8.1f    %8.1f      %8.2f      %8.2f  %8lu   %4.1f%%\n",
+		(double)res.qoylz.decode_time/1000000.0,
+		(double)res.qoylz.encode_time/1000000.0,
+		(res.qoylz.decode_time > 0 ? px / ((double)res.qoylz.decode_time/1000.0) : 0),
+		(res.qoylz.encode_time > 0 ? px / ((double)res.qoylz.encode_time/1000.0) : 0),
+		res.qoylz.size/1024,
+		((double)res.qoylz.size/(double)res.raw_size) * 100.0
+	);
 	printf("\n");
 }
 
+// Op histogram of the qoy encoding, with the bytes spent per op class and
+// the run lengths
+void benchmark_print_ops(benchmark_result_t res) {
+	uint64_t total = 0;
+	for (int i = 0; i < QOY_STAT_COUNT; i++) {
+		total += res.qoystats.bytes[i];
+	}
+
+	printf("qoy ops:        count       bytes   share\n");
+	for (int i = 0; i < QOY_STAT_COUNT; i++) {
+		if (res.qoystats.ops[i] == 0) {
+			continue;
+		}
+		printf(
+			"  %-6s %12llu %11llu  %5.1f%%\n",
+			qoy_stat_names[i],
+			res.qoystats.ops[i],
+			res.qoystats.bytes[i],
+			total > 0 ? (double)res.qoystats.bytes[i] / total * 100.0 : 0
+		);
+	}
+
+	printf("qoy runs:");
+	for (int i = 0; i < QOY_STATS_RUN_BUCKETS; i++) {
+		if (res.qoystats.runs[i] > 0) {
+			printf(" %d-%d: %llu", 1 << i, (2 << i) - 1, res.qoystats.runs[i]);
+		}
+	}
+	printf("\n\n");
+}
+
+// Time per stage of the qoy pipeline, in ns per pixel and as share of the
+// encode (RGBA -> YCbCrA -> ops) or decode (ops -> YCbCrA -> RGBA) total
+void benchmark_print_stages(benchmark_result_t res) {
+	uint64_t encode = res.stage_time[STAGE_RGBA_TO_YCBCRA] + res.stage_time[STAGE_ENCODE_OPS];
+	uint64_t decode = res.stage_time[STAGE_DECODE_OPS] + res.stage_time[STAGE_YCBCRA_TO_RGBA];
+
+	printf("qoy stages:         ms    ns/px   share\n");
+	for (int i = 0; i < BENCHMARK_STAGES; i++) {
+		uint64_t total = i < STAGE_DECODE_OPS ? encode : decode;
+		printf(
+			"  %-14s %8.1f %8.2f  %5.1f%%\n",
+			stage_names[i],
+			(double)res.stage_time[i] / res.count / 1000000.0,
+			res.px > 0 ? (double)res.stage_time[i] / res.px : 0,
+			total > 0 ? (double)res.stage_time[i] / total * 100.0 : 0
+		);
+	}
+	printf("\n");
+}
+
+// Distribution of the time a single run took, per codec. Totals hold the per
+// image percentiles averaged over the images, not percentiles of all runs of
+// the corpus, and are labeled so.
+void benchmark_print_latency(benchmark_result_t res) {
+	const benchmark_lib_result_t *libs = &res.libpng;
+
+	printf("latency ms:        min        p50        p90        p99        max\n");
+	for (int i = 0; i < BENCHMARK_LIBS; i++) {
+		if (!benchmark_lib_enabled(i)) {
+			continue;
+		}
+		for (int encode = 0; encode <= 1; encode++) {
+			if (encode ? opt_noencode : opt_nodecode) {
+				continue;
+			}
+			const uint64_t *latency = encode ? libs[i].encode_latency : libs[i].decode_latency;
+			char name[32];
+			snprintf(name, sizeof(name), "%s %s:", benchmark_lib_names[i], encode ? "enc" : "dec");
+			printf("%-13s", name);
+			for (int p = 0; p < LATENCY_PERCENTILES; p++) {
+				printf(" %10.3f", (double)latency[p] / res.count / 1000000.0);
+			}
+			printf("\n");
+		}
+	}
+	if (res.count > 1) {
+		printf("(means of the per image percentiles of %d images)\n", res.count);
+	}
+	printf("\n");
+}
+
+void benchmark_print_counter_row(const char *name, const uint64_t *counters, uint64_t px) {
+	printf("%-16s", name);
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (perf_available(i)) {
+			printf(" %9.3f", (double)counters[i] / px);
+		}
+		else {
+			printf("         -");
+		}
+	}
+	if (perf_available(PERF_CYCLES) && perf_available(PERF_INSTRUCTIONS) && counters[PERF_CYCLES] > 0) {
+		printf(" %6.2f", (double)counters[PERF_INSTRUCTIONS] / counters[PERF_CYCLES]);
+	}
+	else {
+		printf("      -");
+	}
+	printf("\n");
+}
+
+// Hardware counters per pixel for every codec and, with --stages, every stage
+void benchmark_print_counters(benchmark_result_t res) {
+	if (res.px == 0) {
+		return;
+	}
+	const benchmark_lib_result_t *libs = &res.libpng;
+
+	printf("per pixel:          cycles    instrs   br-miss  l1d-miss  llc-miss    ipc\n");
+	for (int i = 0; i < BENCHMARK_LIBS; i++) {
+		if (!benchmark_lib_enabled(i)) {
+			continue;
+		}
+		for (int encode = 0; encode <= 1; encode++) {
+			if (encode ? opt_noencode : opt_nodecode) {
+				continue;
+			}
+			char name[32];
+			snprintf(name, sizeof(name), "%s %s:", benchmark_lib_names[i], encode ? "enc" : "dec");
+			benchmark_print_counter_row(name, encode ? libs[i].encode_counters : libs[i].decode_counters, res.px);
+		}
+	}
+	for (int i = 0; opt_stages && i < BENCHMARK_STAGES; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "%s:", stage_names[i]);
+		benchmark_print_counter_row(name, res.stage_counters[i], res.px);
+	}
+	printf("\n");
+}
+
+void print_json_counters(const char *key, const uint64_t *counters) {
+	printf(", \"%s\": {", key);
+	const char *separator = "";
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (perf_available(i)) {
+			printf("%s\"%s\": %llu", separator, perf_names[i], (unsigned long long)counters[i]);
+			separator = ", ";
+		}
+	}
+	printf("}");
+}
+
+void print_json_string(const char *str) {
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			printf("\\%c", *str);
+		}
+		else if ((unsigned char)*str < 0x20) {
+			printf("\\u%04x", *str);
+		}
+		else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+// One JSON object per image, directory total or grand total, all in a single
+// array. Times are the sums of the per image averages over the runs, sizes
+// are sums as well. Latencies are percentiles of the runs of an image
+// ("latency_of": "runs"), for totals the means of those over the images
+// ("latency_of": "image_means").
+void benchmark_print_json(const char *kind, const char *path, benchmark_result_t res) {
+	static int first = 1;
+	const benchmark_lib_result_t *libs = &res.libpng;
+
+	printf("%s\n{\"kind\": \"%s\", \"path\": ", first ? "[" : ",", kind);
+	print_json_string(path);
+	printf(
+		", \"count\": %d, \"width\": %d, \"height\": %d, \"px\": %llu, \"raw_size\": %llu",
+		res.count, res.w, res.h, (unsigned long long)res.px, (unsigned long long)res.raw_size
+	);
+	if (opt_latency) {
+		printf(", \"latency_of\": \"%s\"", res.count > 1 ? "image_means" : "runs");
+	}
+	printf(", \"codecs\": {");
+	const char *separator = "";
+	for (int i = 0; i < BENCHMARK_LIBS; i++) {
+		if (!benchmark_lib_enabled(i)) {
+			continue;
+		}
+		printf(
+			"%s\"%s\": {\"decode_ns\": %llu, \"encode_ns\": %llu, \"decode_mpps\": %.3f, \"encode_mpps\": %.3f, \"size\": %llu",
+			separator,
+			benchmark_lib_names[i],
+			(unsigned long long)libs[i].decode_time,
+			(unsigned long long)libs[i].encode_time,
+			libs[i].decode_time > 0 ? (double)res.px / ((double)libs[i].decode_time / 1000.0) : 0,
+			libs[i].encode_time > 0 ? (double)res.px / ((double)libs[i].encode_time / 1000.0) : 0,
+			(unsigned long long)libs[i].size
+		);
+		if (opt_latency) {
+			for (int encode = 0; encode <= 1; encode++) {
+				const uint64_t *latency = encode ? libs[i].encode_latency : libs[i].decode_latency;
+				printf(", \"%s_latency_ns\": {", encode ? "encode" : "decode");
+				for (int p = 0; p < LATENCY_PERCENTILES; p++) {
+					printf("%s\"%s\": %llu", p > 0 ? ", " : "", latency_names[p], (unsigned long long)(latency[p] / res.count));
+				}
+				printf("}");
+			}
+		}
+		if (opt_counters) {
+			print_json_counters("decode_counters", libs[i].decode_counters);
+			print_json_counters("encode_counters", libs[i].encode_counters);
+		}
+		printf("}");
+		separator = ", ";
+	}
+	printf("}, \"qoy_ops\": {");
+	for (int i = 0; i < QOY_STAT_COUNT; i++) {
+		printf(
+			"%s\"%s\": {\"count\": %llu, \"bytes\": %llu}",
+			i > 0 ? ", " : "", qoy_stat_names[i], res.qoystats.ops[i], res.qoystats.bytes[i]
+		);
+	}
+	printf("}, \"qoy_runs\": [");
+	for (int i = 0; i < QOY_STATS_RUN_BUCKETS; i++) {
+		printf("%s%llu", i > 0 ? ", " : "", res.qoystats.runs[i]);
+	}
+	printf("]");
+	if (opt_stages) {
+		printf(", \"qoy_stages\": {");
+		for (int i = 0; i < BENCHMARK_STAGES; i++) {
+			printf(
+				"%s\"%s\": {\"ns\": %llu, \"ns_per_px\": %.3f",
+				i > 0 ? ", " : "", stage_names[i],
+				(unsigned long long)res.stage_time[i],
+				res.px > 0 ? (double)res.stage_time[i] / res.px : 0
+			);
+			if (opt_counters) {
+				print_json_counters("counters", res.stage_counters[i]);
+			}
+			printf("}");
+		}
+		printf("}");
+	}
+	printf("}");
+	first = 0;
+}
+
+// One CSV line per image, directory total or grand total, with the same
+// fields as the JSON output; qoy_runs_N counts runs of 2^N to 2^(N+1)-1 blocks
+// and latency_of tells the per run latencies from the means of totals
+void benchmark_print_csv(const char *kind, const char *path, benchmark_result_t res) {
+	static int first = 1;
+	const benchmark_lib_result_t *libs = &res.libpng;
+
+	if (first) {
+		printf("kind,path,count,width,height,px,raw_size%s", opt_latency ? ",latency_of" : "");
+		for (int i = 0; i < BENCHMARK_LIBS; i++) {
+			if (!benchmark_lib_enabled(i)) {
+				continue;
+			}
+			const char *name = benchmark_lib_names[i];
+			printf(",%s_decode_ns,%s_encode_ns,%s_decode_mpps,%s_encode_mpps,%s_size", name, name, name, name, name);
+			for (int encode = 0; opt_latency && encode <= 1; encode++) {
+				for (int p = 0; p < LATENCY_PERCENTILES; p++) {
+					printf(",%s_%s_%s_ns", name, encode ? "encode" : "decode", latency_names[p]);
+				}
+			}
+			for (int encode = 0; opt_counters && encode <= 1; encode++) {
+				for (int c = 0; c < PERF_COUNTERS; c++) {
+					if (perf_available(c)) {
+						printf(",%s_%s_%s", name, encode ? "encode" : "decode", perf_names[c]);
+					}
+				}
+			}
+		}
+		for (int i = 0; i < QOY_STAT_COUNT; i++) {
+			printf(",qoy_op_%s_count,qoy_op_%s_bytes", qoy_stat_names[i], qoy_stat_names[i]);
+		}
+		for (int i = 0; i < QOY_STATS_RUN_BUCKETS; i++) {
+			printf(",qoy_runs_%d", i);
+		}
+		for (int i = 0; opt_stages && i < BENCHMARK_STAGES; i++) {
+			printf(",qoy_stage_%s_ns,qoy_stage_%s_ns_per_px", stage_names[i], stage_names[i]);
+			for (int c = 0; opt_counters && c < PERF_COUNTERS; c++) {
+				if (perf_available(c)) {
+					printf(",qoy_stage_%s_%s", stage_names[i], perf_names[c]);
+				}
+			}
+		}
+		printf("\n");
+		first = 0;
+	}
+
+	// Paths are quoted, with quotes doubled
+	printf("%s,\"", kind);
+	for (const char *c = path; *c; c++) {
+		if (*c == '"') putchar('"');
+		putchar(*c);
+	}
+	printf("\",%d,%d,%d,%llu,%llu", res.count, res.w, res.h, (unsigned long long)res.px, (unsigned long long)res.raw_size);
+	if (opt_latency) {
+		printf(",%s", res.count > 1 ? "image_means" : "runs");
+	}
+	for (int i = 0; i < BENCHMARK_LIBS; i++) {
+		if (!benchmark_lib_enabled(i)) {
+			continue;
+		}
+		printf(
+			",%llu,%llu,%.3f,%.3f,%llu",
+			(unsigned long long)libs[i].decode_time,
+			(unsigned long long)libs[i].encode_time,
+			libs[i].decode_time > 0 ? (double)res.px / ((double)libs[i].decode_time / 1000.0) : 0,
+			libs[i].encode_time > 0 ? (double)res.px / ((double)libs[i].encode_time / 1000.0) : 0,
+			(unsigned long long)libs[i].size
+		);
+		for (int encode = 0; opt_latency && encode <= 1; encode++) {
+			const uint64_t *latency = encode ? libs[i].encode_latency : libs[i].decode_latency;
+			for (int p = 0; p < LATENCY_PERCENTILES; p++) {
+				printf(",%llu", (unsigned long long)(latency[p] / res.count));
+			}
+		}
+		for (int encode = 0; opt_counters && encode <= 1; encode++) {
+			const uint64_t *counters = encode ? libs[i].encode_counters : libs[i].decode_counters;
+			for (int c = 0; c < PERF_COUNTERS; c++) {
+				if (perf_available(c)) {
+					printf(",%llu", (unsigned long long)counters[c]);
+				}
+			}
+		}
+	}
+	for (int i = 0; i < QOY_STAT_COUNT; i++) {
+		printf(",%llu,%llu", res.qoystats.ops[i], res.qoystats.bytes[i]);
+	}
+	for (int i = 0; i < QOY_STATS_RUN_BUCKETS; i++) {
+		printf(",%llu", res.qoystats.runs[i]);
+	}
+	for (int i = 0; opt_stages && i < BENCHMARK_STAGES; i++) {
+		printf(
+			",%llu,%.3f",
+			(unsigned long long)res.stage_time[i],
+			res.px > 0 ? (double)res.stage_time[i] / res.px : 0
+		);
+		for (int c = 0; opt_counters && c < PERF_COUNTERS; c++) {
+			if (perf_available(c)) {
+				printf(",%llu", (unsigned long long)res.stage_counters[i][c]);
+			}
+		}
+	}
+	printf("\n");
+}
+
+// Print the result for an image ("image"), a directory ("directory") or all of
+// them ("total") in the selected output format
+void benchmark_output(const char *kind, const char *path, benchmark_result_t res) {
+	if (opt_output == OUTPUT_JSON) {
+		benchmark_print_json(kind, path, res);
+		return;
+	}
+	if (opt_output == OUTPUT_CSV) {
+		benchmark_print_csv(kind, path, res);
+		return;
+	}
+
+	if (strcmp(kind, "image") == 0) {
+		printf("## %s size: %dx%d\n", path, res.w, res.h);
+	}
+	else if (strcmp(kind, "directory") == 0) {
+		printf("## Total for %s\n", path);
+	}
+	else {
+		printf("# Grand total for %s\n", path);
+	}
+	benchmark_print_result(res);
+	if (opt_ops) {
+		benchmark_print_ops(res);
+	}
+	if (opt_stages) {
+		benchmark_print_stages(res);
+	}
+	if (opt_latency) {
+		benchmark_print_latency(res);
+	}
+	if (opt_counters) {
+		benchmark_print_counters(res);
+	}
+}
+
+// With --cold every run starts with caches that hold none of its input or
+// output: writing a buffer well above the size of the last level cache
+// evicts them, and the TLB with it.
+#define COLD_BUFFER_SIZE (256 * 1024 * 1024)
+
+void benchmark_evict_caches(void) {
+	static unsigned char *buffer = NULL;
+	static unsigned char value = 0;
+	if (!buffer) {
+		buffer = malloc(COLD_BUFFER_SIZE);
+		if (!buffer) {
+			ERROR("Can't allocate the cache eviction buffer");
+		}
+	}
+	memset(buffer, ++value, COLD_BUFFER_SIZE);
+	__asm__ __volatile__("" : : "r"(buffer) : "memory");
+}
+
+int compare_uint64(const void *a, const void *b) {
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+	return va < vb ? -1 : va > vb;
+}
+
+// Nearest-rank percentiles of the run times. Sorts samples; latency may be
+// NULL.
+void benchmark_latency(uint64_t *samples, int count, uint64_t *latency) {
+	if (!latency) {
+		return;
+	}
+	qsort(samples, count, sizeof(uint64_t), compare_uint64);
+	for (int p = 0; p < LATENCY_PERCENTILES; p++) {
+		int rank = (latency_percentiles[p] * count + 99) / 100;
+		latency[p] = samples[rank > 0 ? rank - 1 : 0];
+	}
+}
+
 // Run __VA_ARGS__ a number of times and meassure the time taken. The first
-// run is ignored.
-#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, ...) \
+// run is ignored. The time of every run is kept for the percentiles in
+// LATENCY (NULL if not needed). With --counters, COUNTERS gets the hardware
+// counts averaged over the runs.
+#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, LATENCY, COUNTERS, ...) \
 	do { \
 		uint64_t time = 0; \
+		uint64_t *samples = malloc((RUNS) * sizeof(uint64_t)); \
+		if (!samples) { \
+			ERROR("Malloc for %d run times failed", RUNS); \
+		} \
+		uint64_t counts[PERF_COUNTERS] = {0}; \
 		for (int i = NOWARMUP; i <= RUNS; i++) { \
+			if (opt_cold) { \
+				benchmark_evict_caches(); \
+			} \
+			uint64_t run_counts[PERF_COUNTERS] = {0}; \
+			if (opt_counters) { \
+				perf_start(); \
+			} \
 			uint64_t time_start = ns(); \
 			__VA_ARGS__ \
 			uint64_t time_end = ns(); \
+			if (opt_counters) { \
+				perf_stop(run_counts); \
+			} \
 			if (i > 0) { \
 				time += time_end - time_start; \
+				samples[i - 1] = time_end - time_start; \
+				for (int c = 0; c < PERF_COUNTERS; c++) { \
+					counts[c] += run_counts[c]; \
+				} \
 			} \
 		} \
 		AVG_TIME = time / RUNS; \
+		benchmark_latency(samples, RUNS, LATENCY); \
+		free(samples); \
+		for (int c = 0; c < PERF_COUNTERS; c++) { \
+			(COUNTERS)[c] = counts[c] / RUNS; \
+		} \
 	} while (0)
 
 
-benchmark_result_t benchmark_image(const char *path) {
-	int encoded_png_size;
-	int encoded_qoi_size;
-	int encoded_qoy_size;
-	int w;
-	int h;
-	int channels;
+// The streaming decoder reads the encoded image from memory
+typedef struct {
+	const unsigned char *data;
+	int size;
+	int pos;
+} stream_mem_t;
+
+int stream_mem_read(void *user, void *buffer, int size) {
+	stream_mem_t *mem = (stream_mem_t *)user;
+	int n = mem->size - mem->pos < size ? mem->size - mem->pos : size;
+	memcpy(buffer, mem->data + mem->pos, n);
+	mem->pos += n;
+	return n;
+}
 
-	// Load the encoded PNG, encoded QOI and raw pixels into memory
-	if(!stbi_info(path, &w, &h, &channels)) {
-		ERROR("Error decoding header %s", path);
+// Decoding through qoy_decoder two lines at a time must give the same RGBA
+// pixels as qoy_decode. Returns 1 if it does.
+int verify_stream(const void *encoded, int encoded_size, const void *expected, int channels) {
+	stream_mem_t mem = {encoded, encoded_size, 0};
+	qoy_desc desc;
+	qoy_decoder *decoder = qoy_decoder_open(stream_mem_read, &mem, &desc, channels, QOY_FORMAT_RGBA);
+	if (!decoder) {
+		return 0;
 	}
 
-	if (channels != 3) {
-		channels = 4;
+	size_t line_size = (size_t)desc.width * channels;
+	unsigned char *lines = malloc(line_size * 2);
+	int ok = lines != NULL;
+	for (unsigned int y = 0; ok && y < desc.height;) {
+		int n = qoy_decoder_lines(decoder, lines);
+		ok = n > 0 && memcmp(lines, (const unsigned char *)expected + y * line_size, n * line_size) == 0;
+		y += n;
 	}
+	ok = ok && qoy_decoder_lines(decoder, lines) == 0;
+	free(lines);
+	qoy_decoder_close(decoder);
+	return ok;
+}
 
-	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
-	void *encoded_png = fload(path, &encoded_png_size);
+// A tiled image this wide has a streaming strip of more than 4 GiB if its
+// size is computed for a full tile height in 32 bits
+void verify_wide_stream(void) {
+	int w = 16777220;
+	int h = 2;
+	int channels = 4;
+	unsigned char *pixels = malloc((size_t)w * h * channels);
+	if (!pixels) {
+		ERROR("Out of memory for %dx%d", w, h);
+	}
+	for (size_t i = 0; i < (size_t)w * h * channels; i++) {
+		pixels[i] = (i / 4096) ^ (i & 3);
+	}
+
+	qoy_desc desc = {
+		.width = w,
+		.height = h,
+		.channels = channels,
+		.colorspace = QOY_COLORSPACE_SRGB,
+		.flags = opt_qoyflags | QOY_FLAG_TILED
+	};
+	int encoded_size;
+	void *encoded = qoy_encode_ex(pixels, &desc, &encoded_size, channels, QOY_FORMAT_RGBA, &opt_qoyoptions);
+	void *decoded = encoded ? qoy_decode(encoded, encoded_size, &desc, channels, QOY_FORMAT_RGBA) : NULL;
+	if (!decoded || !verify_stream(encoded, encoded_size, decoded, channels)) {
+		ERROR("QOY streaming roundtrip missmatch for %dx%d tiled", w, h);
+	}
+	QOY_FREE(decoded);
+	QOY_FREE(encoded);
+	free(pixels);
+}
+
+// Benchmark all codecs on an image in memory; path is only used for messages
+benchmark_result_t benchmark_pixels(const char *path, void *pixels, void *encoded_png, int encoded_png_size, int w, int h, int channels) {
+	int encoded_qoi_size;
+	int encoded_qoy_size;
+
+	// Encode QOI, QOY and the pre-converted YCbCrA
 	void *encoded_qoi = qoi_encode(pixels, &(qoi_desc){
 			.width = w,
 			.height = h, 
 			.channels = channels,
 			.colorspace = QOI_SRGB
 		}, &encoded_qoi_size);
-	void *encoded_qoy = qoy_encode(pixels, &(qoy_desc){
+	void *encoded_qoy = qoy_encode_ex(pixels, &(qoy_desc){
 			.width = w,
 			.height = h, 
 			.channels = channels,
-			.colorspace = QOY_COLORSPACE_SRGB
-		}, &encoded_qoy_size, channels, QOY_FORMAT_RGBA);
+			.colorspace = QOY_COLORSPACE_SRGB,
+			.flags = opt_qoyflags
+		}, &encoded_qoy_size, channels, QOY_FORMAT_RGBA, &opt_qoyoptions);
 	void *preconverted_qoy = QOY_MALLOC(qoy_ycbcra_size(w, h, channels));
     int preconverted_qoy_size = qoy_rgba_to_ycbcra(pixels, w, h, channels, channels, preconverted_qoy);
+	int encoded_qoylz_size;
+	void *encoded_qoylz = qoy_encode_ex(preconverted_qoy, &(qoy_desc){
+			.width = w,
+			.height = h,
+			.channels = channels,
+			.colorspace = QOY_COLORSPACE_SRGB,
+			.flags = opt_qoyflags | QOY_FLAG_LZ
+		}, &encoded_qoylz_size, channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions);
 
-	if (!pixels || !encoded_qoi || !encoded_qoy || !encoded_png) {
-		ERROR("Error decoding %s", path);
+	if (!encoded_qoi || !encoded_qoy || !encoded_qoylz) {
+		ERROR("Error encoding %s", path);
 	}
 
 	// Verify QOI Output
@@ -491,15 +1238,40 @@ benchmark_result_t benchmark_image(const char *path) {
             .width = w,
             .height = h,
             .channels = channels,
-            .colorspace = QOY_COLORSPACE_SRGB
+            .colorspace = QOY_COLORSPACE_SRGB,
+            .flags = opt_qoyflags
         };
-        void *encoded = qoy_encode(preconverted_qoy, &desc, &preconverted_qoy_size, channels, QOY_FORMAT_YCBCR420A);
-        void *decoded = qoy_decode(encoded, preconverted_qoy_size, &desc, channels, QOY_FORMAT_YCBCR420A);
-        if (memcmp(preconverted_qoy, decoded, qoy_ycbcra_size(w, h, channels)) != 0) {
-			ERROR("QOY roundtrip pixel missmatch for %s", path);
+        void *encoded = qoy_encode_ex(preconverted_qoy, &desc, &preconverted_qoy_size, channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions);
+        unsigned char *decoded = qoy_decode(encoded, preconverted_qoy_size, &desc, channels, QOY_FORMAT_YCBCR420A);
+        if (opt_qoyoptions.max_error == 0) {
+            if (memcmp(preconverted_qoy, decoded, qoy_ycbcra_size(w, h, channels)) != 0) {
+                ERROR("QOY roundtrip pixel missmatch for %s", path);
+            }
+        } else {
+            // Near-lossless: every YCbCrA value must be within max_error
+            unsigned char *original = preconverted_qoy;
+            for (int i = 0; i < qoy_ycbcra_size(w, h, channels); i++) {
+                if (abs(original[i] - decoded[i]) > opt_qoyoptions.max_error) {
+                    ERROR("QOY roundtrip error above %d for %s", opt_qoyoptions.max_error, path);
+                }
+            }
+        }
+
+        // The LZ stage must give back exactly the same pixels
+        void *decoded_lz = qoy_decode(encoded_qoylz, encoded_qoylz_size, &desc, channels, QOY_FORMAT_YCBCR420A);
+        if (!decoded_lz || memcmp(decoded, decoded_lz, qoy_ycbcra_size(w, h, channels)) != 0) {
+            ERROR("QOY LZ roundtrip pixel missmatch for %s", path);
         }
+        QOY_FREE(decoded_lz);
         QOY_FREE(encoded);
         QOY_FREE(decoded);
+
+        // The streaming decoder must give back the same pixels as qoy_decode
+        void *decoded_rgba = qoy_decode(encoded_qoy, encoded_qoy_size, &desc, channels, QOY_FORMAT_RGBA);
+        if (!decoded_rgba || !verify_stream(encoded_qoy, encoded_qoy_size, decoded_rgba, channels)) {
+            ERROR("QOY streaming roundtrip pixel missmatch for %s", path);
+        }
+        QOY_FREE(decoded_rgba);
 	}
 
 
@@ -511,62 +1283,83 @@ benchmark_result_t benchmark_image(const char *path) {
 	res.w = w;
 	res.h = h;
 
+	// Op histogram of the qoy-ycc encoding; a separate encode, so the timed
+	// runs below don't pay for it
+	int stats_size;
+	void *stats_p = qoy_encode_stats(preconverted_qoy, &(qoy_desc){
+			.width = w,
+			.height = h,
+			.channels = channels,
+			.colorspace = QOY_COLORSPACE_SRGB,
+			.flags = opt_qoyflags
+		}, &stats_size, channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions, &res.qoystats);
+	QOY_FREE(stats_p);
 
 	// Decoding
 
 	if (!opt_nodecode) {
 		if (!opt_nopng) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libpng.decode_time, {
+#ifndef QOYBENCH_NO_LIBPNG
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libpng.decode_time, res.libpng.decode_latency, res.libpng.decode_counters, {
 				int dec_w, dec_h;
 				void *dec_p = libpng_decode(encoded_png, encoded_png_size, &dec_w, &dec_h);
 				free(dec_p);
 			});
+#endif
 
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stbi.decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stbi.decode_time, res.stbi.decode_latency, res.stbi.decode_counters, {
 				int dec_w, dec_h, dec_channels;
 				void *dec_p = stbi_load_from_memory(encoded_png, encoded_png_size, &dec_w, &dec_h, &dec_channels, 4);
 				free(dec_p);
 			});
 		}
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoi.decode_time, {
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoi.decode_time, res.qoi.decode_latency, res.qoi.decode_counters, {
 			qoi_desc desc;
 			void *dec_p = qoi_decode(encoded_qoi, encoded_qoi_size, &desc, 4);
 			free(dec_p);
 		});
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyrgb.decode_time, {
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyrgb.decode_time, res.qoyrgb.decode_latency, res.qoyrgb.decode_counters, {
 			qoy_desc desc;
 			void *dec_p = qoy_decode(encoded_qoy, encoded_qoy_size, &desc, 4, QOY_FORMAT_RGBA);
 			free(dec_p);
 		});
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyycc.decode_time, {
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyycc.decode_time, res.qoyycc.decode_latency, res.qoyycc.decode_counters, {
 			qoy_desc desc;
 			void *dec_p = qoy_decode(encoded_qoy, encoded_qoy_size, &desc, 4, QOY_FORMAT_YCBCR420A);
 			free(dec_p);
 		});
+
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoylz.decode_time, res.qoylz.decode_latency, res.qoylz.decode_counters, {
+			qoy_desc desc;
+			void *dec_p = qoy_decode(encoded_qoylz, encoded_qoylz_size, &desc, 4, QOY_FORMAT_YCBCR420A);
+			free(dec_p);
+		});
 	}
 
 
 	// Encoding
 	if (!opt_noencode) {
 		if (!opt_nopng) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libpng.encode_time, {
+#ifndef QOYBENCH_NO_LIBPNG
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libpng.encode_time, res.libpng.encode_latency, res.libpng.encode_counters, {
 				int enc_size;
 				void *enc_p = libpng_encode(pixels, w, h, channels, &enc_size);
 				res.libpng.size = enc_size;
 				free(enc_p);
 			});
+#endif
 
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stbi.encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stbi.encode_time, res.stbi.encode_latency, res.stbi.encode_counters, {
 				int enc_size = 0;
 				stbi_write_png_to_func(stbi_write_callback, &enc_size, w, h, channels, pixels, 0);
 				res.stbi.size = enc_size;
 			});
 		}
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoi.encode_time, {
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoi.encode_time, res.qoi.encode_latency, res.qoi.encode_counters, {
 			int enc_size;
 			void *enc_p = qoi_encode(pixels, &(qoi_desc){
 				.width = w,
@@ -578,40 +1371,182 @@ benchmark_result_t benchmark_image(const char *path) {
 			free(enc_p);
 		});
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyrgb.encode_time, {
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyrgb.encode_time, res.qoyrgb.encode_latency, res.qoyrgb.encode_counters, {
 			int enc_size;
-			void *enc_p = qoy_encode(pixels, &(qoy_desc){
+			void *enc_p = qoy_encode_ex(pixels, &(qoy_desc){
 				.width = w,
 				.height = h, 
 				.channels = channels,
-				.colorspace = QOY_COLORSPACE_SRGB
-			}, &enc_size, channels, QOY_FORMAT_RGBA);
+				.colorspace = QOY_COLORSPACE_SRGB,
+				.flags = opt_qoyflags
+			}, &enc_size, channels, QOY_FORMAT_RGBA, &opt_qoyoptions);
 			res.qoyrgb.size = enc_size;
 			free(enc_p);
 		});
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyycc.encode_time, {
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoyycc.encode_time, res.qoyycc.encode_latency, res.qoyycc.encode_counters, {
 			int enc_size;
-			void *enc_p = qoy_encode(preconverted_qoy, &(qoy_desc){
+			void *enc_p = qoy_encode_ex(preconverted_qoy, &(qoy_desc){
 				.width = w,
 				.height = h, 
 				.channels = channels,
-				.colorspace = QOY_COLORSPACE_SRGB
-			}, &enc_size, channels, QOY_FORMAT_YCBCR420A);
+				.colorspace = QOY_COLORSPACE_SRGB,
+				.flags = opt_qoyflags
+			}, &enc_size, channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions);
 			res.qoyycc.size = enc_size;
 			free(enc_p);
 		});
+
+		BENCHMARK_FN(opt_nowarmup, opt_runs, res.qoylz.encode_time, res.qoylz.encode_latency, res.qoylz.encode_counters, {
+			int enc_size;
+			void *enc_p = qoy_encode_ex(preconverted_qoy, &(qoy_desc){
+				.width = w,
+				.height = h, 
+				.channels = channels,
+				.colorspace = QOY_COLORSPACE_SRGB,
+				.flags = opt_qoyflags | QOY_FLAG_LZ
+			}, &enc_size, channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions);
+			res.qoylz.size = enc_size;
+			free(enc_p);
+		});
+	}
+
+
+	// Stages: the colorspace conversions and the op loops of the qoy-ycc
+	// codec on their own, into preallocated buffers
+	if (opt_stages) {
+		void *ycbcra = QOY_MALLOC(qoy_ycbcra_size(w, h, channels));
+		void *rgba = malloc(w * h * channels);
+
+		if (!opt_noencode) {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stage_time[STAGE_RGBA_TO_YCBCRA], NULL, res.stage_counters[STAGE_RGBA_TO_YCBCRA], {
+				qoy_rgba_to_ycbcra(pixels, w, h, channels, channels, ycbcra);
+			});
+
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stage_time[STAGE_ENCODE_OPS], NULL, res.stage_counters[STAGE_ENCODE_OPS], {
+				int enc_size;
+				void *enc_p = qoy_encode_ex(ycbcra, &(qoy_desc){
+					.width = w,
+					.height = h,
+					.channels = channels,
+					.colorspace = QOY_COLORSPACE_SRGB,
+					.flags = opt_qoyflags
+				}, &enc_size, channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions);
+				free(enc_p);
+			});
+		}
+
+		if (!opt_nodecode) {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stage_time[STAGE_DECODE_OPS], NULL, res.stage_counters[STAGE_DECODE_OPS], {
+				qoy_desc desc;
+				void *dec_p = qoy_decode(encoded_qoy, encoded_qoy_size, &desc, channels, QOY_FORMAT_YCBCR420A);
+				free(dec_p);
+			});
+
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.stage_time[STAGE_YCBCRA_TO_RGBA], NULL, res.stage_counters[STAGE_YCBCRA_TO_RGBA], {
+				qoy_ycbcra_to_rgba(preconverted_qoy, w, h, channels, channels, rgba);
+			});
+		}
+
+		QOY_FREE(ycbcra);
+		free(rgba);
 	}
 
-	free(pixels);
-	free(encoded_png);
 	free(encoded_qoi);
 	free(encoded_qoy);
+	free(encoded_qoylz);
 	free(preconverted_qoy);
 
 	return res;
 }
 
+benchmark_result_t benchmark_image(const char *path) {
+	int encoded_png_size;
+	int w;
+	int h;
+	int channels;
+
+	// Load the encoded PNG and raw pixels into memory
+	if(!stbi_info(path, &w, &h, &channels)) {
+		ERROR("Error decoding header %s", path);
+	}
+
+	if (channels != 3) {
+		channels = 4;
+	}
+
+	void *pixels = (void *)stbi_load(path, &w, &h, NULL, channels);
+	void *encoded_png = fload(path, &encoded_png_size);
+	if (!pixels || !encoded_png) {
+		ERROR("Error decoding %s", path);
+	}
+
+	benchmark_result_t res = benchmark_pixels(path, pixels, encoded_png, encoded_png_size, w, h, channels);
+
+	free(pixels);
+	free(encoded_png);
+	return res;
+}
+
+void benchmark_add_result(benchmark_result_t *total, const benchmark_result_t *res) {
+	total->count++;
+	total->raw_size += res->raw_size;
+	total->px += res->px;
+	total->libpng.encode_time += res->libpng.encode_time;
+	total->libpng.decode_time += res->libpng.decode_time;
+	total->libpng.size += res->libpng.size;
+	total->stbi.encode_time += res->stbi.encode_time;
+	total->stbi.decode_time += res->stbi.decode_time;
+	total->stbi.size += res->stbi.size;
+	total->qoi.encode_time += res->qoi.encode_time;
+	total->qoi.decode_time += res->qoi.decode_time;
+	total->qoi.size += res->qoi.size;
+	total->qoyrgb.encode_time += res->qoyrgb.encode_time;
+	total->qoyrgb.decode_time += res->qoyrgb.decode_time;
+	total->qoyrgb.size += res->qoyrgb.size;
+	total->qoyycc.encode_time += res->qoyycc.encode_time;
+	total->qoyycc.decode_time += res->qoyycc.decode_time;
+	total->qoyycc.size += res->qoyycc.size;
+	total->qoylz.encode_time += res->qoylz.encode_time;
+	total->qoylz.decode_time += res->qoylz.decode_time;
+	total->qoylz.size += res->qoylz.size;
+	for (int p = 0; p < LATENCY_PERCENTILES; p++) {
+		total->libpng.encode_latency[p] += res->libpng.encode_latency[p];
+		total->libpng.decode_latency[p] += res->libpng.decode_latency[p];
+		total->stbi.encode_latency[p] += res->stbi.encode_latency[p];
+		total->stbi.decode_latency[p] += res->stbi.decode_latency[p];
+		total->qoi.encode_latency[p] += res->qoi.encode_latency[p];
+		total->qoi.decode_latency[p] += res->qoi.decode_latency[p];
+		total->qoyrgb.encode_latency[p] += res->qoyrgb.encode_latency[p];
+		total->qoyrgb.decode_latency[p] += res->qoyrgb.decode_latency[p];
+		total->qoyycc.encode_latency[p] += res->qoyycc.encode_latency[p];
+		total->qoyycc.decode_latency[p] += res->qoyycc.decode_latency[p];
+		total->qoylz.encode_latency[p] += res->qoylz.encode_latency[p];
+		total->qoylz.decode_latency[p] += res->qoylz.decode_latency[p];
+	}
+	benchmark_add_stats(&total->qoystats, &res->qoystats);
+	for (int i = 0; i < BENCHMARK_STAGES; i++) {
+		total->stage_time[i] += res->stage_time[i];
+	}
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		total->libpng.encode_counters[c] += res->libpng.encode_counters[c];
+		total->libpng.decode_counters[c] += res->libpng.decode_counters[c];
+		total->stbi.encode_counters[c] += res->stbi.encode_counters[c];
+		total->stbi.decode_counters[c] += res->stbi.decode_counters[c];
+		total->qoi.encode_counters[c] += res->qoi.encode_counters[c];
+		total->qoi.decode_counters[c] += res->qoi.decode_counters[c];
+		total->qoyrgb.encode_counters[c] += res->qoyrgb.encode_counters[c];
+		total->qoyrgb.decode_counters[c] += res->qoyrgb.decode_counters[c];
+		total->qoyycc.encode_counters[c] += res->qoyycc.encode_counters[c];
+		total->qoyycc.decode_counters[c] += res->qoyycc.decode_counters[c];
+		total->qoylz.encode_counters[c] += res->qoylz.encode_counters[c];
+		total->qoylz.decode_counters[c] += res->qoylz.decode_counters[c];
+		for (int i = 0; i < BENCHMARK_STAGES; i++) {
+			total->stage_counters[i][c] += res->stage_counters[i][c];
+		}
+	}
+}
+
 void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 	DIR *dir = opendir(path);
 	if (!dir) {
@@ -646,7 +1581,7 @@ void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 			continue;
 		}
 
-		if (!has_shown_heaad) {
+		if (!has_shown_heaad && opt_output == OUTPUT_TEXT) {
 			has_shown_heaad = 1;
 			printf("## Benchmarking %s/*.png -- %d runs\n\n", path, opt_runs);
 		}
@@ -657,61 +1592,631 @@ void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 		benchmark_result_t res = benchmark_image(file_path);
 
 		if (!opt_onlytotals) {
-			printf("## %s size: %dx%d\n", file_path, res.w, res.h);
-			benchmark_print_result(res);
+			benchmark_output("image", file_path, res);
 		}
 
 		free(file_path);
 		
-		dir_total.count++;
-		dir_total.raw_size += res.raw_size;
-		dir_total.px += res.px;
-		dir_total.libpng.encode_time += res.libpng.encode_time;
-		dir_total.libpng.decode_time += res.libpng.decode_time;
-		dir_total.libpng.size += res.libpng.size;
-		dir_total.stbi.encode_time += res.stbi.encode_time;
-		dir_total.stbi.decode_time += res.stbi.decode_time;
-		dir_total.stbi.size += res.stbi.size;
-		dir_total.qoi.encode_time += res.qoi.encode_time;
-		dir_total.qoi.decode_time += res.qoi.decode_time;
-		dir_total.qoi.size += res.qoi.size;
-		dir_total.qoyrgb.encode_time += res.qoyrgb.encode_time;
-		dir_total.qoyrgb.decode_time += res.qoyrgb.decode_time;
-		dir_total.qoyrgb.size += res.qoyrgb.size;
-		dir_total.qoyycc.encode_time += res.qoyycc.encode_time;
-		dir_total.qoyycc.decode_time += res.qoyycc.decode_time;
-		dir_total.qoyycc.size += res.qoyycc.size;
-
-		grand_total->count++;
-		grand_total->raw_size += res.raw_size;
-		grand_total->px += res.px;
-		grand_total->libpng.encode_time += res.libpng.encode_time;
-		grand_total->libpng.decode_time += res.libpng.decode_time;
-		grand_total->libpng.size += res.libpng.size;
-		grand_total->stbi.encode_time += res.stbi.encode_time;
-		grand_total->stbi.decode_time += res.stbi.decode_time;
-		grand_total->stbi.size += res.stbi.size;
-		grand_total->qoi.encode_time += res.qoi.encode_time;
-		grand_total->qoi.decode_time += res.qoi.decode_time;
-		grand_total->qoi.size += res.qoi.size;
-		grand_total->qoyrgb.encode_time += res.qoyrgb.encode_time;
-		grand_total->qoyrgb.decode_time += res.qoyrgb.decode_time;
-		grand_total->qoyrgb.size += res.qoyrgb.size;
-		grand_total->qoyycc.encode_time += res.qoyycc.encode_time;
-		grand_total->qoyycc.decode_time += res.qoyycc.decode_time;
-		grand_total->qoyycc.size += res.qoyycc.size;
+		benchmark_add_result(&dir_total, &res);
+		benchmark_add_result(grand_total, &res);
 	}
 	closedir(dir);
 
 	if (dir_total.count > 0) {
-		printf("## Total for %s\n", path);
-		benchmark_print_result(dir_total);
+		benchmark_output("directory", path, dir_total);
 	}
 }
 
+
+
+// -----------------------------------------------------------------------------
+// synthetic corpus
+
+// With --synthetic N qoybench generates its images instead of loading them,
+// so results are reproducible without an image directory or libpng. Every
+// kind of content is generated at 64, 256, 1024, 4096 and 16384 px wide, up
+// to N, with a 16:9 aspect and an odd height. The generators only depend on
+// their seed, never on the platform.
+
+uint32_t synth_random(uint32_t *state) {
+	// xorshift32
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Random value for a point of a noise lattice
+uint32_t synth_hash(uint32_t x, uint32_t y, uint32_t seed) {
+	uint32_t h = x * 0x8da6b343 ^ y * 0xd8163841 ^ seed * 0xcb1ab31f;
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	h *= 0x846ca68b;
+	h ^= h >> 16;
+	return h;
+}
+
+void synth_rect(unsigned char *pixels, int w, int h, int channels, int x0, int y0, int rw, int rh, const unsigned char *color) {
+	int x1 = x0 + rw > w ? w : x0 + rw;
+	int y1 = y0 + rh > h ? h : y0 + rh;
+	for (int y = y0 < 0 ? 0 : y0; y < y1; y++) {
+		for (int x = x0 < 0 ? 0 : x0; x < x1; x++) {
+			memcpy(pixels + (y * w + x) * channels, color, channels);
+		}
+	}
+}
+
+// Flat UI: a light background with panels and buttons in a few flat colors,
+// each with a darker 1px border
+void synth_ui(unsigned char *pixels, int w, int h, int channels, uint32_t *rng) {
+	static const unsigned char palette[8][3] = {
+		{255, 255, 255}, {33, 150, 243}, {76, 175, 80}, {244, 67, 54},
+		{255, 193, 7}, {96, 125, 139}, {224, 224, 224}, {48, 48, 48}
+	};
+
+	unsigned char background[3] = {245, 245, 245};
+	synth_rect(pixels, w, h, channels, 0, 0, w, h, background);
+
+	int count = w * h / 4096 + 4;
+	for (int i = 0; i < count; i++) {
+		const unsigned char *color = palette[synth_random(rng) % 8];
+		unsigned char border[3] = {color[0] * 3 / 4, color[1] * 3 / 4, color[2] * 3 / 4};
+		int rw = w / 16 + synth_random(rng) % (w / 4 + 1);
+		int rh = h / 32 + synth_random(rng) % (h / 6 + 1);
+		int x = synth_random(rng) % w;
+		int y = synth_random(rng) % h;
+		synth_rect(pixels, w, h, channels, x, y, rw, rh, border);
+		synth_rect(pixels, w, h, channels, x + 1, y + 1, rw - 2, rh - 2, color);
+	}
+}
+
+// Smooth horizontal, vertical and diagonal gradients, one per channel
+void synth_gradient(unsigned char *pixels, int w, int h, int channels, uint32_t *rng) {
+	int phase = synth_random(rng) % 256;
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			unsigned char *p = pixels + (y * w + x) * channels;
+			p[0] = (x * 255 / w + phase) & 0xff;
+			p[1] = y * 255 / h;
+			p[2] = 255 - (int)((int64_t)(x + y) * 255 / (w + h));
+		}
+	}
+}
+
+// Uniform noise, the worst case for every codec
+void synth_noise(unsigned char *pixels, int w, int h, int channels, uint32_t *rng) {
+	for (int i = 0; i < w * h * channels; i++) {
+		pixels[i] = synth_random(rng);
+	}
+}
+
+// Text: lines of words made of 5x7 glyphs on a white page, mostly black with
+// the odd colored line
+void synth_text(unsigned char *pixels, int w, int h, int channels, uint32_t *rng) {
+	uint64_t glyphs[64];
+	for (int i = 0; i < 64; i++) {
+		// About half of the glyph pixels set
+		glyphs[i] = ((uint64_t)synth_random(rng) << 32 | synth_random(rng)) & ((1ull << 35) - 1);
+	}
+
+	unsigned char page[3] = {255, 255, 255};
+	synth_rect(pixels, w, h, channels, 0, 0, w, h, page);
+
+	for (int line = 4; line + 7 < h; line += 11) {
+		unsigned char ink[3] = {20, 20, 20};
+		if (synth_random(rng) % 8 == 0) {
+			ink[0] = 26; ink[1] = 92; ink[2] = 200;
+		}
+		int end = w - 4 - synth_random(rng) % (w / 3 + 1);
+		int x = 4;
+		while (x + 6 < end) {
+			int word = 2 + synth_random(rng) % 8;
+			for (int c = 0; c < word && x + 6 < end; c++, x += 6) {
+				uint64_t glyph = glyphs[synth_random(rng) % 64];
+				for (int gy = 0; gy < 7; gy++) {
+					for (int gx = 0; gx < 5; gx++) {
+						if (glyph >> (gy * 5 + gx) & 1) {
+							memcpy(pixels + ((line + gy) * w + x + gx) * channels, ink, 3);
+						}
+					}
+				}
+			}
+			x += 6;
+		}
+	}
+}
+
+// Sprites: shaded, anti-aliased discs on a fully transparent background
+void synth_sprites(unsigned char *pixels, int w, int h, int channels, uint32_t *rng) {
+	memset(pixels, 0, w * h * channels);
+
+	int count = w * h / 8192 + 2;
+	for (int i = 0; i < count; i++) {
+		int r = 4 + synth_random(rng) % (w / 16 + 1);
+		int cx = synth_random(rng) % w;
+		int cy = synth_random(rng) % h;
+		unsigned char color[3] = {synth_random(rng), synth_random(rng), synth_random(rng)};
+
+		// Opaque inside r-1, fading out linearly (in d²) up to r+1
+		int inner = (r - 1) * (r - 1);
+		int outer = (r + 1) * (r + 1);
+		for (int y = cy - r - 1; y <= cy + r + 1; y++) {
+			for (int x = cx - r - 1; x <= cx + r + 1; x++) {
+				if (x < 0 || y < 0 || x >= w || y >= h) {
+					continue;
+				}
+				int d = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+				if (d >= outer) {
+					continue;
+				}
+				int alpha = d <= inner ? 255 : 255 * (outer - d) / (outer - inner);
+				int shade = 256 - (y - cy) * 64 / r;
+				unsigned char *p = pixels + (y * w + x) * channels;
+				if (alpha >= p[3]) {
+					for (int c = 0; c < 3; c++) {
+						int v = color[c] * shade >> 8;
+						p[c] = v > 255 ? 255 : v;
+					}
+					p[3] = alpha;
+				}
+			}
+		}
+	}
+}
+
+// Value noise with octaves from cell down to 2 px, 0..255
+int synth_fractal(int x, int y, int cell, uint32_t seed) {
+	int sum = 0;
+	int amplitude = 128;
+	for (; cell >= 2 && amplitude > 0; cell /= 2, amplitude /= 2, seed++) {
+		int ix = x / cell;
+		int iy = y / cell;
+		int fx = (x % cell) * 256 / cell;
+		int fy = (y % cell) * 256 / cell;
+		int v00 = synth_hash(ix, iy, seed) & 0xff;
+		int v10 = synth_hash(ix + 1, iy, seed) & 0xff;
+		int v01 = synth_hash(ix, iy + 1, seed) & 0xff;
+		int v11 = synth_hash(ix + 1, iy + 1, seed) & 0xff;
+		int top = v00 * (256 - fx) + v10 * fx;
+		int bottom = v01 * (256 - fx) + v11 * fx;
+		sum += ((top >> 8) * (256 - fy) + (bottom >> 8) * fy) * amplitude >> 16;
+	}
+	return sum;
+}
+
+// Photo-like: detailed fractal luma, smoother fractal chroma and a little
+// sensor noise
+void synth_photo(unsigned char *pixels, int w, int h, int channels, uint32_t *rng) {
+	uint32_t seed = synth_random(rng);
+	int cell = w / 4 > 256 ? 256 : (w / 4 < 2 ? 2 : w / 4);
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			int luma = synth_fractal(x, y, cell, seed);
+			int cb = (synth_fractal(x, y, cell * 2, seed + 16) - 128) / 2;
+			int cr = (synth_fractal(x, y, cell * 2, seed + 32) - 128) / 2;
+			int noise = (synth_random(rng) & 7) - 4;
+			int rgb[3] = {
+				luma + cr + noise,
+				luma - cb / 2 - cr / 2 + noise,
+				luma + cb + noise
+			};
+			unsigned char *p = pixels + (y * w + x) * channels;
+			for (int c = 0; c < 3; c++) {
+				p[c] = rgb[c] < 0 ? 0 : (rgb[c] > 255 ? 255 : rgb[c]);
+			}
+		}
+	}
+}
+
+typedef struct {
+	const char *name;
+	int channels;
+	void (*generate)(unsigned char *pixels, int w, int h, int channels, uint32_t *rng);
+} synth_kind_t;
+
+const synth_kind_t synth_kinds[] = {
+	{"ui",       3, synth_ui},
+	{"gradient", 3, synth_gradient},
+	{"noise",    3, synth_noise},
+	{"text",     3, synth_text},
+	{"sprites",  4, synth_sprites},
+	{"photo",    3, synth_photo}
+};
+
+const int synth_sizes[] = {64, 256, 1024, 4096, 16384};
+
+void benchmark_synthetic(int max_size, benchmark_result_t *grand_total) {
+	if (!opt_noverify) {
+		verify_wide_stream();
+	}
+
+	for (int k = 0; k < (int)(sizeof(synth_kinds) / sizeof(synth_kinds[0])); k++) {
+		const synth_kind_t *kind = &synth_kinds[k];
+		char dir_path[64];
+		snprintf(dir_path, sizeof(dir_path), "synthetic/%s", kind->name);
+		if (opt_output == OUTPUT_TEXT) {
+			printf("## Benchmarking %s -- %d runs\n\n", dir_path, opt_runs);
+		}
+
+		benchmark_result_t dir_total = {0};
+		for (int i = 0; i < (int)(sizeof(synth_sizes) / sizeof(synth_sizes[0])) && synth_sizes[i] <= max_size; i++) {
+			int w = synth_sizes[i];
+			int h = w * 9 / 16 + 1;
+			int channels = kind->channels;
+
+			unsigned char *pixels = malloc((size_t)w * h * channels);
+			if (!pixels) {
+				ERROR("Out of memory for %dx%d", w, h);
+			}
+			uint32_t rng = 0x9e3779b9 ^ (k << 16) ^ i;
+			kind->generate(pixels, w, h, channels, &rng);
+
+			// The png decoders need a png to decode
+			stbi_mem_t png = {0};
+			if (!opt_nopng) {
+				stbi_write_png_to_func(stbi_mem_callback, &png, w, h, channels, pixels, 0);
+			}
+
+			char path[128];
+			snprintf(path, sizeof(path), "%s_%dx%d", dir_path, w, h);
+			benchmark_result_t res = benchmark_pixels(path, pixels, png.data, png.size, w, h, channels);
+			if (!opt_onlytotals) {
+				benchmark_output("image", path, res);
+			}
+
+			free(png.data);
+			free(pixels);
+
+			benchmark_add_result(&dir_total, &res);
+			benchmark_add_result(grand_total, &res);
+		}
+
+		if (dir_total.count > 0) {
+			benchmark_output("directory", dir_path, dir_total);
+		}
+	}
+}
+
+
+
+// -----------------------------------------------------------------------------
+// thread scaling
+
+// With --threads N the whole corpus is loaded and encoded up front. Then, for
+// every thread count from 1 to N, that many threads encode or decode all of it
+// concurrently, each its own pass over the corpus, as a server using all cores
+// would. Memory bandwidth and malloc() are shared between them.
+
+typedef struct {
+	int w;
+	int h;
+	int channels;
+	void *pixels;
+	void *ycbcra;
+	void *encoded_qoi;
+	int encoded_qoi_size;
+	void *encoded_qoy;
+	int encoded_qoy_size;
+} scaling_image_t;
+
+typedef struct {
+	scaling_image_t *images;
+	int count;
+	int capacity;
+	uint64_t px;
+} scaling_corpus_t;
+
+#define SCALING_QOI    0
+#define SCALING_QOYRGB 1
+#define SCALING_QOYYCC 2
+
+typedef struct {
+	const scaling_corpus_t *corpus;
+	int codec;
+	int encode;
+	int ready;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} scaling_run_t;
+
+// Add an image to the corpus and encode it up front. The corpus takes over
+// pixels, which must come from malloc().
+void scaling_add_image(scaling_corpus_t *corpus, const char *name, void *pixels, int w, int h, int channels) {
+	if (corpus->count == corpus->capacity) {
+		corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 64;
+		corpus->images = realloc(corpus->images, corpus->capacity * sizeof(scaling_image_t));
+		if (!corpus->images) {
+			ERROR("Malloc for %d images failed", corpus->capacity);
+		}
+	}
+
+	scaling_image_t *image = &corpus->images[corpus->count++];
+	image->w = w;
+	image->h = h;
+	image->channels = channels;
+	image->pixels = pixels;
+	image->ycbcra = QOY_MALLOC(qoy_ycbcra_size(w, h, channels));
+	if (!image->ycbcra) {
+		ERROR("Malloc for %s failed", name);
+	}
+	qoy_rgba_to_ycbcra(pixels, w, h, channels, channels, image->ycbcra);
+	image->encoded_qoi = qoi_encode(pixels, &(qoi_desc){
+			.width = w,
+			.height = h,
+			.channels = channels,
+			.colorspace = QOI_SRGB
+		}, &image->encoded_qoi_size);
+	image->encoded_qoy = qoy_encode_ex(pixels, &(qoy_desc){
+			.width = w,
+			.height = h,
+			.channels = channels,
+			.colorspace = QOY_COLORSPACE_SRGB,
+			.flags = opt_qoyflags
+		}, &image->encoded_qoy_size, channels, QOY_FORMAT_RGBA, &opt_qoyoptions);
+	if (!image->encoded_qoi || !image->encoded_qoy) {
+		ERROR("Error encoding %s", name);
+	}
+	corpus->px += (uint64_t)w * h;
+}
+
+void scaling_load_directory(const char *path, scaling_corpus_t *corpus) {
+	DIR *dir = opendir(path);
+	if (!dir) {
+		ERROR("Couldn't open directory %s", path);
+	}
+
+	struct dirent *file;
+	while ((file = readdir(dir)) != NULL) {
+		char file_path[1024];
+		snprintf(file_path, 1024, "%s/%s", path, file->d_name);
+
+		if (file->d_type & DT_DIR) {
+			if (!opt_norecurse && strcmp(file->d_name, ".") != 0 && strcmp(file->d_name, "..") != 0) {
+				scaling_load_directory(file_path, corpus);
+			}
+			continue;
+		}
+		if (strcmp(file->d_name + strlen(file->d_name) - 4, ".png") != 0) {
+			continue;
+		}
+
+		int w, h, channels;
+		if (!stbi_info(file_path, &w, &h, &channels)) {
+			ERROR("Error decoding header %s", file_path);
+		}
+		if (channels != 3) {
+			channels = 4;
+		}
+
+		void *pixels = (void *)stbi_load(file_path, &w, &h, NULL, channels);
+		if (!pixels) {
+			ERROR("Error decoding %s", file_path);
+		}
+		scaling_add_image(corpus, file_path, pixels, w, h, channels);
+	}
+	closedir(dir);
+}
+
+// The same images as --synthetic benchmarks, from 64 up to max_size px wide
+void scaling_load_synthetic(int max_size, scaling_corpus_t *corpus) {
+	for (int k = 0; k < (int)(sizeof(synth_kinds) / sizeof(synth_kinds[0])); k++) {
+		const synth_kind_t *kind = &synth_kinds[k];
+		for (int i = 0; i < (int)(sizeof(synth_sizes) / sizeof(synth_sizes[0])) && synth_sizes[i] <= max_size; i++) {
+			int w = synth_sizes[i];
+			int h = w * 9 / 16 + 1;
+			int channels = kind->channels;
+
+			unsigned char *pixels = malloc((size_t)w * h * channels);
+			if (!pixels) {
+				ERROR("Out of memory for %dx%d", w, h);
+			}
+			uint32_t rng = 0x9e3779b9 ^ (k << 16) ^ i;
+			kind->generate(pixels, w, h, channels, &rng);
+			scaling_add_image(corpus, kind->name, pixels, w, h, channels);
+		}
+	}
+}
+
+// Encode or decode every image of the corpus once
+void scaling_pass(const scaling_corpus_t *corpus, int codec, int encode) {
+	for (int i = 0; i < corpus->count; i++) {
+		scaling_image_t *image = &corpus->images[i];
+		void *out = NULL;
+		int out_size;
+		qoi_desc qoi_d;
+		qoy_desc qoy_d = {
+			.width = image->w,
+			.height = image->h,
+			.channels = image->channels,
+			.colorspace = QOY_COLORSPACE_SRGB,
+			.flags = opt_qoyflags
+		};
+
+		if (codec == SCALING_QOI && encode) {
+			out = qoi_encode(image->pixels, &(qoi_desc){
+					.width = image->w,
+					.height = image->h,
+					.channels = image->channels,
+					.colorspace = QOI_SRGB
+				}, &out_size);
+		}
+		else if (codec == SCALING_QOI) {
+			out = qoi_decode(image->encoded_qoi, image->encoded_qoi_size, &qoi_d, 4);
+		}
+		else if (codec == SCALING_QOYRGB && encode) {
+			out = qoy_encode_ex(image->pixels, &qoy_d, &out_size, image->channels, QOY_FORMAT_RGBA, &opt_qoyoptions);
+		}
+		else if (codec == SCALING_QOYRGB) {
+			out = qoy_decode(image->encoded_qoy, image->encoded_qoy_size, &qoy_d, 4, QOY_FORMAT_RGBA);
+		}
+		else if (encode) {
+			out = qoy_encode_ex(image->ycbcra, &qoy_d, &out_size, image->channels, QOY_FORMAT_YCBCR420A, &opt_qoyoptions);
+		}
+		else {
+			out = qoy_decode(image->encoded_qoy, image->encoded_qoy_size, &qoy_d, 4, QOY_FORMAT_YCBCR420A);
+		}
+
+		if (!out) {
+			ERROR("Error %s image %d", encode ? "encoding" : "decoding", i);
+		}
+		free(out);
+	}
+}
+
+void *scaling_worker(void *arg) {
+	scaling_run_t *run = (scaling_run_t *)arg;
+	if (!opt_nowarmup) {
+		scaling_pass(run->corpus, run->codec, run->encode);
+	}
+
+	// Wait for all threads, so they run the timed passes side by side
+	pthread_mutex_lock(&run->lock);
+	run->ready++;
+	pthread_cond_broadcast(&run->cond);
+	while (!run->started) {
+		pthread_cond_wait(&run->cond, &run->lock);
+	}
+	pthread_mutex_unlock(&run->lock);
+
+	for (int i = 0; i < opt_runs; i++) {
+		scaling_pass(run->corpus, run->codec, run->encode);
+	}
+	return NULL;
+}
+
+// Run a codec on a number of threads at once. Returns the aggregate mpps.
+double scaling_measure(const scaling_corpus_t *corpus, int codec, int encode, int threads) {
+	scaling_run_t run = {
+		.corpus = corpus,
+		.codec = codec,
+		.encode = encode
+	};
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.cond, NULL);
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (!workers) {
+		ERROR("Malloc for %d threads failed", threads);
+	}
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, scaling_worker, &run) != 0) {
+			ERROR("Couldn't start thread %d", i + 1);
+		}
+	}
+
+	pthread_mutex_lock(&run.lock);
+	while (run.ready < threads) {
+		pthread_cond_wait(&run.cond, &run.lock);
+	}
+	run.started = 1;
+	uint64_t time_start = ns();
+	pthread_cond_broadcast(&run.cond);
+	pthread_mutex_unlock(&run.lock);
+
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	uint64_t time = ns() - time_start;
+
+	free(workers);
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.lock);
+	return time > 0 ? (double)corpus->px * opt_runs * threads / ((double)time / 1000.0) : 0;
+}
+
+// The corpus is the images in path, if not NULL, and with synthetic > 0 the
+// generated images of --synthetic
+void scaling_benchmark(const char *path, int synthetic, int max_threads) {
+	scaling_corpus_t corpus = {0};
+	if (path) {
+		scaling_load_directory(path, &corpus);
+	}
+	if (synthetic > 0) {
+		scaling_load_synthetic(synthetic, &corpus);
+	}
+
+	char name[1024];
+	snprintf(name, sizeof(name), "%s%s%s", path ? path : "", path && synthetic > 0 ? " and " : "", synthetic > 0 ? "synthetic" : "");
+	if (corpus.count == 0) {
+		printf("No images found in %s\n", name);
+		return;
+	}
+
+	printf("## Thread scaling for %s -- %d images, %d runs per thread\n\n", name, corpus.count, opt_runs);
+	printf("         threads   decode mpps   per core   encode mpps   per core\n");
+
+	// Per core efficiency is the aggregate mpps relative to that many times the
+	// single thread mpps
+	const char *names[] = { "qoi:", "qoy-rgb:", "qoy-ycc:" };
+	for (int codec = SCALING_QOI; codec <= SCALING_QOYYCC; codec++) {
+		double single[2] = {0};
+		for (int threads = 1; threads <= max_threads; threads++) {
+			double mpps[2] = {0};
+			for (int encode = 0; encode <= 1; encode++) {
+				if (encode ? opt_noencode : opt_nodecode) {
+					continue;
+				}
+				mpps[encode] = scaling_measure(&corpus, codec, encode, threads);
+				if (threads == 1) {
+					single[encode] = mpps[encode];
+				}
+			}
+			printf(
+				"%-9s %6d      %8.2f     %5.1f%%      %8.2f     %5.1f%%\n",
+				threads == 1 ? names[codec] : "", threads,
+				mpps[0], single[0] > 0 ? mpps[0] / (single[0] * threads) * 100.0 : 0,
+				mpps[1], single[1] > 0 ? mpps[1] / (single[1] * threads) * 100.0 : 0
+			);
+		}
+		printf("\n");
+	}
+
+	for (int i = 0; i < corpus.count; i++) {
+		free(corpus.images[i].pixels);
+		QOY_FREE(corpus.images[i].ycbcra);
+		free(corpus.images[i].encoded_qoi);
+		free(corpus.images[i].encoded_qoy);
+	}
+	free(corpus.images);
+}
+
 int main(int argc, char **argv) {
-	if (argc < 3) {
+	// The directory may be left out with --synthetic
+	const char *path = argc > 2 && strncmp(argv[2], "--", 2) != 0 ? argv[2] : NULL;
+	for (int i = path ? 3 : 2; i < argc; i++) {
+		if (strcmp(argv[i], "--nowarmup") == 0) { opt_nowarmup = 1; }
+		else if (strcmp(argv[i], "--nopng") == 0) { opt_nopng = 1; }
+		else if (strcmp(argv[i], "--noverify") == 0) { opt_noverify = 1; }
+		else if (strcmp(argv[i], "--noencode") == 0) { opt_noencode = 1; }
+		else if (strcmp(argv[i], "--nodecode") == 0) { opt_nodecode = 1; }
+		else if (strcmp(argv[i], "--norecurse") == 0) { opt_norecurse = 1; }
+		else if (strcmp(argv[i], "--onlytotals") == 0) { opt_onlytotals = 1; }
+		else if (strcmp(argv[i], "--predict") == 0) { opt_qoyflags |= QOY_FLAG_PREDICT; }
+		else if (strcmp(argv[i], "--index") == 0) { opt_qoyflags |= QOY_FLAG_INDEX; }
+		else if (strcmp(argv[i], "--tiled") == 0) { opt_qoyflags |= QOY_FLAG_TILED; }
+		else if (strcmp(argv[i], "--alpharun") == 0) { opt_qoyflags |= QOY_FLAG_ALPHA_RUN; }
+		else if (strcmp(argv[i], "--crc") == 0) { opt_qoyflags |= QOY_FLAG_CRC; }
+		else if (strcmp(argv[i], "--effort") == 0 && i + 1 < argc) { opt_qoyoptions.effort = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--maxerror") == 0 && i + 1 < argc) { opt_qoyoptions.max_error = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--ops") == 0) { opt_ops = 1; }
+		else if (strcmp(argv[i], "--stages") == 0) { opt_stages = 1; }
+		else if (strcmp(argv[i], "--latency") == 0) { opt_latency = 1; }
+		else if (strcmp(argv[i], "--cold") == 0) { opt_cold = 1; }
+		else if (strcmp(argv[i], "--counters") == 0) { opt_counters = 1; }
+		else if (strcmp(argv[i], "--json") == 0) { opt_output = OUTPUT_JSON; }
+		else if (strcmp(argv[i], "--csv") == 0) { opt_output = OUTPUT_CSV; }
+		else if (strcmp(argv[i], "--synthetic") == 0 && i + 1 < argc) { opt_synthetic = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { opt_threads = atoi(argv[++i]); }
+		else { ERROR("Unknown option %s", argv[i]); }
+	}
+
+	if (argc < 3 || (!path && opt_synthetic <= 0)) {
 		printf("Usage: qoybench <iterations> <directory> [options]\n");
+		printf("       qoybench <iterations> [directory] --synthetic N [options]\n");
 		printf("Options:\n");
 		printf("    --nowarmup ... don't perform a warmup run\n");
 		printf("    --nopng ...... don't run png encode/decode\n");
@@ -720,37 +2225,67 @@ int main(int argc, char **argv) {
 		printf("    --nodecode ... don't run decoders\n");
 		printf("    --norecurse .. don't descend into directories\n");
 		printf("    --onlytotals . don't print individual image results\n");
+		printf("    --predict .... encode qoy with per row pair predictors\n");
+		printf("    --index ...... encode qoy with the hashed block index op\n");
+		printf("    --tiled ...... encode qoy in independently coded 256x256 tiles\n");
+		printf("    --alpharun ... encode qoy with alpha ops that continue YCbCr runs\n");
+		printf("    --crc ........ encode qoy with CRC32C checksums of every tile\n");
+		printf("    --effort N ... qoy encoder effort, 0 (fastest, default) to 2 (smallest)\n");
+		printf("    --maxerror N . near-lossless qoy, max error per YCbCrA value (0 = lossless)\n");
+		printf("    --ops ........ print the histogram of qoy ops and the bytes spent on each\n");
+		printf("    --stages ..... time the colorspace conversions and the qoy op loops apart\n");
+		printf("    --latency .... print min/p50/p90/p99/max of the single run times\n");
+		printf("    --cold ....... evict the caches before every run by writing a 256mb buffer\n");
+		printf("    --counters ... count cycles, instructions, branch and cache misses per pixel\n");
+		printf("                   with linux perf_event_open, if available\n");
+		printf("    --json ....... print all results, with the qoy op histogram, as JSON\n");
+		printf("    --csv ........ print all results, with the qoy op histogram, as CSV\n");
+		printf("    --synthetic N  also benchmark generated flat UI, gradient, noise, text,\n");
+		printf("                   alpha sprite and photo-like images, from 64 up to N px wide\n");
+		printf("    --threads N .. encode/decode the corpus on 1..N threads at once and report\n");
+		printf("                   the aggregate mpps and per core efficiency of qoi and qoy,\n");
+		printf("                   the corpus includes the --synthetic images if given\n");
 		printf("Examples\n");
 		printf("    qoybench 10 images/textures/\n");
 		printf("    qoybench 1 images/textures/ --nopng --nowarmup\n");
+		printf("    qoybench 5 images/ --threads 8\n");
+		printf("    qoybench 3 --synthetic 1024 --threads 4\n");
+		printf("    qoybench 3 images/ --nopng --json > results.json\n");
+		printf("    qoybench 5 --synthetic 4096 --nopng\n");
 		exit(1);
 	}
 
-	for (int i = 3; i < argc; i++) {
-		if (strcmp(argv[i], "--nowarmup") == 0) { opt_nowarmup = 1; }
-		else if (strcmp(argv[i], "--nopng") == 0) { opt_nopng = 1; }
-		else if (strcmp(argv[i], "--noverify") == 0) { opt_noverify = 1; }
-		else if (strcmp(argv[i], "--noencode") == 0) { opt_noencode = 1; }
-		else if (strcmp(argv[i], "--nodecode") == 0) { opt_nodecode = 1; }
-		else if (strcmp(argv[i], "--norecurse") == 0) { opt_norecurse = 1; }
-		else if (strcmp(argv[i], "--onlytotals") == 0) { opt_onlytotals = 1; }
-		else { ERROR("Unknown option %s", argv[i]); }
-	}
-
 	opt_runs = atoi(argv[1]);
 	if (opt_runs <=0) {
 		ERROR("Invalid number of runs %d", opt_runs);
 	}
 
+	if (opt_threads > 0) {
+		scaling_benchmark(path, opt_synthetic, opt_threads);
+		return 0;
+	}
+
+	if (opt_counters && perf_open() == 0) {
+		opt_counters = 0;
+	}
+
 	benchmark_result_t grand_total = {0};
-	benchmark_directory(argv[2], &grand_total);
+	if (path) {
+		benchmark_directory(path, &grand_total);
+	}
+	if (opt_synthetic > 0) {
+		benchmark_synthetic(opt_synthetic, &grand_total);
+	}
 
+	const char *total_path = path ? path : "synthetic";
 	if (grand_total.count > 0) {
-		printf("# Grand total for %s\n", argv[2]);
-		benchmark_print_result(grand_total);
+		benchmark_output("total", total_path, grand_total);
+		if (opt_output == OUTPUT_JSON) {
+			printf("\n]\n");
+		}
 	}
 	else {
-		printf("No images found in %s\n", argv[2]);
+		printf("No images found in %s\n", total_path);
 	}
 
 	return 0;
@@ -1,10 +1,10 @@
 /*
 
-Command line tool to convert between png <> qoy format
+Command line tool to convert between png, y4m, yuv, raw rgb(a) <> qoy format
 
 Requires "stb_image.h" and "stb_image_write.h"
 Compile with: 
-	gcc qoyconv.c -std=c99 -O3 -o qoyconv
+	gcc qoyconv.c -std=c99 -O3 -pthread -o qoyconv
 
 Dominic Szablewski - https://phoboslab.org
 Jorrit "Chainfire" Jongma
@@ -37,6 +37,11 @@ license to QOY as well.
 */
 
 
+// qoy_read and qoy_write memory map files with POSIX, which -std=c99 hides.
+// With glibc, qoy_write also needs fallocate from _GNU_SOURCE to map the file.
+#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #define STBI_NO_LINEAR
@@ -48,64 +53,1048 @@ license to QOY as well.
 #define QOY_IMPLEMENTATION
 #include "qoy.h"
 
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
-int main(int argc, char **argv) {
-	if (argc < 3) {
-		printf("Usage: qoyconv <infile> <outfile>\n");
-		printf("Examples:\n");
-		printf("  qoyconv input.png output.qoy\n");
-		printf("  qoyconv input.qoy output.png\n");
-		exit(1);
+#define STR_ENDS_WITH(S, E) (strlen(S) >= sizeof(E)-1 && strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+
+typedef struct {
+	long long files;
+	long long failed;
+	long long bytes_in;
+	long long bytes_out;
+	long long pixels;
+} convert_stats_t;
+
+// A decoded image, either RGB(A) pixels or QOY's interleaved YCbCr 4:2:0 (A)
+// blocks, see qoy.h
+typedef struct {
+	int width;
+	int height;
+	int channels;
+	int format;
+	void *pixels;
+} image_t;
+
+
+
+// -----------------------------------------------------------------------------
+// Files and streams
+
+// File formats, given with -i/-o or taken from the file extension
+#define FORMAT_UNKNOWN 0
+#define FORMAT_PNG     1
+#define FORMAT_QOY     2
+#define FORMAT_Y4M     3
+#define FORMAT_YUV     4
+#define FORMAT_RGB     5
+#define FORMAT_RGBA    6
+
+static const char *format_names[] = { "", "png", "qoy", "y4m", "yuv", "rgb", "rgba" };
+
+static int format_by_name(const char *name) {
+	for (int i = FORMAT_PNG; i <= FORMAT_RGBA; i++) {
+		if (strcmp(name, format_names[i]) == 0) {
+			return i;
+		}
 	}
+	return FORMAT_UNKNOWN;
+}
 
-	void *pixels = NULL;
-	int w, h, channels;
-	if (STR_ENDS_WITH(argv[1], ".png")) {
-		if(!stbi_info(argv[1], &w, &h, &channels)) {
-			printf("Couldn't read header %s\n", argv[1]);
-			exit(1);
+static int format_of_file(const char *filename) {
+	const char *ext = strrchr(filename, '.');
+	return ext ? format_by_name(ext + 1) : FORMAT_UNKNOWN;
+}
+
+#define IS_STDIO(S) (strcmp(S, "-") == 0)
+
+// Open a file, or stdin/stdout for "-"
+static FILE *open_file(const char *filename, const char *mode) {
+	if (IS_STDIO(filename)) {
+		return mode[0] == 'r' ? stdin : stdout;
+	}
+	return fopen(filename, mode);
+}
+
+// Close a file opened with open_file. Returns 0 on success, as fclose.
+static int close_file(FILE *f) {
+	if (f == stdin) {
+		return 0;
+	}
+	if (f == stdout) {
+		return fflush(f);
+	}
+	return fclose(f);
+}
+
+// Read and write callbacks for qoy_decoder_open, qoy_encoder_open and
+// stbi_write_png_to_func
+static int file_read(void *user, void *buffer, int size) {
+	size_t read = fread(buffer, 1, size, (FILE *)user);
+	return read == 0 && ferror((FILE *)user) ? -1 : (int)read;
+}
+
+static int file_write(void *user, const void *buffer, int size) {
+	return fwrite(buffer, 1, size, (FILE *)user) == (size_t)size ? 0 : -1;
+}
+
+static void file_write_func(void *context, void *data, int size) {
+	fwrite(data, 1, size, (FILE *)context);
+}
+
+// Read a whole file, or stdin, into memory
+static unsigned char *read_all(const char *filename, int *size) {
+	FILE *f = open_file(filename, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	int capacity = 1 << 16, len = 0, read;
+	unsigned char *data = malloc(capacity);
+	while (data && (read = fread(data + len, 1, capacity - len, f)) > 0) {
+		len += read;
+		if (len == capacity) {
+			unsigned char *grown = capacity <= 0x3fffffff ? realloc(data, capacity * 2) : NULL;
+			if (!grown) {
+				free(data);
+			}
+			data = grown;
+			capacity *= 2;
 		}
+	}
+	if (data && ferror(f)) {
+		free(data);
+		data = NULL;
+	}
+	close_file(f);
+	*size = len;
+	return data;
+}
 
-		// Force all odd encodings to be RGBA
-		if(channels != 3) {
-			channels = 4;
+
+
+// -----------------------------------------------------------------------------
+// Y4M and raw YUV
+
+// .y4m and .yuv hold planar YCbCr 4:2:0: a full size Y plane followed by the
+// Cb and Cr planes at half width and height (rounded up). QOY's blocks hold the
+// same samples interleaved, so both directions are lossless.
+//
+// Y4M has no 4:2:0 with alpha, alpha goes into a sidecar file next to it with
+// .alpha.y4m in place of .y4m, holding a single full size plane (Cmono). Raw
+// .yuv stores alpha as a fourth full size plane after Cr, as yuva420p.
+//
+// The samples are full range (C420jpeg, XCOLORRANGE=FULL), as defined by QOY's
+// conversion to and from RGB. Y4M input is taken as-is.
+//
+// There is no sidecar when reading from stdin or writing to stdout, Y4M output
+// drops the alpha channel then.
+
+static void planes_to_blocks(const unsigned char *y, const unsigned char *cb, const unsigned char *cr, const unsigned char *a, int w, int h, unsigned char *blocks) {
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	int size = a ? 10 : 6;
+	for (int by = 0; by < ch; by++) {
+		// Odd sizes repeat the last line and column, as qoy_rgba_to_ycbcra does
+		int y0 = by * 2, y1 = y0 + 1 < h ? y0 + 1 : y0;
+		for (int bx = 0; bx < cw; bx++, blocks += size) {
+			int x0 = bx * 2, x1 = x0 + 1 < w ? x0 + 1 : x0;
+			blocks[0] = y[y0 * w + x0];
+			blocks[1] = y[y1 * w + x0];
+			blocks[2] = y[y0 * w + x1];
+			blocks[3] = y[y1 * w + x1];
+			blocks[4] = cb[by * cw + bx];
+			blocks[5] = cr[by * cw + bx];
+			if (a) {
+				blocks[6] = a[y0 * w + x0];
+				blocks[7] = a[y1 * w + x0];
+				blocks[8] = a[y0 * w + x1];
+				blocks[9] = a[y1 * w + x1];
+			}
+		}
+	}
+}
+
+static void blocks_to_planes(const unsigned char *blocks, int w, int h, unsigned char *y, unsigned char *cb, unsigned char *cr, unsigned char *a) {
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	int size = a ? 10 : 6;
+	for (int by = 0; by < ch; by++) {
+		int y0 = by * 2, y1 = y0 + 1;
+		for (int bx = 0; bx < cw; bx++, blocks += size) {
+			int x0 = bx * 2, x1 = x0 + 1;
+			y[y0 * w + x0] = blocks[0];
+			if (y1 < h) y[y1 * w + x0] = blocks[1];
+			if (x1 < w) y[y0 * w + x1] = blocks[2];
+			if (y1 < h && x1 < w) y[y1 * w + x1] = blocks[3];
+			cb[by * cw + bx] = blocks[4];
+			cr[by * cw + bx] = blocks[5];
+			if (a) {
+				a[y0 * w + x0] = blocks[6];
+				if (y1 < h) a[y1 * w + x0] = blocks[7];
+				if (x1 < w) a[y0 * w + x1] = blocks[8];
+				if (y1 < h && x1 < w) a[y1 * w + x1] = blocks[9];
+			}
+		}
+	}
+}
+
+// Read the header and first FRAME line of a y4m file. Returns the number of
+// planes (1 = mono, 3 = 4:2:0) or 0 if the file isn't a supported y4m.
+static int y4m_read_header(FILE *f, int *w, int *h) {
+	char line[1024];
+	if (!fgets(line, sizeof(line), f) || strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+		return 0;
+	}
+
+	// Batch workers read headers concurrently, so strtok_r rather than strtok
+	int planes = 3;
+	*w = *h = 0;
+	char *save;
+	for (char *tag = strtok_r(line + 10, " \n", &save); tag; tag = strtok_r(NULL, " \n", &save)) {
+		if (tag[0] == 'W') *w = atoi(tag + 1);
+		else if (tag[0] == 'H') *h = atoi(tag + 1);
+		else if (tag[0] == 'I' && tag[1] != 'p' && tag[1] != '?') return 0;
+		else if (tag[0] == 'C') {
+			// Only 8-bit samples; C420p10, C420p12 etc. have 16-bit ones
+			if (strcmp(tag, "Cmono") == 0) planes = 1;
+			else if (
+				strcmp(tag, "C420") != 0 && strcmp(tag, "C420jpeg") != 0 &&
+				strcmp(tag, "C420paldv") != 0 && strcmp(tag, "C420mpeg2") != 0
+			) return 0;
 		}
+	}
+
+	if (*w <= 0 || *h <= 0 || (unsigned int)*h >= QOY_PIXELS_MAX / *w) {
+		return 0;
+	}
+	if (!fgets(line, sizeof(line), f) || strncmp(line, "FRAME", 5) != 0) {
+		return 0;
+	}
+	return planes;
+}
+
+// Name of the alpha sidecar of a y4m file, the caller frees it. "a.y4m" has
+// "a.alpha.y4m", names without the .y4m extension (-i y4m, -o y4m) get
+// ".alpha.y4m" appended.
+static char *y4m_alpha_name(const char *filename) {
+	size_t len = strlen(filename);
+	if (STR_ENDS_WITH(filename, ".y4m")) {
+		len -= 4;
+	}
+	char *name = malloc(len + sizeof(".alpha.y4m"));
+	if (name) {
+		memcpy(name, filename, len);
+		memcpy(name + len, ".alpha.y4m", sizeof(".alpha.y4m"));
+	}
+	return name;
+}
+
+// Load the first frame of a y4m file, and its alpha sidecar if there is one
+static int y4m_load(const char *filename, image_t *image) {
+	FILE *f = open_file(filename, "rb");
+	if (!f) {
+		return 0;
+	}
+
+	int w, h;
+	int planes = y4m_read_header(f, &w, &h);
+	if (planes != 3) {
+		close_file(f);
+		return 0;
+	}
 
-		pixels = (void *)stbi_load(argv[1], &w, &h, NULL, channels);
+	int luma = w * h, chroma = ((w + 1) / 2) * ((h + 1) / 2);
+	unsigned char *data = malloc(luma * 2 + chroma * 2);
+	if (!data || fread(data, 1, luma + chroma * 2, f) != (size_t)(luma + chroma * 2)) {
+		free(data);
+		close_file(f);
+		return 0;
 	}
-	else if (STR_ENDS_WITH(argv[1], ".qoy")) {
-		qoy_desc desc;
-		pixels = qoy_read(argv[1], &desc, 0);
+	close_file(f);
+
+	unsigned char *alpha = NULL;
+	char *alpha_name = IS_STDIO(filename) ? NULL : y4m_alpha_name(filename);
+	FILE *fa = alpha_name ? fopen(alpha_name, "rb") : NULL;
+	free(alpha_name);
+	if (fa) {
+		int aw, ah;
+		alpha = data + luma + chroma * 2;
+		if (
+			y4m_read_header(fa, &aw, &ah) != 1 || aw != w || ah != h ||
+			fread(alpha, 1, luma, fa) != (size_t)luma
+		) {
+			fprintf(stderr, "Invalid alpha sidecar for %s\n", filename);
+			free(data);
+			fclose(fa);
+			return 0;
+		}
+		fclose(fa);
+	}
+
+	image->width = w;
+	image->height = h;
+	image->channels = alpha ? 4 : 3;
+	image->format = QOY_FORMAT_YCBCR420A;
+	image->pixels = malloc(qoy_ycbcra_size(w, h, image->channels));
+	if (image->pixels) {
+		planes_to_blocks(data, data + luma, data + luma + chroma, alpha, w, h, image->pixels);
+	}
+	free(data);
+	return image->pixels != NULL;
+}
+
+// Load a raw yuv420p (3 channels) or yuva420p (4 channels) file, which has no
+// header; the size must be given and the channels follow from the file size.
+static int yuv_load(const char *filename, int w, int h, image_t *image) {
+	if (w <= 0 || h <= 0 || (unsigned int)h >= QOY_PIXELS_MAX / w) {
+		fprintf(stderr, "Raw .yuv input needs --size WxH\n");
+		return 0;
+	}
+
+	FILE *f = open_file(filename, "rb");
+	if (!f) {
+		return 0;
+	}
+
+	int luma = w * h, chroma = ((w + 1) / 2) * ((h + 1) / 2);
+	unsigned char *data = malloc(luma * 2 + chroma * 2 + 1);
+	int size = data ? (int)fread(data, 1, luma * 2 + chroma * 2 + 1, f) : 0;
+	close_file(f);
+
+	int channels = size == luma + chroma * 2 ? 3 : size == luma * 2 + chroma * 2 ? 4 : 0;
+	if (!channels) {
+		fprintf(stderr, "Size of %s doesn't match yuv420p or yuva420p %dx%d\n", filename, w, h);
+		free(data);
+		return 0;
+	}
+
+	image->width = w;
+	image->height = h;
+	image->channels = channels;
+	image->format = QOY_FORMAT_YCBCR420A;
+	image->pixels = malloc(qoy_ycbcra_size(w, h, channels));
+	if (image->pixels) {
+		planes_to_blocks(data, data + luma, data + luma + chroma, channels == 4 ? data + luma + chroma * 2 : NULL, w, h, image->pixels);
+	}
+	free(data);
+	return image->pixels != NULL;
+}
+
+static void y4m_write_header(FILE *f, int w, int h) {
+	fprintf(f, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\nFRAME\n", w, h);
+}
+
+// Write the alpha sidecar of a .y4m file, nothing for stdout
+static int y4m_write_alpha(const char *filename, const unsigned char *alpha, int w, int h) {
+	if (IS_STDIO(filename)) {
+		return 1;
+	}
+
+	char *alpha_name = y4m_alpha_name(filename);
+	FILE *f = alpha_name ? fopen(alpha_name, "wb") : NULL;
+	free(alpha_name);
+	if (!f) {
+		return 0;
+	}
+	fprintf(f, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 Cmono XCOLORRANGE=FULL\nFRAME\n", w, h);
+	int written = fwrite(alpha, 1, w * h, f) == (size_t)(w * h);
+	return fclose(f) == 0 && written;
+}
+
+// Write the planes of a YCbCr image as .y4m (and its alpha sidecar) or .yuv
+static int yuv_write(const char *filename, const image_t *image, int y4m) {
+	int w = image->width, h = image->height;
+	int luma = w * h, chroma = ((w + 1) / 2) * ((h + 1) / 2);
+	unsigned char *data = malloc(luma * 2 + chroma * 2);
+	if (!data) {
+		return 0;
+	}
+	unsigned char *alpha = image->channels == 4 ? data + luma + chroma * 2 : NULL;
+	blocks_to_planes(image->pixels, w, h, data, data + luma, data + luma + chroma, alpha);
+
+	int written = 0;
+	FILE *f = open_file(filename, "wb");
+	if (f) {
+		if (y4m) {
+			y4m_write_header(f, w, h);
+		}
+		int size = y4m || !alpha ? luma + chroma * 2 : luma * 2 + chroma * 2;
+		written = fwrite(data, 1, size, f) == (size_t)size;
+		written = close_file(f) == 0 && written;
+	}
+
+	if (written && y4m && alpha) {
+		written = y4m_write_alpha(filename, alpha, w, h);
+	}
+
+	free(data);
+	return written;
+}
+
+
+
+// -----------------------------------------------------------------------------
+// Conversion
+
+typedef struct {
+	int width;
+	int height;
+	int in_format;
+	int out_format;
+} convert_options_t;
+
+// Decode a .qoy file, or stdin, to the given format. Files are read with
+// qoy_read when decoding to RGB(A), which maps them into memory, anything else
+// is decoded two lines at a time as it is read.
+static int qoy_load(const char *filename, int format, image_t *image) {
+	qoy_desc desc;
+	image->format = format;
+	if (format == QOY_FORMAT_RGBA && !IS_STDIO(filename)) {
+		image->pixels = qoy_read(filename, &desc, 0);
+		image->width = desc.width;
+		image->height = desc.height;
+		image->channels = desc.channels;
+		return image->pixels != NULL;
+	}
+
+	FILE *f = open_file(filename, "rb");
+	qoy_decoder *decoder = f ? qoy_decoder_open(file_read, f, &desc, 0, format) : NULL;
+	if (!decoder) {
+		if (f) close_file(f);
+		return 0;
+	}
+
+	image->width = desc.width;
+	image->height = desc.height;
+	image->channels = desc.channels;
+	int line_size = format == QOY_FORMAT_YCBCR420A ? qoy_ycbcra_size(desc.width, 2, desc.channels) / 2 : desc.width * desc.channels;
+	image->pixels = malloc(format == QOY_FORMAT_YCBCR420A ? qoy_ycbcra_size(desc.width, desc.height, desc.channels) : desc.width * desc.height * desc.channels);
+
+	// Row pairs of YCbCr blocks take two lines worth of bytes
+	int y = 0, lines = 0;
+	while (image->pixels && (lines = qoy_decoder_lines(decoder, (unsigned char *)image->pixels + y * line_size)) > 0) {
+		y += lines;
+	}
+	qoy_decoder_close(decoder);
+	close_file(f);
+
+	if (lines < 0) {
+		free(image->pixels);
+		image->pixels = NULL;
+	}
+	return image->pixels != NULL;
+}
+
+// Encode an image to a .qoy file, or stdout. RGB(A) files are written with
+// qoy_write, which encodes straight into a memory mapping of the file, anything
+// else is encoded two lines at a time and written as it goes.
+static int qoy_save(const char *filename, const image_t *image) {
+	qoy_desc desc = {
+		.width = image->width,
+		.height = image->height,
+		.channels = image->channels,
+		.colorspace = QOY_COLORSPACE_SRGB
+	};
+	if (image->format == QOY_FORMAT_RGBA && !IS_STDIO(filename)) {
+		return qoy_write(filename, image->pixels, &desc);
+	}
+
+	FILE *f = open_file(filename, "wb");
+	qoy_encoder *encoder = f ? qoy_encoder_open(file_write, f, &desc, image->channels, image->format, NULL) : NULL;
+	if (!encoder) {
+		if (f) close_file(f);
+		return 0;
+	}
+
+	int line_size = image->format == QOY_FORMAT_YCBCR420A ? qoy_ycbcra_size(image->width, 2, image->channels) / 2 : image->width * image->channels;
+	int encoded = 1;
+	for (int y = 0; y < image->height && encoded; y += 2) {
+		encoded = qoy_encoder_lines(encoder, (const unsigned char *)image->pixels + y * line_size) == 0;
+	}
+	encoded = qoy_encoder_close(encoder) > 0 && encoded;
+	return close_file(f) == 0 && encoded;
+}
+
+// Decode .qoy to raw RGB(A), .y4m or .yuv two lines at a time, as it is read
+// and written. RGB(A) needs a buffer for two lines. Y4M and YUV store the whole
+// Y plane first, only the Cb, Cr (and A) planes that follow it are kept until
+// the end.
+static int qoy_to_raw(const char *infile, const char *outfile, int out_format, image_t *image) {
+	int planar = out_format == FORMAT_Y4M || out_format == FORMAT_YUV;
+	int channels = out_format == FORMAT_RGB ? 3 : out_format == FORMAT_RGBA ? 4 : 0;
+
+	qoy_desc desc;
+	FILE *in = open_file(infile, "rb");
+	qoy_decoder *decoder = in ? qoy_decoder_open(file_read, in, &desc, channels, planar ? QOY_FORMAT_YCBCR420A : QOY_FORMAT_RGBA) : NULL;
+	if (!decoder) {
+		if (in) close_file(in);
+		return 0;
+	}
+	if (!channels) {
 		channels = desc.channels;
-		w = desc.width;
-		h = desc.height;
 	}
 
-	if (pixels == NULL) {
-		printf("Couldn't load/decode %s\n", argv[1]);
-		exit(1);
+	int w = desc.width, h = desc.height;
+	int luma = w * h, cw = (w + 1) / 2, chroma = cw * ((h + 1) / 2);
+	int lines_size = planar ? qoy_ycbcra_size(w, 2, channels) + w * 2 : w * channels * 2;
+	unsigned char *lines = malloc(lines_size);
+	unsigned char *planes = planar ? malloc(chroma * 2 + (channels == 4 ? luma : 0)) : NULL;
+	unsigned char *alpha = planes && channels == 4 ? planes + chroma * 2 : NULL;
+	FILE *out = lines && (planes || !planar) ? open_file(outfile, "wb") : NULL;
+
+	int written = out != NULL, count = 0;
+	if (out && out_format == FORMAT_Y4M) {
+		y4m_write_header(out, w, h);
+	}
+	for (int y = 0; written && (count = qoy_decoder_lines(decoder, lines)) > 0; y += count) {
+		if (planar) {
+			unsigned char *luma_lines = lines + qoy_ycbcra_size(w, 2, channels);
+			blocks_to_planes(lines, w, count, luma_lines, planes + (y / 2) * cw, planes + chroma + (y / 2) * cw, alpha ? alpha + y * w : NULL);
+			written = fwrite(luma_lines, 1, w * count, out) == (size_t)(w * count);
+		}
+		else {
+			written = fwrite(lines, 1, w * channels * count, out) == (size_t)(w * channels * count);
+		}
+	}
+	written = written && count == 0;
+
+	if (written && planar) {
+		int size = out_format == FORMAT_YUV && alpha ? chroma * 2 + luma : chroma * 2;
+		written = fwrite(planes, 1, size, out) == (size_t)size;
+	}
+	if (out) {
+		written = close_file(out) == 0 && written;
+	}
+	if (written && out_format == FORMAT_Y4M && alpha) {
+		written = y4m_write_alpha(outfile, alpha, w, h);
+	}
+
+	qoy_decoder_close(decoder);
+	close_file(in);
+	free(lines);
+	free(planes);
+	image->width = w;
+	image->height = h;
+	return written;
+}
+
+// Encode raw RGB(A) to .qoy two lines at a time, as it is read and written.
+// Raw input has no header, the size must be given.
+static int raw_to_qoy(const char *infile, const char *outfile, int channels, const convert_options_t *options, image_t *image) {
+	int w = options->width, h = options->height;
+	if (w <= 0 || h <= 0 || (unsigned int)h >= QOY_PIXELS_MAX / w) {
+		fprintf(stderr, "Raw input needs --size WxH\n");
+		return 0;
+	}
+
+	FILE *in = open_file(infile, "rb");
+	if (!in) {
+		return 0;
+	}
+	FILE *out = open_file(outfile, "wb");
+	qoy_encoder *encoder = out ? qoy_encoder_open(file_write, out, &(qoy_desc){
+		.width = w,
+		.height = h,
+		.channels = channels,
+		.colorspace = QOY_COLORSPACE_SRGB
+	}, channels, QOY_FORMAT_RGBA, NULL) : NULL;
+	unsigned char *lines = malloc(w * channels * 2);
+
+	int encoded = encoder && lines;
+	for (int y = 0; y < h && encoded; y += 2) {
+		int size = w * channels * (h - y < 2 ? 1 : 2);
+		encoded =
+			fread(lines, 1, size, in) == (size_t)size &&
+			qoy_encoder_lines(encoder, lines) == 0;
+	}
+	encoded = qoy_encoder_close(encoder) > 0 && encoded;
+	if (out) {
+		encoded = close_file(out) == 0 && encoded;
+	}
+
+	close_file(in);
+	free(lines);
+	image->width = w;
+	image->height = h;
+	return encoded;
+}
+
+// Load raw RGB(A) with the size given
+static int raw_load(const char *filename, int channels, const convert_options_t *options, image_t *image) {
+	int w = options->width, h = options->height;
+	if (w <= 0 || h <= 0 || (unsigned int)h >= QOY_PIXELS_MAX / w) {
+		fprintf(stderr, "Raw input needs --size WxH\n");
+		return 0;
+	}
+
+	FILE *f = open_file(filename, "rb");
+	if (!f) {
+		return 0;
+	}
+	int size = w * h * channels;
+	image->width = w;
+	image->height = h;
+	image->channels = channels;
+	image->format = QOY_FORMAT_RGBA;
+	image->pixels = malloc(size);
+	if (image->pixels && fread(image->pixels, 1, size, f) != (size_t)size) {
+		free(image->pixels);
+		image->pixels = NULL;
+	}
+	close_file(f);
+	return image->pixels != NULL;
+}
+
+// Write RGB(A) pixels as raw RGB(A), adding or dropping alpha as needed
+static int raw_write(const char *filename, const image_t *image, int channels) {
+	FILE *f = open_file(filename, "wb");
+	if (!f) {
+		return 0;
+	}
+
+	int written = 1;
+	if (image->channels == channels) {
+		int size = image->width * image->height * channels;
+		written = fwrite(image->pixels, 1, size, f) == (size_t)size;
+	}
+	else {
+		const unsigned char *in = image->pixels;
+		unsigned char *line = malloc(image->width * channels);
+		written = line != NULL;
+		for (int y = 0; y < image->height && written; y++) {
+			for (int x = 0; x < image->width; x++, in += image->channels) {
+				memcpy(line + x * channels, in, 3);
+				if (channels == 4) line[x * 4 + 3] = 255;
+			}
+			written = fwrite(line, 1, image->width * channels, f) == (size_t)(image->width * channels);
+		}
+		free(line);
+	}
+	return close_file(f) == 0 && written;
+}
+
+// Convert through a whole image in memory
+static int convert_image(const char *infile, int in_format, const char *outfile, int out_format, const convert_options_t *options, image_t *image) {
+	// .y4m and .yuv are YCbCr, decoding .qoy to those skips RGB entirely
+	int out_yuv = out_format == FORMAT_Y4M || out_format == FORMAT_YUV;
+
+	int loaded = 0;
+	if (in_format == FORMAT_PNG) {
+		int size;
+		unsigned char *data = read_all(infile, &size);
+		if(!data || !stbi_info_from_memory(data, size, &image->width, &image->height, &image->channels)) {
+			fprintf(stderr, "Couldn't read header %s\n", infile);
+			free(data);
+			return 0;
+		}
+
+		// Force all odd encodings to be RGBA
+		if(image->channels != 3) {
+			image->channels = 4;
+		}
+
+		image->format = QOY_FORMAT_RGBA;
+		image->pixels = (void *)stbi_load_from_memory(data, size, &image->width, &image->height, NULL, image->channels);
+		loaded = image->pixels != NULL;
+		free(data);
+	}
+	else if (in_format == FORMAT_QOY) {
+		loaded = qoy_load(infile, out_yuv ? QOY_FORMAT_YCBCR420A : QOY_FORMAT_RGBA, image);
+	}
+	else if (in_format == FORMAT_Y4M) {
+		loaded = y4m_load(infile, image);
+	}
+	else if (in_format == FORMAT_YUV) {
+		loaded = yuv_load(infile, options->width, options->height, image);
+	}
+	else if (in_format == FORMAT_RGB || in_format == FORMAT_RGBA) {
+		loaded = raw_load(infile, in_format == FORMAT_RGB ? 3 : 4, options, image);
+	}
+
+	if (!loaded) {
+		fprintf(stderr, "Couldn't load/decode %s\n", infile);
+		return 0;
+	}
+
+	// .png and raw need RGB(A), .y4m and .yuv need YCbCr(A), .qoy takes either
+	int format = out_yuv ? QOY_FORMAT_YCBCR420A : out_format == FORMAT_QOY ? image->format : QOY_FORMAT_RGBA;
+	if (format != image->format) {
+		void *converted;
+		if (format == QOY_FORMAT_RGBA) {
+			converted = malloc(image->width * image->height * image->channels);
+			if (converted) qoy_ycbcra_to_rgba(image->pixels, image->width, image->height, image->channels, image->channels, converted);
+		}
+		else {
+			converted = malloc(qoy_ycbcra_size(image->width, image->height, image->channels));
+			if (converted) qoy_rgba_to_ycbcra(image->pixels, image->width, image->height, image->channels, image->channels, converted);
+		}
+		free(image->pixels);
+		image->pixels = converted;
+		image->format = format;
+		if (!converted) {
+			fprintf(stderr, "Couldn't convert %s\n", infile);
+			return 0;
+		}
 	}
 
 	int encoded = 0;
-	if (STR_ENDS_WITH(argv[2], ".png")) {
-		encoded = stbi_write_png(argv[2], w, h, channels, pixels, 0);
+	if (out_format == FORMAT_PNG && IS_STDIO(outfile)) {
+		encoded = stbi_write_png_to_func(file_write_func, stdout, image->width, image->height, image->channels, image->pixels, 0);
+		encoded = fflush(stdout) == 0 && encoded;
 	}
-	else if (STR_ENDS_WITH(argv[2], ".qoy")) {
-		encoded = qoy_write(argv[2], pixels, &(qoy_desc){
-			.width = w,
-			.height = h,
-			.channels = channels,
-			.colorspace = QOY_COLORSPACE_SRGB
-		});
+	else if (out_format == FORMAT_PNG) {
+		encoded = stbi_write_png(outfile, image->width, image->height, image->channels, image->pixels, 0);
 	}
+	else if (out_format == FORMAT_QOY) {
+		encoded = qoy_save(outfile, image);
+	}
+	else if (out_yuv) {
+		encoded = yuv_write(outfile, image, out_format == FORMAT_Y4M);
+	}
+	else {
+		encoded = raw_write(outfile, image, out_format == FORMAT_RGB ? 3 : 4);
+	}
+	free(image->pixels);
 
 	if (!encoded) {
-		printf("Couldn't write/encode %s\n", argv[2]);
-		exit(1);
+		fprintf(stderr, "Couldn't write/encode %s\n", outfile);
+		return 0;
 	}
+	return 1;
+}
+
+// Convert between .png, .qoy, .y4m, .yuv and raw .rgb/.rgba, as given in the
+// options or by the file extensions; "-" is stdin or stdout. Returns 1 on
+// success, 0 on failure after printing the reason.
+static int convert(const char *infile, const char *outfile, const convert_options_t *options, convert_stats_t *stats) {
+	int in_format = options->in_format ? options->in_format : format_of_file(infile);
+	int out_format = options->out_format ? options->out_format : format_of_file(outfile);
+	if (!in_format || !out_format) {
+		fprintf(stderr, "Unknown format for %s, use -i/-o\n", in_format ? outfile : infile);
+		return 0;
+	}
+
+	// QOY is streamed to and from the raw formats, so the whole image is never
+	// held in memory, everything else is converted as a whole
+	image_t image = {0};
+	int converted;
+	if (in_format == FORMAT_QOY && (out_format == FORMAT_Y4M || out_format == FORMAT_YUV || out_format == FORMAT_RGB || out_format == FORMAT_RGBA)) {
+		converted = qoy_to_raw(infile, outfile, out_format, &image);
+		if (!converted) fprintf(stderr, "Couldn't decode %s to %s\n", infile, outfile);
+	}
+	else if ((in_format == FORMAT_RGB || in_format == FORMAT_RGBA) && out_format == FORMAT_QOY) {
+		converted = raw_to_qoy(infile, outfile, in_format == FORMAT_RGB ? 3 : 4, options, &image);
+		if (!converted) fprintf(stderr, "Couldn't encode %s to %s\n", infile, outfile);
+	}
+	else {
+		converted = convert_image(infile, in_format, outfile, out_format, options, &image);
+	}
+	if (!converted) {
+		return 0;
+	}
+
+	if (stats) {
+		struct stat st;
+		if (stat(infile, &st) == 0) stats->bytes_in += st.st_size;
+		if (stat(outfile, &st) == 0) stats->bytes_out += st.st_size;
+		stats->pixels += (long long)image.width * image.height;
+	}
+	return 1;
+}
+
+
+
+// -----------------------------------------------------------------------------
+// Batch mode
+
+// The input files are either the entries of a directory, or the lines of a
+// list file (or stdin). Workers take the next file from the shared source one
+// at a time, so neither is read up front.
+typedef struct {
+	pthread_mutex_t lock;
+	DIR *dir;
+	const char *dir_path;
+	FILE *list;
+	const char *out_dir;
+	const char *out_ext;
+	convert_options_t options;
+	convert_stats_t total;
+
+	// Hash set of the output files claimed so far, see batch_claim
+	char **outputs;
+	int outputs_size;
+	int outputs_count;
+} batch_t;
 
-	free(pixels);
+#define IS_IMAGE(S) ( \
+	STR_ENDS_WITH(S, ".png") || STR_ENDS_WITH(S, ".qoy") || \
+	(STR_ENDS_WITH(S, ".y4m") && !STR_ENDS_WITH(S, ".alpha.y4m")) || \
+	STR_ENDS_WITH(S, ".yuv") \
+)
+
+// Get the next input file into path, skipping anything that isn't an image
+// qoyconv can read (or is an alpha sidecar). Returns 0 when there are no more
+// files.
+static int batch_next(batch_t *batch, char *path, int size) {
+	int found = 0;
+	pthread_mutex_lock(&batch->lock);
+	while (!found) {
+		if (batch->dir) {
+			struct dirent *file = readdir(batch->dir);
+			if (!file) {
+				break;
+			}
+			snprintf(path, size, "%s/%s", batch->dir_path, file->d_name);
+		}
+		else {
+			if (!fgets(path, size, batch->list)) {
+				break;
+			}
+			path[strcspn(path, "\r\n")] = '\0';
+		}
+		found = IS_IMAGE(path);
+	}
+	pthread_mutex_unlock(&batch->lock);
+	return found;
+}
+
+static unsigned int str_hash(const char *s) {
+	unsigned int hash = 2166136261u;
+	for (; *s; s++) {
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
+	}
+	return hash;
+}
+
+// Insert name into the hash set of output files unless it is there already
+static int batch_outputs_insert(batch_t *batch, char *name) {
+	unsigned int mask = batch->outputs_size - 1;
+	for (unsigned int i = str_hash(name) & mask; ; i = (i + 1) & mask) {
+		if (!batch->outputs[i]) {
+			batch->outputs[i] = name;
+			batch->outputs_count++;
+			return 1;
+		}
+		if (strcmp(batch->outputs[i], name) == 0) {
+			return 0;
+		}
+	}
+}
+
+// Claim an output file for one input. Inputs with the same name in different
+// directories map to the same output file, which two workers would otherwise
+// write (and on failure delete) at the same time. Returns 0 if another input
+// claimed it first, or if malloc failed.
+static int batch_claim(batch_t *batch, const char *outfile) {
+	int claimed = 0;
+	pthread_mutex_lock(&batch->lock);
+	if (batch->outputs_count * 2 >= batch->outputs_size) {
+		int size = batch->outputs_size ? batch->outputs_size * 2 : 256;
+		char **outputs = calloc(size, sizeof(char *));
+		if (outputs) {
+			char **old = batch->outputs;
+			int old_size = batch->outputs_size;
+			batch->outputs = outputs;
+			batch->outputs_size = size;
+			batch->outputs_count = 0;
+			for (int i = 0; i < old_size; i++) {
+				if (old[i]) batch_outputs_insert(batch, old[i]);
+			}
+			free(old);
+		}
+	}
+	size_t len = strlen(outfile) + 1;
+	char *name = batch->outputs_count * 2 < batch->outputs_size ? malloc(len) : NULL;
+	if (name) {
+		memcpy(name, outfile, len);
+		claimed = batch_outputs_insert(batch, name);
+		if (!claimed) {
+			free(name);
+		}
+	}
+	pthread_mutex_unlock(&batch->lock);
+	return claimed;
+}
+
+static void *batch_worker(void *arg) {
+	batch_t *batch = (batch_t *)arg;
+	convert_stats_t stats = {0};
+	char infile[4096], outfile[4096 + 256];
+
+	while (batch_next(batch, infile, sizeof(infile))) {
+		// out_dir/name.png -> out_dir/name.qoy, .qoy -> .png unless another
+		// output format was asked for
+		const char *name = strrchr(infile, '/');
+		name = name ? name + 1 : infile;
+		int len = strlen(name) - 4;
+		const char *ext = batch->out_ext ? batch->out_ext : STR_ENDS_WITH(name, ".qoy") ? "png" : "qoy";
+		snprintf(outfile, sizeof(outfile), "%s/%.*s.%s", batch->out_dir, len, name, ext);
+
+		stats.files++;
+		if (!batch_claim(batch, outfile)) {
+			fprintf(stderr, "Skipping %s, another input already writes %s\n", infile, outfile);
+			stats.failed++;
+		}
+		else if (!convert(infile, outfile, &batch->options, &stats)) {
+			stats.failed++;
+		}
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	batch->total.files += stats.files;
+	batch->total.failed += stats.failed;
+	batch->total.bytes_in += stats.bytes_in;
+	batch->total.bytes_out += stats.bytes_out;
+	batch->total.pixels += stats.pixels;
+	pthread_mutex_unlock(&batch->lock);
+	return NULL;
+}
+
+static double seconds() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec + spec.tv_nsec * 1e-9;
+}
+
+static int batch_convert(const char *input, const char *out_dir, const char *out_ext, const convert_options_t *options, int threads) {
+	batch_t batch = {0};
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.out_dir = out_dir;
+	batch.out_ext = out_ext;
+	batch.options = *options;
+
+	struct stat st;
+	if (strcmp(input, "-") == 0) {
+		batch.list = stdin;
+	}
+	else if (stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+		batch.dir = opendir(input);
+		batch.dir_path = input;
+	}
+	else {
+		batch.list = fopen(input, "r");
+	}
+	if (!batch.dir && !batch.list) {
+		fprintf(stderr, "Couldn't open %s\n", input);
+		return 0;
+	}
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0) threads = 1;
+	}
+
+	double time_start = seconds();
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	int started = 0;
+	for (; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, batch_worker, &batch) != 0) {
+			break;
+		}
+	}
+	if (started == 0) {
+		batch_worker(&batch);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	double time = seconds() - time_start;
+	free(workers);
+
+	if (batch.dir) closedir(batch.dir);
+	if (batch.list && batch.list != stdin) fclose(batch.list);
+	pthread_mutex_destroy(&batch.lock);
+	for (int i = 0; i < batch.outputs_size; i++) {
+		free(batch.outputs[i]);
+	}
+	free(batch.outputs);
+
+	convert_stats_t *t = &batch.total;
+	printf(
+		"%lld files (%lld failed) in %.2fs with %d threads\n"
+		"%.1f files/s, %.1f MB/s in, %.1f MB/s out, %.1f mpps\n",
+		t->files, t->failed, time, started ? started : 1,
+		t->files / time, t->bytes_in / time / 1e6, t->bytes_out / time / 1e6, t->pixels / time / 1e6
+	);
+	return t->failed == 0;
+}
+
+static void usage() {
+	printf("Usage: qoyconv [options] <infile> <outfile>\n");
+	printf("       qoyconv --batch <dir|listfile|-> <outdir> [options]\n");
+	printf("Formats follow the file extensions, or -i/-o: png, qoy, y4m (4:2:0, alpha in a\n");
+	printf("name.alpha.y4m sidecar), yuv (raw yuv420p or yuva420p) and rgb/rgba (raw\n");
+	printf("interleaved pixels). Y4M and YUV map onto QOY's YCbCr directly and convert\n");
+	printf("losslessly to and from it.\n");
+	printf("A file name of - reads from stdin or writes to stdout, for use in pipes. QOY\n");
+	printf("to y4m, yuv, rgb and rgba, and rgb and rgba to QOY are converted two lines\n");
+	printf("at a time as the data comes in, without holding the whole image in memory.\n");
+	printf("Batch mode converts every image in a directory, or listed one per line in\n");
+	printf("a file or on stdin (-), into outdir using a pool of threads, then prints\n");
+	printf("the throughput.\n");
+	printf("Options:\n");
+	printf("    -i FMT ....... input format (png, qoy, y4m, yuv, rgb, rgba)\n");
+	printf("    -o FMT ....... output format\n");
+	printf("    --size WxH ... size of raw yuv, rgb and rgba input\n");
+	printf("    --threads N .. batch worker threads (default: one per CPU)\n");
+	printf("    --to EXT ..... batch output format (default: qoy, png for .qoy input)\n");
+	printf("Examples:\n");
+	printf("  qoyconv input.png output.qoy\n");
+	printf("  qoyconv input.qoy output.png\n");
+	printf("  qoyconv input.yuv output.qoy --size 1920x1080\n");
+	printf("  curl -s https://example.com/a.png | qoyconv -i png -o qoy - - > a.qoy\n");
+	printf("  qoyconv -o rgba huge.qoy - | consumer\n");
+	printf("  find images/ -name '*.png' | qoyconv --batch - out/ --threads 8\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+	const char *files[2];
+	int file_count = 0;
+
+	convert_options_t options = {0};
+	const char *out_ext = NULL;
+	int threads = 0;
+	for (int i = batch ? 2 : 1; i < argc; i++) {
+		if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) {
+				fprintf(stderr, "Invalid size %s\n", argv[i]);
+				exit(1);
+			}
+		}
+		else if (!batch && (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "-o") == 0) && i + 1 < argc) {
+			int format = format_by_name(argv[i + 1]);
+			if (!format) {
+				fprintf(stderr, "Unknown format %s\n", argv[i + 1]);
+				exit(1);
+			}
+			*(argv[i][1] == 'i' ? &options.in_format : &options.out_format) = format;
+			i++;
+		}
+		else if (batch && strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { threads = atoi(argv[++i]); }
+		else if (batch && strcmp(argv[i], "--to") == 0 && i + 1 < argc) { out_ext = argv[++i]; }
+		else if ((argv[i][0] != '-' || IS_STDIO(argv[i])) && file_count < 2) {
+			files[file_count++] = argv[i];
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			exit(1);
+		}
+	}
+	if (file_count < 2) {
+		usage();
+	}
+
+	if (batch) {
+		return batch_convert(files[0], files[1], out_ext, &options, threads) ? 0 : 1;
+	}
+
+	if (!convert(files[0], files[1], &options, NULL)) {
+		exit(1);
+	}
 	return 0;
 }